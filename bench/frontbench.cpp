@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "ast.hpp"
+#include "astcache.hpp"
+#include "codegen.hpp"
+#include "fold.hpp"
+#include "incremental.hpp"
+#include "lexer.hpp"
+#include "log.hpp"
+#include "parser.hpp"
+
+/**
+  * フロントエンドのスループット計測
+  * 入力ファイルごとにLexicalAnalysis, Parser::parse, ASTCacheの書き出し・読み込み（save, load）,
+  * IncrementalParserの編集（edit: 代入の右辺の前に空白を入れて消す）,
+  * ASTの走査（木をたどるwalk, ノード配列を順に読むscan）, ConstantFolder::fold,
+  * CodeGen::generate（畳み込みなし・あり、SSAモード）を別々に計測し、
+  * CSV（file,bytes,phase,seconds,items,unit,items_per_sec,peak_rss_kb,allocs）を標準出力に書き出す
+  * allocsは計測区間内のoperator newの呼び出し回数、astフェーズのitemsはASTの大きさ（バイト）、
+  * ir・ir.fold・ir.ssaフェーズのitemsは生成したIRの命令数
+  * 読み込んだASTが構文解析したASTと一致しない、または編集後の診断・ASTが全体を解析し直したものと
+  * 一致しなければエラーにする
+  *
+  * 使い方: frontbench [-r 回数] ファイル...
+  *   各フェーズを指定回数（既定3回）実行し、最短時間を採る
+  */
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+  * ヒープ確保の回数を数える（計測は単一スレッドで行う）
+  */
+static size_t Allocations = 0;
+
+void *operator new(size_t size) {
+  Allocations++;
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  abort();   // 例外は使えない
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static double seconds(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static long peakRSS() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;   // KB
+}
+
+static void report(const char *file, size_t bytes, const char *phase, double sec, size_t items,
+                   const char *unit, size_t allocs) {
+  printf("%s,%zu,%s,%.6f,%zu,%s,%.0f,%ld,%zu\n", file, bytes, phase, sec, items, unit,
+         sec > 0 ? items / sec : 0.0, peakRSS(), allocs);
+  fflush(stdout);
+}
+
+/**
+  * ASTのノード数を数える
+  */
+class NodeCounter : public ASTVisitor<NodeCounter, size_t> {
+public:
+  size_t count(BaseStmtAST stmt) { return stmt ? visit(stmt) : 0; }
+  size_t count(BaseExpAST exp) { return exp ? visit(exp) : 0; }
+
+  size_t block(BlockAST block) {
+    size_t n = 1;
+    n += block.getConstant() ? 1 : 0;
+    n += block.getVariable() ? 1 : 0;
+    for (auto func : block.getFunctions())
+      n += 1 + this->block(func.getBlock());
+    return n + count(block.getStatement());
+  }
+
+  size_t visitStmt(BaseStmtAST) { return 1; }
+  size_t visitExp(BaseExpAST) { return 1; }
+
+  size_t visitAssign(AssignAST stmt) { return 1 + count(stmt.getRHS()); }
+  size_t visitBeginEnd(BeginEndAST stmt) {
+    size_t n = 1;
+    for (auto child : stmt.getStatements())
+      n += count(child);
+    return n;
+  }
+  size_t visitIfThen(IfThenAST stmt) {
+    return 1 + count(stmt.getCondition()) + count(stmt.getStatement());
+  }
+  size_t visitWhileDo(WhileDoAST stmt) {
+    return 1 + count(stmt.getCondition()) + count(stmt.getStatement());
+  }
+  size_t visitReturn(ReturnAST stmt) { return 1 + count(stmt.getExpression()); }
+  size_t visitWrite(WriteAST stmt) { return 1 + count(stmt.getExpression()); }
+
+  size_t visitCondExp(CondExpAST exp) { return 1 + count(exp.getLHS()) + count(exp.getRHS()); }
+  size_t visitBinaryExpr(BinaryExprAST exp) { return 1 + count(exp.getLHS()) + count(exp.getRHS()); }
+  size_t visitCallExpr(CallExprAST exp) {
+    size_t n = 1;
+    for (auto arg : exp.getArgs())
+      n += count(arg);
+    return n;
+  }
+};
+
+/**
+  * 2つのASTが同じか（ノード・リスト・宣言・識別子表を比べる）
+  */
+static bool sameAST(const ProgramAST &a, const ProgramAST &b) {
+  const ASTContext &x = a.getContext(), &y = b.getContext();
+  if (a.getBlock().getIndex() != b.getBlock().getIndex() || x.getNumNodes() != y.getNumNodes() ||
+      x.getLists() != y.getLists() || x.getDecls() != y.getDecls())
+    return false;
+  if (memcmp(x.getNodes().data(), y.getNodes().data(), x.getNumNodes() * sizeof(ASTNode)))
+    return false;
+  const StringInterner &n = *a.getNames(), &m = *b.getNames();
+  if (n.size() != m.size())
+    return false;
+  for (size_t i = 0; i < n.size(); i++)
+    if (n.get(i) != m.get(i))
+      return false;
+  return true;
+}
+
+/**
+  * IRの命令数
+  */
+static size_t countInstructions(const llvm::Module &module) {
+  size_t n = 0;
+  for (auto &func : module)
+    for (auto &bb : func)
+      n += bb.size();
+  return n;
+}
+
+static std::unique_ptr<ProgramAST> parseFile(const char *file, double &sec, size_t &allocs) {
+  Parser parser(file, false, LEXER_BUFFER);   // 字句解析はここで済ませておく
+  size_t before = Allocations;
+  auto start = Clock::now();
+  bool ok = parser.parse();
+  sec = seconds(start);
+  allocs = Allocations - before;
+  if (!ok) {
+    fprintf(stderr, "%s: parse failed\n", file);
+    exit(1);
+  }
+  return parser.getAST();
+}
+
+int main(int argc, char **argv) {
+  int repeat = 3;
+  int first = 1;
+  if (argc > 2 && !strcmp(argv[1], "-r")) {
+    repeat = atoi(argv[2]);
+    first = 3;
+  }
+  if (first >= argc || repeat < 1) {
+    fprintf(stderr, "usage: %s [-r N] file...\n", argv[0]);
+    return 1;
+  }
+
+  printf("file,bytes,phase,seconds,items,unit,items_per_sec,peak_rss_kb,allocs\n");
+  for (int i = first; i < argc; i++) {
+    const char *file = argv[i];
+
+    // 字句解析
+    double best = 1e30;
+    size_t tokens = 0, bytes = 0, allocs = 0;
+    for (int r = 0; r < repeat; r++) {
+      size_t before = Allocations;
+      auto start = Clock::now();
+      auto Tokens = LexicalAnalysis(file, LEXER_BUFFER);
+      double sec = seconds(start);
+      allocs = Allocations - before;
+      if (!Tokens) {
+        fprintf(stderr, "%s: could not open\n", file);
+        return 1;
+      }
+      bytes = Tokens->getSource().size();
+      for (tokens = 1; Tokens->getNextToken(); tokens++)
+        ;
+      best = std::min(best, sec);
+    }
+    report(file, bytes, "lex", best, tokens, "tokens", allocs);
+
+    // 構文解析
+    best = 1e30;
+    size_t nodes = 0;
+    std::unique_ptr<ProgramAST> program;
+    for (int r = 0; r < repeat; r++) {
+      double sec;
+      program = nullptr;
+      program = parseFile(file, sec, allocs);
+      best = std::min(best, sec);
+    }
+    nodes = 1 + NodeCounter().block(program->getBlock());
+    report(file, bytes, "parse", best, nodes, "nodes", allocs);
+    report(file, bytes, "ast", 0, program->getContext().getBytes(), "bytes", 0);
+
+    // ASTの書き出しと読み込み（-ast-cacheのファイルの中身）
+    auto source = llvm::MemoryBuffer::getFile(file);
+    if (!source) {
+      fprintf(stderr, "%s: could not open\n", file);
+      return 1;
+    }
+    llvm::StringRef text = (*source)->getBuffer();
+    best = 1e30;
+    std::string image;
+    for (int r = 0; r < repeat; r++) {
+      image.clear();
+      llvm::raw_string_ostream out(image);
+      size_t before = Allocations;
+      auto start = Clock::now();
+      ASTCache::write(*program, text, out);
+      out.flush();
+      best = std::min(best, seconds(start));
+      allocs = Allocations - before;
+    }
+    report(file, bytes, "save", best, image.size(), "bytes", allocs);
+
+    best = 1e30;
+    std::unique_ptr<ProgramAST> loaded;
+    for (int r = 0; r < repeat; r++) {
+      loaded = nullptr;
+      size_t before = Allocations;
+      auto start = Clock::now();
+      loaded = ASTCache::read(image, text);
+      best = std::min(best, seconds(start));
+      allocs = Allocations - before;
+    }
+    if (!loaded || !sameAST(*program, *loaded)) {
+      fprintf(stderr, "%s: AST cache round trip failed\n", file);
+      return 1;
+    }
+    report(file, bytes, "load", best, nodes, "nodes", allocs);
+    loaded = nullptr;
+
+    // インクリメンタル構文解析（関数のブロックの中の編集）
+    std::vector<uint32_t> points;
+    for (size_t pos = text.find(":="); pos != llvm::StringRef::npos; pos = text.find(":=", pos + 2))
+      points.push_back(pos + 2);
+    size_t step = std::max<size_t>(points.size() / 100, 1);
+    best = 1e30;
+    size_t edits = 0;
+    for (int r = 0; r < repeat; r++) {
+      IncrementalParser session(file, text);
+      edits = 0;
+      size_t before = Allocations;
+      auto start = Clock::now();
+      for (size_t k = 0; k < points.size(); k += step) {
+        session.edit(points[k], 0, " ");
+        session.edit(points[k], 1, "");
+        edits += 2;
+      }
+      best = std::min(best, seconds(start));
+      allocs = Allocations - before;
+
+      IncrementalParser fresh(file, text);
+      std::string got, expected;
+      session.report(stderr, DIAG_TEXT, &got);
+      fresh.report(stderr, DIAG_TEXT, &expected);
+      if (session.getText() != text || got != expected || !session.getProgram() ||
+          NodeCounter().block(session.getProgram()->getBlock()) != nodes - 1) {
+        fprintf(stderr, "%s: incremental reparse differs from a full parse\n", file);
+        return 1;
+      }
+    }
+    if (edits)
+      report(file, bytes, "edit", best, edits, "edits", allocs);
+
+    // ASTの走査
+    best = 1e30;
+    for (int r = 0; r < repeat; r++) {
+      auto start = Clock::now();
+      NodeCounter().block(program->getBlock());
+      best = std::min(best, seconds(start));
+    }
+    report(file, bytes, "walk", best, nodes, "nodes", 0);
+
+    // ノード配列を先頭から順に走査（種類ごとに数える）
+    best = 1e30;
+    size_t scanned = 0;
+    for (int r = 0; r < repeat; r++) {
+      size_t kinds[256] = {};
+      auto start = Clock::now();
+      for (auto &node : program->getContext().getNodes())
+        kinds[node.ID]++;
+      best = std::min(best, seconds(start));
+      scanned = 0;
+      for (size_t n : kinds)
+        scanned += n;
+    }
+    report(file, bytes, "scan", best, scanned, "nodes", 0);
+    program = nullptr;
+
+    // 定数畳み込み
+    best = 1e30;
+    size_t folded = 0;
+    for (int r = 0; r < repeat; r++) {
+      double sec;
+      size_t parsed;
+      auto program = parseFile(file, sec, parsed);
+      ConstantFolder folder(*program);
+      size_t before = Allocations;
+      auto start = Clock::now();
+      folder.fold();
+      best = std::min(best, seconds(start));
+      allocs = Allocations - before;
+      folded = folder.getNumFolded() + folder.getNumDeleted();
+    }
+    report(file, bytes, "fold", best, folded, "nodes", allocs);
+
+    // コード生成（定数畳み込みなし・あり、SSAを直接作るもの）
+    static const struct {
+      bool Fold, SSA;
+      const char *Phase, *IRPhase;
+    } modes[] = {
+      { false, false, "codegen", "ir" },
+      { true, false, "codegen.fold", "ir.fold" },
+      { false, true, "codegen.ssa", "ir.ssa" },
+    };
+    for (auto &mode : modes) {
+      best = 1e30;
+      size_t insts = 0;
+      for (int r = 0; r < repeat; r++) {
+        double sec;
+        size_t parsed;
+        auto program = parseFile(file, sec, parsed);
+        if (mode.Fold)
+          ConstantFolder(*program).fold();
+        CodeGen codegen(file, mode.SSA);
+        size_t before = Allocations;
+        auto start = Clock::now();
+        codegen.generate(std::move(program));
+        best = std::min(best, seconds(start));
+        allocs = Allocations - before;
+        insts = countInstructions(*codegen.getModule());
+      }
+      report(file, bytes, mode.Phase, best, nodes, "nodes", allocs);
+      report(file, bytes, mode.IRPhase, 0, insts, "insts", 0);
+    }
+  }
+  return 0;
+}
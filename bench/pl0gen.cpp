@@ -0,0 +1,267 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+/**
+  * ベンチマーク用PL/0プログラム生成器
+  * 構文・意味ともに正しいプログラムを標準出力に書き出す。
+  * 変数は読む前に初期化し、除数は0にならない定数にする（整数の桁あふれは折り返す）。
+  * while の条件は乱数で決めるので、実行が終わるとは限らない
+  *
+  * 使い方: pl0gen [-shape 名前] [-funcs N] [-stmts N] [-depth N] [-expr N]
+  *                [-comments 割合] [-seed N]
+  *   -shape    flat（既定）, deep, funcs, expr, comment のいずれか。
+  *             各パラメータの既定値を決める（個別の指定が優先される）
+  *   -funcs    関数の数
+  *   -stmts    関数本体1つあたりの文の数
+  *   -depth    if/while/begin の入れ子の深さ
+  *   -expr     式1つあたりの項の数
+  *   -comments 文の前にコメントを置く割合（%）
+  *   -seed     乱数の種
+  */
+
+struct GenOption {
+  int Funcs;
+  int Stmts;
+  int Depth;
+  int Expr;
+  int Comments;
+  unsigned Seed;
+};
+
+static const int GLOBALS = 8;
+static const int CONSTS = 4;
+
+class Generator {
+private:
+  GenOption Opt;
+  std::mt19937 Rand;
+  std::string Out;
+  int CurFunc;      // 生成中の関数番号（-1ならメイン）
+
+public:
+  Generator(const GenOption &opt) : Opt(opt), Rand(opt.Seed), CurFunc(-1) {}
+
+  const std::string &program() {
+    for (int i = 0; i < CONSTS; i++)
+      Out += (i ? ", " : "const ") + std::string("c") + std::to_string(i) + " = " + std::to_string(i * 7 + 3);
+    Out += ";\nvar ";
+    for (int i = 0; i < GLOBALS; i++)
+      Out += (i ? ", g" : "g") + std::to_string(i);
+    Out += ";\n\n";
+
+    for (int i = 0; i < Opt.Funcs; i++) {
+      CurFunc = i;
+      function(i);
+    }
+
+    CurFunc = -1;
+    Out += "begin\n";
+    for (int i = 0; i < GLOBALS; i++)
+      Out += "  g" + std::to_string(i) + " := " + std::to_string(i * 11 + 1) + ";\n";
+    for (int i = 0; i < Opt.Stmts; i++) {
+      comment(1);
+      statement(1, Opt.Depth);
+      Out += ";\n";
+    }
+    Out += "  writeln\nend.\n";
+    return Out;
+  }
+
+private:
+  int pick(int n) { return std::uniform_int_distribution<int>(0, n - 1)(Rand); }
+
+  void indent(int level) { Out.append(level * 2, ' '); }
+
+  void function(int n) {
+    Out += "function f" + std::to_string(n) + "(a, b)\n  var x, y, z;\nbegin\n";
+    Out += "  x := a;\n  y := b;\n  z := c0;\n";
+    for (int i = 0; i < Opt.Stmts; i++) {
+      comment(1);
+      statement(1, Opt.Depth);
+      Out += ";\n";
+    }
+    Out += "  return ";
+    expression(Opt.Expr);
+    Out += "\nend;\n\n";
+  }
+
+  void comment(int level) {
+    if (pick(100) >= Opt.Comments)
+      return;
+    indent(level);
+    Out += "{ statement " + std::to_string(Out.size()) + ": a comment that the lexer has to skip }\n";
+  }
+
+  // 参照できる変数名
+  std::string variable() {
+    if (CurFunc >= 0 && pick(2))
+      return local();
+    return "g" + std::to_string(pick(GLOBALS));
+  }
+
+  // 代入できる変数名（関数内では同じレベルの変数・パラメタだけ）
+  std::string assignable() {
+    return CurFunc >= 0 ? local() : "g" + std::to_string(pick(GLOBALS));
+  }
+
+  std::string local() { return std::string(1, "abxyz"[pick(5)]); }
+
+  void statement(int level, int depth) {
+    indent(level);
+    int kind = depth > 0 ? pick(3) : 3 + pick(4);
+    switch (kind) {
+    case 0:
+      Out += "if ";
+      condition();
+      Out += " then\n";
+      statement(level + 1, depth - 1);
+      break;
+    case 1:
+      Out += "while ";
+      condition();
+      Out += " do\n";
+      statement(level + 1, depth - 1);
+      break;
+    case 2:
+      Out += "begin\n";
+      statement(level + 1, depth - 1);
+      Out += ";\n";
+      statement(level + 1, 0);
+      Out += "\n";
+      indent(level);
+      Out += "end";
+      break;
+    case 3:
+    case 4:
+      Out += assignable() + " := ";
+      expression(Opt.Expr);
+      break;
+    case 5:
+      Out += "write ";
+      expression(Opt.Expr);
+      break;
+    default:
+      Out += "writeln";
+    }
+  }
+
+  void condition() {
+    static const char *ops[] = { "=", "<>", "<", "<=", ">", ">=" };
+    if (pick(8) == 0) {
+      Out += "odd ";
+      expression(2);
+      return;
+    }
+    expression(2);
+    Out += std::string(" ") + ops[pick(6)] + " ";
+    expression(2);
+  }
+
+  void expression(int terms) {
+    static const char *ops[] = { " + ", " - ", " * ", " / " };
+    if (pick(8) == 0)
+      Out += "-";
+    factor(terms);
+    for (int i = 1; i < terms; i++) {
+      const char *op = ops[pick(4)];
+      Out += op;
+      if (op == ops[3])
+        divisor();
+      else
+        factor(terms);
+    }
+  }
+
+  // 0にならない除数（正の数か定数）
+  void divisor() {
+    if (pick(2))
+      Out += std::to_string(1 + pick(999));
+    else
+      Out += "c" + std::to_string(pick(CONSTS));
+  }
+
+  void factor(int terms) {
+    switch (pick(10)) {
+    case 0:
+      // 呼び出せるのは定義済みの関数だけ
+      if (CurFunc != 0 && Opt.Funcs > 0) {
+        int limit = CurFunc < 0 ? Opt.Funcs : CurFunc;
+        Out += "f" + std::to_string(pick(limit)) + "(";
+        expression(1);
+        Out += ", ";
+        expression(1);
+        Out += ")";
+        return;
+      }
+      break;
+    case 1:
+      if (terms > 2) {
+        Out += "(";
+        expression(terms / 2);
+        Out += ")";
+        return;
+      }
+      break;
+    case 2:
+    case 3:
+      Out += std::to_string(pick(1000));
+      return;
+    case 4:
+      Out += "c" + std::to_string(pick(CONSTS));
+      return;
+    }
+    Out += variable();
+  }
+};
+
+int main(int argc, char **argv) {
+  GenOption opt = { 200, 20, 2, 4, 10, 1 };
+  const char *shape = "flat";
+  for (int i = 1; i + 1 < argc; i += 2)
+    if (!strcmp(argv[i], "-shape"))
+      shape = argv[i + 1];
+
+  if (!strcmp(shape, "deep")) {
+    opt = { 20, 10, 40, 3, 5, 1 };
+  } else if (!strcmp(shape, "funcs")) {
+    opt = { 2000, 4, 1, 3, 5, 1 };
+  } else if (!strcmp(shape, "expr")) {
+    opt = { 100, 10, 1, 64, 5, 1 };
+  } else if (!strcmp(shape, "comment")) {
+    opt = { 200, 20, 2, 4, 90, 1 };
+  } else if (strcmp(shape, "flat")) {
+    fprintf(stderr, "unknown shape: %s\n", shape);
+    return 1;
+  }
+
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) {
+      fprintf(stderr, "missing value for %s\n", argv[i]);
+      return 1;
+    }
+    int value = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "-funcs"))
+      opt.Funcs = value;
+    else if (!strcmp(argv[i], "-stmts"))
+      opt.Stmts = value;
+    else if (!strcmp(argv[i], "-depth"))
+      opt.Depth = value;
+    else if (!strcmp(argv[i], "-expr"))
+      opt.Expr = value;
+    else if (!strcmp(argv[i], "-comments"))
+      opt.Comments = value;
+    else if (!strcmp(argv[i], "-seed"))
+      opt.Seed = value;
+    else if (strcmp(argv[i], "-shape")) {
+      fprintf(stderr, "unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  Generator gen(opt);
+  fputs(gen.program().c_str(), stdout);
+  return 0;
+}
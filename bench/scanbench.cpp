@@ -0,0 +1,103 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "scan.hpp"
+
+/**
+  * 走査カーネルのマイクロベンチマーク
+  * コメントの多い入力と長い識別子の多い入力を生成し、
+  * 各カーネルで字句解析と同じ読み飛ばしを行ったときのバイト/秒を表示する
+  */
+
+// コメントの多い入力
+static std::string commentHeavy(size_t size) {
+  std::string src;
+  int i = 0;
+  while (src.size() < size) {
+    src += "  { this is a fairly long comment describing statement ";
+    src += std::to_string(i);
+    src += " in some detail }\n    x := x + 1;\n";
+    i++;
+  }
+  return src;
+}
+
+// 長い識別子の多い入力
+static std::string identifierHeavy(size_t size) {
+  std::string src;
+  int i = 0;
+  while (src.size() < size) {
+    src += "    accumulatedValue";
+    src += std::to_string(i % 97);
+    src += " := previousIntermediateResult * multiplicationFactor + 1234567;\n";
+    i++;
+  }
+  return src;
+}
+
+// Lexer::nextと同じ順序で読み飛ばし、トークン数を返す
+static size_t scanAll(const std::string &src) {
+  const char *p = src.data();
+  const char *end = p + src.size();
+  size_t tokens = 0;
+  while (p < end) {
+    char c = *p++;
+    if (c == '\n')
+      continue;
+    if (c == ' ' || c == '\t' || c == '\r') {
+      p = Scan.blank(p, end);
+    } else if (c == '{') {
+      while ((p = Scan.comment(p, end)) < end && *p == '\n')
+        p++;
+      if (p < end)
+        p++;
+    } else if ((unsigned char)((c | 0x20) - 'a') < 26) {
+      p = Scan.alnum(p, end);
+      tokens++;
+    } else if ((unsigned char)(c - '0') < 10) {
+      p = Scan.digit(p, end);
+      tokens++;
+    } else {
+      tokens++;
+    }
+  }
+  return tokens;
+}
+
+static double measure(const std::string &src, int repeat, size_t &tokens) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; i++)
+    tokens = scanAll(src);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return (double)src.size() * repeat / elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  size_t size = argc > 1 ? atol(argv[1]) : 16 << 20;
+  int repeat = argc > 2 ? atoi(argv[2]) : 10;
+  struct { const char *name; std::string src; } inputs[] = {
+    { "comment", commentHeavy(size) },
+    { "identifier", identifierHeavy(size) },
+  };
+  ScanKernel kernels[] = { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2 };
+  ScanKernel best = setScanKernel(SCAN_AUTO);
+
+  printf("input,kernel,bytes,tokens,bytes_per_sec,speedup\n");
+  for (auto &input : inputs) {
+    double scalar = 0;
+    for (ScanKernel kernel : kernels) {
+      if (kernel > best)
+        continue;
+      setScanKernel(kernel);
+      size_t tokens = 0;
+      measure(input.src, 1, tokens);   // warm up
+      double rate = measure(input.src, repeat, tokens);
+      if (kernel == SCAN_SCALAR)
+        scalar = rate;
+      printf("%s,%s,%zu,%zu,%.0f,%.2f\n", input.name, scanKernelName(kernel),
+             input.src.size(), tokens, rate, rate / scalar);
+    }
+  }
+  return 0;
+}
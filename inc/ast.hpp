@@ -1,7 +1,15 @@
 #ifndef AST_HPP
 #define AST_HPP
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Casting.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "interner.hpp"
+#include <cassert>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <map>
 #include <vector>
@@ -36,7 +44,7 @@ class CallExprAST;
 /**
   * ASTの種類
   */
-enum AstID {
+enum AstID : uint8_t {
 // 式
   BaseExpID,
   CondExpID,
@@ -54,129 +62,338 @@ enum AstID {
   ReturnID,
   WriteID,
   WritelnID,
+// 宣言
+  BlockID,
+  ConstDeclID,
+  VarDeclID,
+  FuncDeclID,
+};
+
+/**
+  * 演算子の種類
+  */
+enum OpID : uint8_t {
+  OP_NONE,
+// 算術演算子（BinaryExprAST）
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+// 比較演算子（CondExpAST）
+  OP_ODD,
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
 };
 
 
 /**
-  * 式のASTの基底クラス
+  * ASTのノード（12バイトの固定長レコード）
+  * 子ノードはASTContextのノード配列の添字、名前は宣言の番号、整数はそのまま持つ
   */
-class BaseExpAST {
+struct ASTNode {
   AstID ID;
-
-  public:
-  BaseExpAST(AstID id): ID(id) {}
-  virtual ~BaseExpAST() {}
-  AstID getValueID() const { return ID; }
+  OpID Op;
+  OpID Prefix;
+  uint8_t Reserved;
+  uint32_t Operand[2];
 };
 
+static_assert(sizeof(ASTNode) == 12, "ASTNode is a 12-byte record");
+
 /**
-  * 文のASTの基底クラス
+  * 平坦化したAST
+  * コンパイル単位ごとに1つ作る。ノードは後行順（子が親より前）に1つの配列に並ぶ。
+  * 子の並び（文の列、引数、パラメタ、宣言）は要素数を先頭に置いてリスト配列に格納する。
+  * 名前の宣言（定数・変数・パラメタ・関数）には番号を振り、参照するノードはその番号を持つ
+  * インクリメンタル解析で関数のブロックを差し替えると、新しいブロックのノードは配列の末尾に追加され、
+  * 古いノードは参照されないまま残る（その部分だけは後行順にならない）
+  * 定数畳み込みはノードをその場で書き換え、置き換えられた子ノードはやはり参照されないまま残る
   */
-class BaseStmtAST {
-  AstID ID;
+class ASTContext {
+public:
+  static const uint32_t NOIDX = UINT32_MAX;   // ノードなし
 
-  public:
-  BaseStmtAST(AstID id): ID(id) {}
-  virtual ~BaseStmtAST() {}
-  AstID getValueID() const { return ID; }
-};
+private:
+  std::vector<ASTNode> Nodes;
+  std::vector<uint32_t> Lists;
+  std::vector<SymbolID> Decls;     // 宣言の番号 -> 名前
 
+public:
+  /**
+    * @param ソースの大きさ（ノード数の見積もりに使う。ノードはソース4バイトに1個程度）
+    */
+  explicit ASTContext(size_t source_size = 0) {
+    Nodes.reserve(source_size / 4);
+    Lists.reserve(source_size / 16);
+  }
+
+  /**
+    * 保存しておいた配列からそのまま作る（ASTCacheが使う）
+    */
+  ASTContext(std::vector<ASTNode> nodes, std::vector<uint32_t> lists, std::vector<SymbolID> decls)
+    : Nodes(std::move(nodes)), Lists(std::move(lists)), Decls(std::move(decls)) {}
+
+  /**
+    * ノードを追加する
+    * ノードの内容は T::build が設定する
+    * @return 追加したノードへの参照
+    */
+  template<typename T, typename... Args>
+  T create(Args&&... args) {
+    ASTNode node = { T::ID, OP_NONE, OP_NONE, 0, { NOIDX, NOIDX } };
+    T::build(*this, node, std::forward<Args>(args)...);
+    Nodes.push_back(node);
+    return T(this, (uint32_t)Nodes.size() - 1);
+  }
+
+  /**
+    * ノードへの参照の並びをリストにする
+    * @return リストの位置
+    */
+  template<typename T>
+  uint32_t addList(llvm::ArrayRef<T> items) {
+    uint32_t begin = Lists.size();
+    Lists.push_back(items.size());
+    for (auto &item : items)
+      Lists.push_back(item.getIndex());
+    return begin;
+  }
+
+  uint32_t addList(llvm::ArrayRef<uint32_t> items) {
+    uint32_t begin = Lists.size();
+    Lists.push_back(items.size());
+    Lists.insert(Lists.end(), items.begin(), items.end());
+    return begin;
+  }
+
+  /**
+    * 宣言を追加する（どこにも宣言されていない名前にも1つ作る）
+    * @return 宣言の番号
+    */
+  uint32_t addDecl(SymbolID name) {
+    Decls.push_back(name);
+    return (uint32_t)Decls.size() - 1;
+  }
+
+  /**
+    * 名前の参照（代入・変数参照）のノードに宣言を設定する
+    */
+  void resolve(uint32_t index, uint32_t decl) { Nodes[index].Operand[0] = decl; }
+
+  /**
+    * リストの要素を置き換える（インクリメンタル解析で関数のブロックを差し替えるとき）
+    */
+  void setListItem(uint32_t begin, size_t i, uint32_t item) { Lists[begin + 1 + i] = item; }
+
+  /**
+    * ノードを置き換える（定数畳み込みで式・文を書き換えるとき）
+    */
+  void setNode(uint32_t index, const ASTNode &node) { Nodes[index] = node; }
+
+  SymbolID getDeclName(uint32_t decl) const { return Decls[decl]; }
+  size_t getNumDecls() const { return Decls.size(); }
+
+  const ASTNode &getNode(uint32_t index) const { return Nodes[index]; }
+  llvm::ArrayRef<ASTNode> getNodes() const { return Nodes; }   // 後行順
+  llvm::ArrayRef<uint32_t> getLists() const { return Lists; }
+  llvm::ArrayRef<SymbolID> getDecls() const { return Decls; }
+  llvm::ArrayRef<uint32_t> getList(uint32_t begin) const {
+    return llvm::ArrayRef<uint32_t>(&Lists[begin + 1], Lists[begin]);
+  }
+
+  size_t getNumNodes() const { return Nodes.size(); }
+  size_t getBytes() const {
+    return Nodes.size() * sizeof(ASTNode) + Lists.size() * sizeof(uint32_t)
+         + Decls.size() * sizeof(SymbolID);
+  }
+};
 
 /**
-  * ソースコードを表すAST
+  * ASTのノードへの参照（ASTContextと添字の組）
+  * 派生クラスがノードの種類ごとのアクセサを持つ。値として受け渡す
   */
-class ProgramAST {
-  std::unique_ptr<BlockAST> Block;
+class ASTRef {
+protected:
+  const ASTContext *Context;
+  uint32_t Index;
 
-  public:
-    ProgramAST(std::unique_ptr<BlockAST> block): Block(std::move(block)) {}
-    ~ProgramAST() {}
-    std::unique_ptr<BlockAST> getBlock() { return std::move(Block); }
+  const ASTNode &node() const { return Context->getNode(Index); }
+  uint32_t operand(int i) const { return node().Operand[i]; }
+  llvm::ArrayRef<uint32_t> list(int i) const { return Context->getList(operand(i)); }
+  SymbolID name(uint32_t decl) const { return Context->getDeclName(decl); }
+
+public:
+  ASTRef() : Context(nullptr), Index(ASTContext::NOIDX) {}
+  ASTRef(std::nullptr_t) : ASTRef() {}
+  ASTRef(const ASTContext *context, uint32_t index) : Context(context), Index(index) {}
+
+  explicit operator bool() const { return Index != ASTContext::NOIDX; }
+  uint32_t getIndex() const { return Index; }
+  AstID getValueID() const { return node().ID; }
+
+  template<typename T>
+  T castAs() const {
+    assert(T::classof(this) && "castAs<T>() to the wrong AST");
+    return T(Context, Index);
+  }
 };
 
 /**
-  * Blockを表すAST
+  * リストに並んだノードを T として順にたどる
   */
-class BlockAST {
-  std::unique_ptr<ConstDeclAST> Constant;
-  std::unique_ptr<VarDeclAST> Variable;
-  std::vector<std::unique_ptr<FuncDeclAST>> Functions;
-  std::unique_ptr<BaseStmtAST> Statement;
+template<typename T>
+class ASTList {
+  const ASTContext *Context;
+  llvm::ArrayRef<uint32_t> Items;
+
+public:
+  class iterator {
+    const ASTContext *Context;
+    const uint32_t *Ptr;
 
   public:
-    BlockAST() {}
-    ~BlockAST() {}
-    void setConstant(std::unique_ptr<ConstDeclAST> constant);
-    void setVariable(std::unique_ptr<VarDeclAST> variable);
-    void addFunction(std::unique_ptr<FuncDeclAST> function);
-    void setStatement(std::unique_ptr<BaseStmtAST> statement) {
-      Statement = std::move(statement);
-    }
-    bool empty();
-    std::unique_ptr<ConstDeclAST> getConstant() {
-      return std::move(Constant);
-    }
-    std::unique_ptr<VarDeclAST> getVariable() {
-      return std::move(Variable);
-    }
-    std::vector<std::unique_ptr<FuncDeclAST>> getFunctions() {
-      return std::move(Functions);
-    }
-    std::unique_ptr<BaseStmtAST> getStatement() {
-      return std::move(Statement);
-    }
+    iterator(const ASTContext *context, const uint32_t *ptr) : Context(context), Ptr(ptr) {}
+    T operator*() const { return T(Context, *Ptr); }
+    iterator &operator++() { ++Ptr; return *this; }
+    bool operator==(const iterator &other) const { return Ptr == other.Ptr; }
+    bool operator!=(const iterator &other) const { return Ptr != other.Ptr; }
+  };
+
+  ASTList(const ASTContext *context, llvm::ArrayRef<uint32_t> items) : Context(context), Items(items) {}
+  iterator begin() const { return iterator(Context, Items.begin()); }
+  iterator end() const { return iterator(Context, Items.end()); }
+  size_t size() const { return Items.size(); }
+  bool empty() const { return Items.empty(); }
+  T operator[](size_t i) const { return T(Context, Items[i]); }
 };
 
 /**
-  * 定数定義を表すAST
+  * 式のASTの基底クラス
   */
-class ConstDeclAST {
-private:
-  std::vector<std::pair<std::string, int>> NameTable;
+class BaseExpAST : public ASTRef {
+public:
+  using ASTRef::ASTRef;
+  static inline bool classof(ASTRef const* ref) {
+    return ref->getValueID() >= BaseExpID && ref->getValueID() < BaseStmtID;
+  }
+};
 
+/**
+  * 文のASTの基底クラス
+  */
+class BaseStmtAST : public ASTRef {
 public:
-  ConstDeclAST() {}
-  ~ConstDeclAST() {}
-  void addConstant(const std::string &name, int value) {
-    NameTable.emplace_back(name, value);
+  using ASTRef::ASTRef;
+  static inline bool classof(ASTRef const* ref) {
+    return ref->getValueID() >= BaseStmtID && ref->getValueID() < BlockID;
   }
-  void setNameTable(std::vector<std::pair<std::string, int>> table) {
-    NameTable = table;
+};
+
+/**
+  * 定数定義を表すAST
+  * リスト: 宣言, 値, 宣言, 値, ...
+  */
+class ConstDeclAST : public ASTRef {
+public:
+  static const AstID ID = ConstDeclID;
+  using ASTRef::ASTRef;
+  static void build(ASTContext &context, ASTNode &node, llvm::ArrayRef<std::pair<uint32_t, int>> table) {
+    llvm::SmallVector<uint32_t, 16> items;
+    for (auto &pair : table) {
+      items.push_back(pair.first);
+      items.push_back((uint32_t)pair.second);
+    }
+    node.Operand[0] = context.addList(llvm::makeArrayRef(items));
   }
-  std::vector<std::pair<std::string, int>> getNameTable() { return NameTable; }
+  static inline bool classof(ASTRef const* ref) { return ref->getValueID() == ConstDeclID; }
+  size_t size() const { return list(0).size() / 2; }
+  uint32_t getDecl(size_t i) const { return list(0)[i * 2]; }
+  SymbolID getName(size_t i) const { return name(getDecl(i)); }
+  int getValue(size_t i) const { return (int)list(0)[i * 2 + 1]; }
 };
 
 /**
   * 変数定義を表すAST
+  * リスト: 宣言...
   */
-class VarDeclAST {
-private:
-  std::vector<std::string> NameTable;
+class VarDeclAST : public ASTRef {
+public:
+  static const AstID ID = VarDeclID;
+  using ASTRef::ASTRef;
+  static void build(ASTContext &context, ASTNode &node, llvm::ArrayRef<uint32_t> decls) {
+    node.Operand[0] = context.addList(decls);
+  }
+  static inline bool classof(ASTRef const* ref) { return ref->getValueID() == VarDeclID; }
+  llvm::ArrayRef<uint32_t> getDecls() const { return list(0); }
+  SymbolID getName(size_t i) const { return name(getDecls()[i]); }
+};
+
+class FuncDeclAST;
 
+/**
+  * Blockを表すAST
+  * リスト: 定数定義, 変数定義, 関数定義...
+  */
+class BlockAST : public ASTRef {
 public:
-  VarDeclAST() {}
-  ~VarDeclAST() {}
-  void addVariable(const std::string &name) { NameTable.push_back(name); }
-  void setNameTable(std::vector<std::string> table) { NameTable = table; }
-  std::vector<std::string> getNameTable() { return NameTable; }
+  static const AstID ID = BlockID;
+  using ASTRef::ASTRef;
+  static void build(ASTContext &context, ASTNode &node, ConstDeclAST constant, VarDeclAST variable,
+                    llvm::ArrayRef<FuncDeclAST> functions, BaseStmtAST statement);
+  static inline bool classof(ASTRef const* ref) { return ref->getValueID() == BlockID; }
+  bool empty() const;
+  ConstDeclAST getConstant() const { return ConstDeclAST(Context, list(0)[0]); }
+  VarDeclAST getVariable() const { return VarDeclAST(Context, list(0)[1]); }
+  ASTList<FuncDeclAST> getFunctions() const {
+    return ASTList<FuncDeclAST>(Context, list(0).drop_front(2));
+  }
+  BaseStmtAST getStatement() const { return BaseStmtAST(Context, operand(1)); }
 };
 
 /**
   * 関数定義を表すAST
+  * 関数名の宣言, リスト: パラメタの宣言..., ブロック
   */
-class FuncDeclAST {
-private:
-  std::string Name;
-  std::vector<std::string> Parameters;
-  std::unique_ptr<BlockAST> Block;
-
+class FuncDeclAST : public ASTRef {
 public:
-  FuncDeclAST(const std::string &name, std::vector<std::string> parameters, std::unique_ptr<BlockAST> block):
-    Name(name), Parameters(parameters), Block(std::move(block)) {}
-  ~FuncDeclAST() {}
-  std::string getName() { return Name; }
-  std::vector<std::string> getParameters() { return Parameters; }
-  std::unique_ptr<BlockAST> getBlock() { return std::move(Block); }
+  static const AstID ID = FuncDeclID;
+  using ASTRef::ASTRef;
+  static void build(ASTContext &context, ASTNode &node, uint32_t decl,
+                    llvm::ArrayRef<uint32_t> parameters, BlockAST block) {
+    llvm::SmallVector<uint32_t, 8> items(parameters.begin(), parameters.end());
+    items.push_back(block.getIndex());
+    node.Operand[0] = decl;
+    node.Operand[1] = context.addList(llvm::makeArrayRef(items));
+  }
+  static inline bool classof(ASTRef const* ref) { return ref->getValueID() == FuncDeclID; }
+  uint32_t getDecl() const { return operand(0); }
+  SymbolID getName() const { return name(getDecl()); }
+  llvm::ArrayRef<uint32_t> getParameters() const { return list(1).drop_back(); }   // 宣言の並び
+  BlockAST getBlock() const { return BlockAST(Context, list(1).back()); }
+};
+
+/**
+  * ソースコードを表すAST
+  * ノードを格納したASTContextを所有する
+  */
+class ProgramAST {
+  std::unique_ptr<ASTContext> Context;
+  BlockAST Block;
+  std::shared_ptr<StringInterner> Names;   // 識別子表
+
+  public:
+    ProgramAST(std::unique_ptr<ASTContext> context, BlockAST block, std::shared_ptr<StringInterner> names):
+      Context(std::move(context)), Block(block), Names(names) {}
+    ~ProgramAST() {}
+    BlockAST getBlock() const { return Block; }
+    std::shared_ptr<StringInterner> getNames() const { return Names; }
+    const ASTContext &getContext() const { return *Context; }
+    ASTContext &getContext() { return *Context; }
+    std::unique_ptr<ASTContext> releaseContext() { return std::move(Context); }
 };
 
 /**
@@ -184,140 +401,115 @@ public:
   */
 class NullAST : public BaseStmtAST {
 public:
-  NullAST() : BaseStmtAST(NullID) {}
-  ~NullAST() {}
-  static inline bool classof(NullAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == NullID;
+  static const AstID ID = NullID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &) {}
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == NullID;
   }
 };
 
 /**
   * 代入文を表すAST
+  * 代入先の宣言は、構文解析がブロックを出るときに ASTContext::resolve で設定する
   */
 class AssignAST : public BaseStmtAST {
-private:
-  std::string Name;
-  std::unique_ptr<BaseExpAST> RHS;
-
 public:
-  AssignAST(const std::string &name, std::unique_ptr<BaseExpAST> rhs) : BaseStmtAST(AssignID), Name(name), RHS(std::move(rhs)) {}
-  ~AssignAST() {}
-  static inline bool classof(AssignAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == AssignID;
+  static const AstID ID = AssignID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &node, BaseExpAST rhs) {
+    node.Operand[1] = rhs.getIndex();
   }
-  std::string getName() { return Name; }
-  std::unique_ptr<BaseExpAST> getRHS() {
-    return std::move(RHS);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == AssignID;
   }
+  uint32_t getDecl() const { return operand(0); }
+  SymbolID getName() const { return name(getDecl()); }
+  BaseExpAST getRHS() const { return BaseExpAST(Context, operand(1)); }
 };
 
 /**
   * Begin/End文を表すAST
   */
 class BeginEndAST : public BaseStmtAST {
-private:
-  std::vector<std::unique_ptr<BaseStmtAST>> Statements;
-
 public:
-  BeginEndAST(std::vector<std::unique_ptr<BaseStmtAST>> statements) : BaseStmtAST(BeginEndID), Statements(std::move(statements)) {}
-  ~BeginEndAST() {}
-  static inline bool classof(BeginEndAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == BeginEndID;
+  static const AstID ID = BeginEndID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &context, ASTNode &node, llvm::ArrayRef<BaseStmtAST> statements) {
+    node.Operand[0] = context.addList(statements);
   }
-  std::vector<std::unique_ptr<BaseStmtAST>> getStatements() {
-    return std::move(Statements);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == BeginEndID;
   }
+  ASTList<BaseStmtAST> getStatements() const { return ASTList<BaseStmtAST>(Context, list(0)); }
 };
 
 /**
   * If/Then文を表すAST
   */
 class IfThenAST : public BaseStmtAST {
-private:
-  std::unique_ptr<BaseExpAST> Condition;
-  std::unique_ptr<BaseStmtAST> Statement;
-
 public:
-  IfThenAST(std::unique_ptr<BaseExpAST> condition, std::unique_ptr<BaseStmtAST> statement) :
-    BaseStmtAST(IfThenID), Condition(std::move(condition)), Statement(std::move(statement)) {}
-  ~IfThenAST() {}
-  static inline bool classof(IfThenAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == IfThenID;
+  static const AstID ID = IfThenID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &node, BaseExpAST condition, BaseStmtAST statement) {
+    node.Operand[0] = condition.getIndex();
+    node.Operand[1] = statement.getIndex();
   }
-  std::unique_ptr<BaseExpAST> getCondition() {
-    return std::move(Condition);
-  }
-  std::unique_ptr<BaseStmtAST> getStatement() {
-    return std::move(Statement);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == IfThenID;
   }
+  BaseExpAST getCondition() const { return BaseExpAST(Context, operand(0)); }
+  BaseStmtAST getStatement() const { return BaseStmtAST(Context, operand(1)); }
 };
 
 /**
   * While/Do文を表すAST
   */
 class WhileDoAST : public BaseStmtAST {
-private:
-  std::unique_ptr<BaseExpAST> Condition;
-  std::unique_ptr<BaseStmtAST> Statement;
-
 public:
-  WhileDoAST(std::unique_ptr<BaseExpAST> condition, std::unique_ptr<BaseStmtAST> statement) :
-    BaseStmtAST(WhileDoID), Condition(std::move(condition)), Statement(std::move(statement)) {}
-  ~WhileDoAST() {}
-  static inline bool classof(WhileDoAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == WhileDoID;
-  }
-  std::unique_ptr<BaseExpAST> getCondition() {
-    return std::move(Condition);
+  static const AstID ID = WhileDoID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &node, BaseExpAST condition, BaseStmtAST statement) {
+    node.Operand[0] = condition.getIndex();
+    node.Operand[1] = statement.getIndex();
   }
-  std::unique_ptr<BaseStmtAST> getStatement() {
-    return std::move(Statement);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == WhileDoID;
   }
+  BaseExpAST getCondition() const { return BaseExpAST(Context, operand(0)); }
+  BaseStmtAST getStatement() const { return BaseStmtAST(Context, operand(1)); }
 };
 
 /**
   * リターン文を表すAST
   */
 class ReturnAST : public BaseStmtAST {
-private:
-  std::unique_ptr<BaseExpAST> Expression;
-
 public:
-  ReturnAST(std::unique_ptr<BaseExpAST> expression) :
-    BaseStmtAST(ReturnID), Expression(std::move(expression)) {}
-  ~ReturnAST() {}
-  static inline bool classof(ReturnAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == ReturnID;
+  static const AstID ID = ReturnID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &node, BaseExpAST expression) {
+    node.Operand[0] = expression.getIndex();
   }
-  std::unique_ptr<BaseExpAST> getExpression() {
-    return std::move(Expression);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == ReturnID;
   }
+  BaseExpAST getExpression() const { return BaseExpAST(Context, operand(0)); }
 };
 
 /**
   * Write文を表すAST
   */
 class WriteAST : public BaseStmtAST {
-private:
-  std::unique_ptr<BaseExpAST> Expression;
-
 public:
-  WriteAST(std::unique_ptr<BaseExpAST> expression) :
-    BaseStmtAST(WriteID), Expression(std::move(expression)) {}
-  ~WriteAST() {}
-  static inline bool classof(WriteAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == WriteID;
+  static const AstID ID = WriteID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &node, BaseExpAST expression) {
+    node.Operand[0] = expression.getIndex();
   }
-  std::unique_ptr<BaseExpAST> getExpression() {
-    return std::move(Expression);
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == WriteID;
   }
+  BaseExpAST getExpression() const { return BaseExpAST(Context, operand(0)); }
 };
 
 /**
@@ -325,11 +517,11 @@ public:
   */
 class WritelnAST : public BaseStmtAST {
 public:
-  WritelnAST() : BaseStmtAST(WritelnID) {}
-  ~WritelnAST() {}
-  static inline bool classof(WritelnAST const*) { return true; }
-  static inline bool classof(BaseStmtAST const* base) {
-     return base->getValueID() == WritelnID;
+  static const AstID ID = WritelnID;
+  using BaseStmtAST::BaseStmtAST;
+  static void build(ASTContext &, ASTNode &) {}
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == WritelnID;
   }
 };
 
@@ -337,89 +529,83 @@ public:
   * 条件式を表すAST
   */
 class CondExpAST : public BaseExpAST {
-private:
-  std::string Op;
-  std::unique_ptr<BaseExpAST> LHS, RHS;
-
 public:
-  CondExpAST(const std::string& op, std::unique_ptr<BaseExpAST> lhs, std::unique_ptr<BaseExpAST> rhs) :
-    BaseExpAST(CondExpID), Op(op), LHS(std::move(lhs)), RHS(std::move(rhs)) {}
-  ~CondExpAST() {}
-  static inline bool classof(CondExpAST const*) { return true; }
-  static inline bool classof(BaseExpAST const* base) {
-     return base->getValueID() == CondExpID;
-  }
-  std::string getOp() { return Op; }
-  std::unique_ptr<BaseExpAST> getLHS() { return std::move(LHS); }
-  std::unique_ptr<BaseExpAST> getRHS() { return std::move(RHS); }
+  static const AstID ID = CondExpID;
+  using BaseExpAST::BaseExpAST;
+  static void build(ASTContext &, ASTNode &node, OpID op, BaseExpAST lhs, BaseExpAST rhs) {
+    node.Op = op;
+    node.Operand[0] = lhs.getIndex();
+    node.Operand[1] = rhs.getIndex();
+  }
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == CondExpID;
+  }
+  OpID getOp() const { return node().Op; }
+  BaseExpAST getLHS() const { return BaseExpAST(Context, operand(0)); }
+  BaseExpAST getRHS() const { return BaseExpAST(Context, operand(1)); }
 };
 
 /**
   * 二項演算式を表すAST
   */
 class BinaryExprAST : public BaseExpAST {
-private:
-  std::string Op;
-  std::unique_ptr<BaseExpAST> LHS, RHS;
-  std::string Prefix;
-
 public:
-  BinaryExprAST(const std::string& op, std::unique_ptr<BaseExpAST> lhs, std::unique_ptr<BaseExpAST> rhs, const std::string& prefix = "") :
-    BaseExpAST(BinaryExprID), Op(op), LHS(std::move(lhs)), RHS(std::move(rhs)), Prefix(prefix)  {}
-  ~BinaryExprAST() {}
-  static inline bool classof(BinaryExprAST const*) { return true; }
-  static inline bool classof(BaseExpAST const* base) {
-     return base->getValueID() == BinaryExprID;
-  }
-  std::string getOp() { return Op; }
-  std::string getPrefix() { return Prefix; }
-  std::unique_ptr<BaseExpAST> getLHS() { return std::move(LHS); }
-  std::unique_ptr<BaseExpAST> getRHS() { return std::move(RHS); }
+  static const AstID ID = BinaryExprID;
+  using BaseExpAST::BaseExpAST;
+  static void build(ASTContext &, ASTNode &node, OpID op, BaseExpAST lhs, BaseExpAST rhs, OpID prefix = OP_NONE) {
+    node.Op = op;
+    node.Prefix = prefix;    // OP_NONE, OP_ADD, OP_SUB
+    node.Operand[0] = lhs.getIndex();
+    node.Operand[1] = rhs.getIndex();
+  }
+  static inline bool classof(ASTRef const* ref) {
+     return ref->getValueID() == BinaryExprID;
+  }
+  OpID getOp() const { return node().Op; }
+  OpID getPrefix() const { return node().Prefix; }
+  BaseExpAST getLHS() const { return BaseExpAST(Context, operand(0)); }
+  BaseExpAST getRHS() const { return BaseExpAST(Context, operand(1)); }
 };
 
 /**
   * 関数呼び出しを表すAST
   */
 class CallExprAST : public BaseExpAST {
-private:
-  std::string Callee;
-  std::vector<std::unique_ptr<BaseExpAST>> Args;
-
 public:
-  CallExprAST(const std::string &callee)
-    : BaseExpAST(CallExprID), Callee(callee) {}
-  ~CallExprAST() {}
-  std::string getCallee() { return Callee; }
-  size_t getArgSize() { return Args.size(); }
-  std::unique_ptr<BaseExpAST> getArgs(size_t i) {
-    if (i < Args.size()) return std::move(Args.at(i));
-    else return nullptr;
+  static const AstID ID = CallExprID;
+  using BaseExpAST::BaseExpAST;
+  static void build(ASTContext &context, ASTNode &node, uint32_t decl, llvm::ArrayRef<BaseExpAST> args) {
+    node.Operand[0] = decl;
+    node.Operand[1] = context.addList(args);
   }
-  static inline bool classof(CallExprAST const*) { return true; }
-  static inline bool classof(BaseExpAST const* base) {
-    return base->getValueID() == CallExprID;
+  static inline bool classof(ASTRef const* ref) {
+    return ref->getValueID() == CallExprID;
   }
-  void addArg(std::unique_ptr<BaseExpAST> arg) {
-    Args.push_back(std::move(arg));
+  uint32_t getDecl() const { return operand(0); }
+  SymbolID getCallee() const { return name(getDecl()); }
+  size_t getArgSize() const { return list(1).size(); }
+  ASTList<BaseExpAST> getArgs() const { return ASTList<BaseExpAST>(Context, list(1)); }
+  BaseExpAST getArgs(size_t i) const {
+    if (i < getArgSize()) return BaseExpAST(Context, list(1)[i]);
+    else return nullptr;
   }
-  int getNumOfArgs() { return (int)Args.size(); }
+  int getNumOfArgs() const { return (int)getArgSize(); }
 };
 
 /**
   * 変数参照式を表すAST
+  * 参照先の宣言は、構文解析がブロックを出るときに ASTContext::resolve で設定する
   */
 class VariableAST : public BaseExpAST{
-private:
-  std::string Name;
-
 public:
-  VariableAST(const std::string &name) : BaseExpAST(VariableID), Name(name) {}
-  ~VariableAST(){}
-  static inline bool classof(VariableAST const*) { return true; }
-  static inline bool classof(BaseExpAST const* base) {
-    return base->getValueID() == VariableID;
+  static const AstID ID = VariableID;
+  using BaseExpAST::BaseExpAST;
+  static void build(ASTContext &, ASTNode &) {}
+  static inline bool classof(ASTRef const* ref) {
+    return ref->getValueID() == VariableID;
   }
-  std::string getName() { return Name; }
+  uint32_t getDecl() const { return operand(0); }
+  SymbolID getName() const { return name(getDecl()); }
 };
 
 
@@ -427,17 +613,78 @@ public:
   * 整数式を表すAST
   */
 class NumberAST : public BaseExpAST {
-private:
-  int Val;
+public:
+  static const AstID ID = NumberID;
+  using BaseExpAST::BaseExpAST;
+  static void build(ASTContext &, ASTNode &node, int val) {
+    node.Operand[0] = (uint32_t)val;
+  }
+  int getNumberValue() const { return (int)operand(0); }
+  static inline bool classof(ASTRef const* ref) {
+    return ref->getValueID() == NumberID;
+  }
+};
 
+/**
+  * ASTのビジタ（CRTP）
+  * 文・式の種類ごとに Derived::visitXXX を呼び分ける。
+  * 定義していない種類は visitStmt / visitExp に回され、既定では何もしない。
+  * 子ノードはたどらないので、必要なら各 visitXXX から visit() を呼ぶ
+  * @param Derived   派生クラス
+  * @param StmtRetTy 文を訪問したときの戻り値の型
+  * @param ExpRetTy  式を訪問したときの戻り値の型
+  */
+template<typename Derived, typename StmtRetTy = void, typename ExpRetTy = StmtRetTy>
+class ASTVisitor {
 public:
-  NumberAST(int val) : BaseExpAST(NumberID), Val(val) {};
-  ~NumberAST() {}
-  int getNumberValue() { return Val; }
-  static inline bool classof(NumberAST const*){ return true; }
-  static inline bool classof(BaseExpAST const* base) {
-    return base->getValueID() == NumberID;
+  StmtRetTy visit(BaseStmtAST stmt) {
+    switch (stmt.getValueID()) {
+    case NullID:     return derived().visitNull(stmt.castAs<NullAST>());
+    case AssignID:   return derived().visitAssign(stmt.castAs<AssignAST>());
+    case BeginEndID: return derived().visitBeginEnd(stmt.castAs<BeginEndAST>());
+    case IfThenID:   return derived().visitIfThen(stmt.castAs<IfThenAST>());
+    case WhileDoID:  return derived().visitWhileDo(stmt.castAs<WhileDoAST>());
+    case ReturnID:   return derived().visitReturn(stmt.castAs<ReturnAST>());
+    case WriteID:    return derived().visitWrite(stmt.castAs<WriteAST>());
+    case WritelnID:  return derived().visitWriteln(stmt.castAs<WritelnAST>());
+    default:
+      llvm_unreachable("unknown statement AST");
+    }
+  }
+
+  ExpRetTy visit(BaseExpAST exp) {
+    switch (exp.getValueID()) {
+    case CondExpID:    return derived().visitCondExp(exp.castAs<CondExpAST>());
+    case BinaryExprID: return derived().visitBinaryExpr(exp.castAs<BinaryExprAST>());
+    case CallExprID:   return derived().visitCallExpr(exp.castAs<CallExprAST>());
+    case VariableID:   return derived().visitVariable(exp.castAs<VariableAST>());
+    case NumberID:     return derived().visitNumber(exp.castAs<NumberAST>());
+    default:
+      llvm_unreachable("unknown expression AST");
+    }
   }
+
+  // 既定の動作
+  StmtRetTy visitStmt(BaseStmtAST) { return StmtRetTy(); }
+  ExpRetTy visitExp(BaseExpAST) { return ExpRetTy(); }
+
+  StmtRetTy visitNull(NullAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitAssign(AssignAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitBeginEnd(BeginEndAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitIfThen(IfThenAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitWhileDo(WhileDoAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitReturn(ReturnAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitWrite(WriteAST stmt) { return derived().visitStmt(stmt); }
+  StmtRetTy visitWriteln(WritelnAST stmt) { return derived().visitStmt(stmt); }
+
+  ExpRetTy visitCondExp(CondExpAST exp) { return derived().visitExp(exp); }
+  ExpRetTy visitBinaryExpr(BinaryExprAST exp) { return derived().visitExp(exp); }
+  ExpRetTy visitCallExpr(CallExprAST exp) { return derived().visitExp(exp); }
+  ExpRetTy visitVariable(VariableAST exp) { return derived().visitExp(exp); }
+  ExpRetTy visitNumber(NumberAST exp) { return derived().visitExp(exp); }
+
+private:
+  Derived &derived() { return *static_cast<Derived *>(this); }
 };
 
 #endif
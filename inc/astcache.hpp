@@ -0,0 +1,59 @@
+#ifndef ASTCACHE_HPP
+#define ASTCACHE_HPP
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include "ast.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+  * ASTのファイル形式（ホストのバイト順、各部分は4バイト境界に並ぶ）
+  *   ヘッダ, ノード配列, リスト配列, 宣言の配列,
+  *   識別子の開始位置（識別子数+1個）, 識別子の文字列（連結したもの）
+  * ノード・リスト・宣言はASTContextの配列そのままなので、読み込みは配列のコピーだけで済む。
+  * ノードの中身は調べずに使うので、ヘッダの後ろ全体のハッシュ値を記録して壊れたファイルを見分ける
+  */
+struct ASTCacheHeader {
+  char Magic[4];          // "PL0A"
+  uint32_t Version;       // ASTの形式を変えたら上げる
+  uint64_t SourceHash;    // ソースの内容のハッシュ値
+  uint64_t SourceSize;    // ソースの大きさ
+  uint64_t PayloadHash;   // ヘッダより後ろのハッシュ値
+  uint32_t NumNodes;
+  uint32_t NumLists;
+  uint32_t NumDecls;
+  uint32_t NumNames;
+  uint32_t NameBytes;
+  uint32_t Root;          // プログラムのBlockASTの添字
+};
+
+static_assert(sizeof(ASTCacheHeader) % 4 == 0, "the arrays after the header are 4-byte aligned");
+
+/**
+  * 構文解析したASTのキャッシュ
+  * ソースの内容のハッシュ値をファイル名にしてディレクトリに保存し、
+  * 同じ内容のソースであれば字句解析・構文解析をせずにASTを読み込む
+  */
+class ASTCache {
+private:
+  std::string Dir;
+
+public:
+  static const uint32_t VERSION = 2;
+
+  explicit ASTCache(llvm::StringRef dir) : Dir(dir) {}
+
+  std::unique_ptr<ProgramAST> load(llvm::StringRef source) const;
+  bool store(llvm::StringRef source, const ProgramAST &program) const;
+
+  static uint64_t hash(llvm::StringRef source);
+  static void write(const ProgramAST &program, llvm::StringRef source, llvm::raw_ostream &out);
+  static std::unique_ptr<ProgramAST> read(llvm::StringRef data, llvm::StringRef source);
+
+private:
+  std::string path(llvm::StringRef source) const;
+};
+
+#endif  // #ifndef ASTCACHE_HPP
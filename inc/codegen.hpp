@@ -1,6 +1,8 @@
 #ifndef CODEGEN_HPP
 #define CODEGEN_HPP
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/DerivedTypes.h>
@@ -11,51 +13,117 @@
 #include <llvm/IR/Value.h>
 #include "table.hpp"
 #include "ast.hpp"
+#include "effect.hpp"
 
-class CodeGen {
+/**
+  * LLVM IRの生成
+  * 文と式は ASTVisitor で種類ごとに振り分ける。
+  * 入れ子の文・式は再帰せず、作業スタックに積んで生成する。
+  * SSAモードでは変数・パラメタに alloca を使わず、Braun らの方法で
+  * 代入の値をブロックごとに覚え、合流点に phi を置いてSSA形式を直接作る
+  * （内側の関数から参照される変数・パラメタはメモリに置く）。
+  * 内側の関数から参照される main の変数は大域変数に置き、それ以外の関数の変数・パラメタは
+  * 参照する関数に alloca のアドレスを引数で渡す
+  */
+class CodeGen : public ASTVisitor<CodeGen, void, llvm::Value *> {
 public:
-  CodeGen(std::string name) :
+  CodeGen(std::string name, bool ssa = false) :
     TheContext(), TheModule(llvm::make_unique<llvm::Module>(name, TheContext)),
-    TheBuilder(TheContext) {
+    TheBuilder(TheContext), SSA(ssa), Failed(false) {
       setLibraries();
     }
   ~CodeGen();
 
-  void generate(std::unique_ptr<ProgramAST> program);
+  bool generate(std::unique_ptr<ProgramAST> program);
   std::unique_ptr<llvm::Module> getModule() { return std::move(TheModule); }
 
 public:
-  void block(std::unique_ptr<BlockAST> block_ast, llvm::Function *func);
-
-  void constant(std::unique_ptr<ConstDeclAST>);
-  void variable(std::unique_ptr<VarDeclAST>);
-  void function(std::unique_ptr<FuncDeclAST>);
-  void statement(std::unique_ptr<BaseStmtAST>);
-  void statementAssign(std::unique_ptr<AssignAST> stmt_ast);
-  void statementIf(std::unique_ptr<IfThenAST> stmt_ast);
-  void statementWhile(std::unique_ptr<WhileDoAST> stmt_ast);
-
-  llvm::Value *condition(std::unique_ptr<CondExpAST> exp_ast);
-  llvm::Value *expression(std::unique_ptr<BaseExpAST> exp_ast);
-  llvm::Value *binaryExp(std::unique_ptr<BinaryExprAST> exp_ast);
-  llvm::Value *callExp(std::unique_ptr<CallExprAST> exp_ast);
-  llvm::Value *variableExp(std::unique_ptr<VariableAST> exp_ast);
-  llvm::Value *numberExp(std::unique_ptr<NumberAST> exp_ast);
+  void block(BlockAST block_ast, llvm::Function *func,
+             llvm::ArrayRef<uint32_t> params = llvm::None);
+
+  void constant(ConstDeclAST const_ast);
+  void variable(VarDeclAST var_ast);
+  void function(FuncDeclAST func_ast);
+
+  void statement(BaseStmtAST stmt_ast);
+  llvm::Value *expression(BaseExpAST exp_ast);
+
+  // 文: 中の文は StmtStack に積む
+  void visitAssign(AssignAST stmt_ast);
+  void visitBeginEnd(BeginEndAST stmt_ast);
+  void visitIfThen(IfThenAST stmt_ast);
+  void visitWhileDo(WhileDoAST stmt_ast);
+  void visitReturn(ReturnAST stmt_ast);
+  void visitWrite(WriteAST stmt_ast);
+  void visitWriteln(WritelnAST stmt_ast);
+
+  // 式: 子の値は生成済みで、Values の末尾に左から順に積まれている
+  llvm::Value *visitCondExp(CondExpAST exp_ast);
+  llvm::Value *visitBinaryExpr(BinaryExprAST exp_ast);
+  llvm::Value *visitCallExpr(CallExprAST exp_ast);
+  llvm::Value *visitVariable(VariableAST exp_ast);
+  llvm::Value *visitNumber(NumberAST exp_ast);
 
 private:
   void setLibraries();
-  llvm::CmpInst::Predicate token_to_inst(std::string op);
+  llvm::Function *createFunction(llvm::FunctionType *type, const llvm::Twine &name);
+  void setAttributes(llvm::Function *func, uint32_t decl);
+  llvm::CallInst *createCall(llvm::Function *func, llvm::ArrayRef<llvm::Value *> args = llvm::None);
+  llvm::CmpInst::Predicate token_to_inst(OpID op);
+  llvm::Value *lookup(uint32_t decl);
+  static bool isMemory(llvm::Value *value);
+  llvm::Value *undefined();
+  llvm::Value *popValue();
+
+  // SSAモード
+  void writeVariable(uint32_t decl, llvm::BasicBlock *block, llvm::Value *value);
+  llvm::Value *readVariable(uint32_t decl, llvm::BasicBlock *block);
+  llvm::PHINode *createPhi(uint32_t decl, llvm::BasicBlock *block);
+  void addPhiOperands(uint32_t decl, llvm::PHINode *phi);
+  void removeTrivialPhis(llvm::SmallVectorImpl<llvm::PHINode *> &phis);
+  llvm::Value *resolvePhi(llvm::Value *value);
+  void sealBlock(llvm::BasicBlock *block);
 
 private:
   llvm::LLVMContext TheContext;
   std::unique_ptr<llvm::Module> TheModule;
   llvm::IRBuilder<> TheBuilder;
   std::unique_ptr<ProgramAST> Program;
+  std::shared_ptr<StringInterner> Names;
+  std::unique_ptr<EffectAnalysis> Effects;
 
   llvm::Function *curFunc;
   llvm::Function *writeFunc;
   llvm::Function *writelnFunc;
-  CodeTable ident_table;
+  bool SSA;                    // 変数をSSA形式で生成する
+  bool Failed;                 // エラーがあった
+  std::vector<llvm::Value *> Slots;   // 宣言の番号 -> 値（構文解析で名前を解決済み）
+
+  /**
+    * 後で生成する文、またはif/whileの中の文を生成し終えた後の分岐
+    */
+  struct StmtWork {
+    BaseStmtAST Stmt;            // 生成する文（なければ分岐を生成する）
+    llvm::BasicBlock *Target;    // 分岐先
+    llvm::BasicBlock *Merge;     // 続きを生成するブロック
+
+    StmtWork(BaseStmtAST stmt) : Stmt(stmt), Target(nullptr), Merge(nullptr) {}
+    StmtWork(llvm::BasicBlock *target, llvm::BasicBlock *merge) : Target(target), Merge(merge) {}
+  };
+  std::vector<StmtWork> StmtStack;
+  static const uint32_t EXPANDED = 1u << 31;          // ExpStack: 子を積み終えた
+  std::vector<uint32_t> ExpStack;                      // 生成する式のノード
+  std::vector<llvm::Value *> Values;                  // 生成した式の値
+
+  /**
+    * SSAモードの変数の値
+    * (ブロック, 宣言の番号) -> ブロックの終わりでの値（置き換えた phi なら Replaced でたどる）
+    */
+  llvm::DenseMap<std::pair<llvm::BasicBlock *, uint32_t>, llvm::Value *> CurrentDef;
+  llvm::DenseMap<llvm::PHINode *, llvm::Value *> Replaced;   // 置き換えた phi -> 置き換えた値
+  std::vector<std::pair<llvm::PHINode *, uint32_t>> Phis;   // 置いた phi と変数（名前は最後に付ける）
+  llvm::SmallPtrSet<llvm::BasicBlock *, 32> Sealed;   // 先行ブロックが出そろったブロック
+  llvm::DenseMap<llvm::BasicBlock *, std::vector<std::pair<uint32_t, llvm::PHINode *>>> IncompletePhis;
 };
 
 #endif
@@ -0,0 +1,150 @@
+#ifndef DIAGNOSTICS_HPP
+#define DIAGNOSTICS_HPP
+
+#include "llvm/ADT/StringRef.h"
+#include "interner.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TokenStream;
+
+/**
+  * 診断の重要度
+  */
+enum DiagLevel : uint8_t {
+  DIAG_ERROR,
+  DIAG_WARN,
+  DIAG_NOTE,       // 位置・接頭辞なしで出力する補足
+};
+
+/**
+  * 診断の種類（メッセージの雛形）
+  */
+enum DiagID : uint8_t {
+  DIAG_MESSAGE,          // %0
+  DIAG_EXPECTED,         // expected '%0' but '%1'
+  DIAG_UNEXPECTED,       // unexpected '%0': deleted
+  DIAG_UNDEFINED_FUNC,   // undefined func %0(%1)
+  DIAG_MISSING,          // missing '%0': inserted
+  DIAG_DUPLICATE,        // duplicate %0 %1: ignored
+  DIAG_SKIP,             // delete %0 and skip to a new statement
+  DIAG_DUPLICATE_FACTOR, // fact + id/num %0: missing opcode
+  DIAG_ADD_TEMP,         // add %0 to name table temporarily
+  DIAG_DELETE_TEMP,      // delete %0 from name table
+  DIAG_UNDEFINED,        // %0 is undefined
+  DIAG_ERROR_COUNT,      // %0 error(s)
+  DIAG_TOO_MANY,         // too many errors
+};
+
+/**
+  * 診断の引数
+  * 文字列はコピーせず、識別子・ソース上の範囲・静的文字列として参照する
+  */
+struct DiagArg {
+  enum Kind : uint8_t {
+    NONE,
+    INT,       // 整数
+    SYMBOL,    // 識別子（SymbolID）
+    RANGE,     // ソース上の範囲（Value: 位置, Length: 長さ）
+    TEXT,      // 静的な文字列
+    STRING,    // 診断エンジンが保持する文字列（Value: 番号）
+  };
+
+  Kind ArgKind;
+  uint32_t Length;
+  union {
+    int Value;
+    const char *Text;
+  };
+
+  DiagArg() : ArgKind(NONE), Length(0), Value(0) {}
+  static DiagArg integer(int value) { DiagArg a; a.ArgKind = INT; a.Value = value; return a; }
+  static DiagArg symbol(SymbolID id) { DiagArg a; a.ArgKind = SYMBOL; a.Value = id; return a; }
+  static DiagArg range(uint32_t offset, uint32_t length) {
+    DiagArg a; a.ArgKind = RANGE; a.Value = offset; a.Length = length; return a;
+  }
+  static DiagArg text(const char *text) { DiagArg a; a.ArgKind = TEXT; a.Text = text; return a; }
+};
+
+/**
+  * 診断1件分の記録
+  * メッセージは出力するときに組み立てる
+  */
+struct Diagnostic {
+  static const uint32_t NOLOC = UINT32_MAX;
+
+  DiagID ID;
+  DiagLevel Level;
+  uint32_t Loc;          // ソース上の位置（NOLOCなら位置なし）
+  DiagArg Args[2];
+
+  Diagnostic() : ID(DIAG_MESSAGE), Level(DIAG_ERROR), Loc(NOLOC) {}
+  Diagnostic(DiagID id, DiagLevel level, uint32_t loc, DiagArg arg0 = DiagArg(), DiagArg arg1 = DiagArg())
+    : ID(id), Level(level), Loc(loc), Args{arg0, arg1} {}
+};
+
+/**
+  * 出力形式
+  */
+enum DiagFormat {
+  DIAG_TEXT,       // [行:桁] error: メッセージ
+  DIAG_JSON,       // 1行に1件のJSONオブジェクト
+};
+
+/**
+  * 診断エンジン
+  * コンパイル単位ごとに診断を記録しておき、flush()でまとめて出力する
+  * エラーが多すぎる場合は以降の診断を捨てる（exitはしない）
+  * 出力先を文字列にすると、並列コンパイルでファイルごとの出力を後でまとめて書き出せる
+  */
+class Diagnostics {
+private:
+  static const int MAXERROR = 30;
+
+  FILE *Out;
+  std::string *Buffer;                       // nullptrでなければOutの代わりにここへ書く
+  DiagFormat Format;
+  std::vector<Diagnostic> Pending;           // 未出力の診断
+  std::vector<std::string> Strings;          // STRING引数の本体
+  const TokenStream *Source;                 // 位置の解決に使う
+  std::shared_ptr<StringInterner> Names;     // SYMBOL引数の解決に使う
+  int ErrorNum;
+  int ReportNum;                             // 記録した診断の数（警告を含む）
+  int MaxError;                              // これを超えたら以降の診断を捨てる
+  bool Full;                                 // エラーが多すぎる
+
+public:
+  Diagnostics(FILE *out = stderr, DiagFormat format = DIAG_TEXT)
+    : Out(out), Buffer(nullptr), Format(format), Source(nullptr), ErrorNum(0), ReportNum(0), MaxError(MAXERROR),
+      Full(false) {}
+  ~Diagnostics() { flush(); }
+
+  void setFormat(DiagFormat format) { Format = format; }
+  void setMaxError(int max) { MaxError = max; }
+  void setBuffer(std::string *buffer) { Buffer = buffer; }
+  void setSource(const TokenStream *source);
+  void setNames(std::shared_ptr<StringInterner> names) { Names = names; }
+  const TokenStream *getSource() const { return Source; }
+
+  void report(const Diagnostic &diag);
+  DiagArg copyString(const std::string &str);
+  void flush();
+  void write(llvm::StringRef text);
+  void take(std::vector<Diagnostic> &diags, std::vector<std::string> &strings);
+
+  int getErrorNum() const { return ErrorNum; }
+  int getReportNum() const { return ReportNum; }
+  bool tooMany() const { return Full; }
+
+private:
+  std::string message(const Diagnostic &diag) const;
+  std::string argText(const DiagArg &arg) const;
+  void renderText(const Diagnostic &diag, std::string &out) const;
+  void renderJSON(const Diagnostic &diag, std::string &out) const;
+  void output(llvm::StringRef text);
+};
+
+#endif  // #ifndef DIAGNOSTICS_HPP
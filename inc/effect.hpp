@@ -0,0 +1,107 @@
+#ifndef EFFECT_HPP
+#define EFFECT_HPP
+
+#include "ast.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+  * 関数の副作用の解析（コード生成の前に行う）
+  * 関数ごとに、外側の変数の読み書き、write/writeln、止まらないかもしれないか（while・再帰）を
+  * 呼び出す関数の分も含めて求め、コード生成が関数の属性を付けるのに使う。
+  * 内側の関数から参照される変数・パラメタと、関数ごとに外側の関数から受け取る変数も求める
+  * （mainの変数は大域変数に置き、それ以外は呼び出し元がアドレスを渡す）。
+  *
+  * PL/0の関数は自分か外側のブロックで宣言された関数しか呼べないので、
+  * 呼び出し先は本体を生成し終えた関数か、生成中の外側の関数（自分を含む）のどちらかになる。
+  * 生成中の関数を呼べば再帰しうるとみなす（呼び出しの循環はこの呼び出しを通るものに限られる）
+  */
+class EffectAnalysis : public ASTVisitor<EffectAnalysis> {
+public:
+  /**
+    * 副作用の種類
+    */
+  enum Effect : uint8_t {
+    EFF_NONE = 0,
+    EFF_READ = 1,        // 外側の変数を読む
+    EFF_WRITE = 2,       // 外側の変数に代入する
+    EFF_OUTPUT = 4,      // write/writeln
+    EFF_LOOP = 8,        // 止まらないかもしれない（while・再帰）
+  };
+
+  explicit EffectAnalysis(const ProgramAST &program)
+    : Context(program.getContext()), Program(program), Current(NOFUNC) {}
+
+  void analyze();
+
+  /**
+    * 関数の副作用（呼び出す関数の分を含む）
+    */
+  unsigned getEffects(uint32_t decl) const { return Funcs[decl].Effects; }
+  /**
+    * 関数が自分を呼び出しうるか
+    */
+  bool isRecursive(uint32_t decl) const { return Funcs[decl].Recursive; }
+  /**
+    * 変数・パラメタが内側の関数から参照されるか
+    */
+  bool isShared(uint32_t decl) const { return Shared[decl]; }
+  /**
+    * 内側の関数から参照される main の変数か（大域変数に置く）
+    */
+  bool isGlobal(uint32_t decl) const { return Shared[decl] && Owners[decl] == NOFUNC; }
+  /**
+    * 関数が参照する、main 以外の外側の関数の変数・パラメタ（呼び出す関数の分を含む）
+    */
+  llvm::ArrayRef<uint32_t> getFreeVars(uint32_t decl) const { return Funcs[decl].FreeVars; }
+
+public:
+  void block(BlockAST block_ast, llvm::ArrayRef<uint32_t> params = llvm::None);
+  void statement(BaseStmtAST stmt_ast);
+  void expression(BaseExpAST exp_ast);
+
+  // 文: 中の文と式は作業スタックに積む
+  void visitAssign(AssignAST stmt_ast);
+  void visitBeginEnd(BeginEndAST stmt_ast);
+  void visitIfThen(IfThenAST stmt_ast);
+  void visitWhileDo(WhileDoAST stmt_ast);
+  void visitReturn(ReturnAST stmt_ast);
+  void visitWrite(WriteAST stmt_ast);
+  void visitWriteln(WritelnAST stmt_ast);
+
+private:
+  static const uint32_t NOFUNC = ASTContext::NOIDX;   // main
+
+  /**
+    * 関数ごとの情報（関数の宣言の番号で引く）
+    */
+  struct FuncInfo {
+    unsigned Effects = EFF_NONE;
+    unsigned Depth = 0;             // 入れ子の深さ（main の直下が1）
+    unsigned UpLevel = UINT32_MAX;  // 呼びうる生成中の関数の最も浅い深さ
+    bool Active = false;            // 本体をたどっている
+    bool Recursive = false;
+    std::vector<uint32_t> Calls;    // 呼び出す関数
+    std::vector<uint32_t> FreeVars; // 外側の関数から受け取る変数・パラメタ（宣言の番号の昇順）
+  };
+
+  void use(uint32_t decl, Effect effect);
+  void call(uint32_t decl);
+  void propagate();
+  bool addFreeVars(uint32_t decl, llvm::ArrayRef<uint32_t> vars);
+
+private:
+  const ASTContext &Context;
+  const ProgramAST &Program;
+  std::vector<FuncInfo> Funcs;        // 宣言の番号 -> 関数の情報
+  std::vector<uint32_t> Owners;       // 宣言の番号 -> 宣言した関数（変数・パラメタ）
+  std::vector<bool> IsVar;            // 宣言の番号 -> 変数・パラメタか
+  std::vector<bool> Shared;           // 宣言の番号 -> 内側の関数から参照される
+  std::vector<uint32_t> Finished;     // 本体をたどり終えた順の関数
+  uint32_t Current;                   // たどっている関数
+
+  std::vector<BaseStmtAST> StmtStack;
+  std::vector<uint32_t> ExpStack;
+};
+
+#endif  // #ifndef EFFECT_HPP
@@ -0,0 +1,95 @@
+#ifndef FOLD_HPP
+#define FOLD_HPP
+
+#include "ast.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+  * ASTの定数畳み込み（コード生成の前に行う）
+  * 定数の参照を値に置き換え、値の決まる算術式を NumberAST に畳み込む。
+  * 条件が定数の if は中の文か空文に、入るときの条件が偽の while は空文に置き換える。
+  * ノードはその場で書き換えるので、置き換えられた子ノードは参照されないまま残る。
+  *
+  * 消す文の中にコード生成がエラーにするもの（未定義の名前、変数でないものへの代入、
+  * 引数の数の違う呼び出し）があれば、診断が変わらないよう消さずに残す。
+  * 名前が使えるかどうかは宣言の順（定数, 変数, パラメタ, 関数, 文）にたどって判断する。
+  * 内側の関数は外側の関数の変数・パラメタを使える（コード生成はアドレスを引数に足して渡す）
+  */
+class ConstantFolder : public ASTVisitor<ConstantFolder> {
+public:
+  explicit ConstantFolder(ProgramAST &program)
+    : Context(program.getContext()), Program(program), Errors(0), NumFolded(0), NumDeleted(0) {}
+
+  void fold();
+
+  unsigned getNumFolded() const { return NumFolded; }
+  unsigned getNumDeleted() const { return NumDeleted; }
+
+public:
+  void block(BlockAST block_ast, llvm::ArrayRef<uint32_t> params = llvm::None);
+  void statement(BaseStmtAST stmt_ast);
+
+  // 文: 中の文は StmtStack に積む
+  void visitAssign(AssignAST stmt_ast);
+  void visitBeginEnd(BeginEndAST stmt_ast);
+  void visitIfThen(IfThenAST stmt_ast);
+  void visitWhileDo(WhileDoAST stmt_ast);
+  void visitReturn(ReturnAST stmt_ast);
+  void visitWrite(WriteAST stmt_ast);
+
+private:
+  /**
+    * 宣言の種類（コード生成で使えるようになったもの）
+    */
+  enum DeclKind : uint8_t {
+    DECL_NONE,
+    DECL_CONST,
+    DECL_VAR,        // 変数・パラメタ（内側の関数からも使える）
+    DECL_FUNC,
+  };
+
+  /**
+    * 式の値
+    */
+  struct Value {
+    bool Known;      // 値が決まる
+    int64_t Num;
+  };
+
+  /**
+    * 後でたどる文、またはif/whileの中の文をたどり終えた後の書き換え
+    */
+  struct StmtWork {
+    BaseStmtAST Stmt;            // たどる文（なければ書き換える）
+    uint32_t Target;             // 書き換える if/while のノード
+    uint32_t Replace;            // 置き換えるノード（NOIDXなら空文）
+    unsigned Errors;             // 中の文をたどる前のエラーの数
+
+    StmtWork(BaseStmtAST stmt) : Stmt(stmt), Target(ASTContext::NOIDX), Replace(ASTContext::NOIDX), Errors(0) {}
+    StmtWork(uint32_t target, uint32_t replace, unsigned errors)
+      : Target(target), Replace(replace), Errors(errors) {}
+  };
+
+  Value expression(BaseExpAST exp_ast);
+  Value evaluate(BaseExpAST exp);
+  void use(uint32_t decl, DeclKind kind);
+  void replace(uint32_t index, uint32_t with);
+  void setNumber(uint32_t index, int64_t value);
+
+private:
+  ASTContext &Context;
+  ProgramAST &Program;
+  std::vector<DeclKind> Kinds;       // 宣言の番号 -> 種類
+  std::vector<int> Numbers;          // 宣言の番号 -> 定数の値・関数の引数の数
+  unsigned Errors;                   // コード生成がエラーにするものの数
+  unsigned NumFolded;
+  unsigned NumDeleted;
+
+  std::vector<StmtWork> StmtStack;
+  static const uint32_t EXPANDED = 1u << 31;   // ExpStack: 子を積み終えた
+  std::vector<uint32_t> ExpStack;               // たどる式のノード
+  std::vector<Value> Values;                    // たどった式の値
+};
+
+#endif  // #ifndef FOLD_HPP
@@ -0,0 +1,61 @@
+#ifndef INCREMENTAL_HPP
+#define INCREMENTAL_HPP
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "ast.hpp"
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+  * インクリメンタル構文解析（エディタ連携・構文チェック用）
+  * ソース・AST・関数定義の記録・診断を保持しておき、編集を受け取ると、
+  * 編集を含む最も内側の関数のブロックだけを字句解析・構文解析し直してASTと診断を差し替える。
+  * 差し替えられない編集（関数のブロックの外、ブロックの最初・最後のトークンにかかるもの、
+  * 解析し直した結果がブロックの外に影響するもの）では全体を解析し直す
+  */
+class IncrementalParser {
+private:
+  std::string FileName;
+  std::string Text;                              // 今のソース
+  std::shared_ptr<StringInterner> Names;
+  std::unique_ptr<ProgramAST> Program;           // nullptrならプログラムのブロックの解析に失敗した
+  std::unique_ptr<TokenStream> Tokens;           // 最後に解析したTokenStream（診断の位置の解決に使う）
+  std::vector<FuncRecord> Funcs;                 // 関数定義の記録（診断の番号はDiagsの添字）
+  std::vector<Diagnostic> Diags;                 // 構文解析の診断（件数の上限なしで記録したもの）
+  std::vector<std::string> Strings;              // DiagsのSTRING引数の本体
+  bool Result;                                   // Parser::parseProgramの結果
+  bool Exact;                                    // ASTから名前表を復元できる
+  size_t LiveNodes;                              // 最後に全体を解析したときのノード数
+  unsigned NumFull;
+  unsigned NumIncremental;
+
+public:
+  IncrementalParser(llvm::StringRef filename, llvm::StringRef text);
+  ~IncrementalParser() {}
+
+  bool edit(uint32_t offset, uint32_t length, llvm::StringRef text);
+  bool report(FILE *out, DiagFormat format, std::string *buffer = nullptr) const;
+
+  llvm::StringRef getText() const { return Text; }
+  const ProgramAST *getProgram() const { return Program.get(); }
+  unsigned getNumFull() const { return NumFull; }
+  unsigned getNumIncremental() const { return NumIncremental; }
+
+private:
+  void parseAll();
+  int findFunction(uint32_t begin, uint32_t end) const;
+  bool reparse(int index, uint32_t offset, uint32_t length, uint32_t size);
+  void splice(int index, uint32_t edit_end, int delta, std::vector<FuncRecord> &records,
+              std::vector<Diagnostic> &diags);
+  std::unique_ptr<llvm::MemoryBuffer> buffer() const {
+    return llvm::MemoryBuffer::getMemBuffer(Text, FileName, false);
+  }
+};
+
+#endif  // #ifndef INCREMENTAL_HPP
@@ -0,0 +1,35 @@
+#ifndef INTERNER_HPP
+#define INTERNER_HPP
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+  * 識別子のID
+  */
+typedef uint32_t SymbolID;
+
+/**
+  * 識別子の文字列を一意なIDに変換して保持するクラス
+  * 文字列本体はアリーナに一度だけ確保され、字句解析・構文解析・コード生成で共有する
+  */
+class StringInterner {
+private:
+  llvm::StringMap<SymbolID, llvm::BumpPtrAllocator> Map;   // 文字列 -> ID
+  std::vector<llvm::StringRef> Strings;                      // ID -> 文字列
+
+public:
+  StringInterner() {}
+  ~StringInterner() {}
+
+  SymbolID intern(llvm::StringRef str);
+  llvm::StringRef get(SymbolID id) const { return Strings[id]; }
+  std::string str(SymbolID id) const { return Strings[id].str(); }
+  size_t size() const { return Strings.size(); }
+};
+
+#endif
@@ -2,6 +2,9 @@
 #define LEXER_HPP
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "diagnostics.hpp"
+#include "interner.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <fstream>
@@ -15,7 +18,24 @@
 enum TokenType {
   TOK_IDENTIFIER,  // 識別子
   TOK_DIGIT,       // 数字
-  TOK_SYMBOL,      // 記号
+// 記号
+  TOK_PLUS,        // +
+  TOK_MINUS,       // -
+  TOK_MUL,         // *
+  TOK_DIV,         // /
+  TOK_EQ,          // =
+  TOK_NE,          // <>
+  TOK_LT,          // <
+  TOK_LE,          // <=
+  TOK_GT,          // >
+  TOK_GE,          // >=
+  TOK_ASSIGN,      // :=
+  TOK_SEMICOLON,   // ;
+  TOK_COMMA,       // ,
+  TOK_PERIOD,      // .
+  TOK_LPAREN,      // (
+  TOK_RPAREN,      // )
+// キーワード
   TOK_CONST,       // Keyword: const
   TOK_VAR,         // Keyword: var
   TOK_FUNCTION,    // Keyword: function
@@ -32,13 +52,21 @@ enum TokenType {
   TOK_EOF          // EOF
 };
 
+inline bool isSymbolType(TokenType t) { return TOK_PLUS <= t && t <= TOK_RPAREN; }
+inline bool isKeyWordType(TokenType t) { return TOK_CONST <= t && t <= TOK_ODD; }
+
+/**
+  * 記号・キーワードの綴り（エラーメッセージ用）
+  */
+const char *tokenSpelling(TokenType t);
+
 struct TokenTypeStr : public std::string {
   TokenTypeStr(TokenType t) {
     if (t == TOK_IDENTIFIER)
       assign("ident");
     else if (t == TOK_DIGIT)
       assign("number");
-    else if (t == TOK_SYMBOL)
+    else if (isSymbolType(t))
       assign("symbol");
     else if (t == TOK_EOF)
       assign("eof");
@@ -47,69 +75,180 @@ struct TokenTypeStr : public std::string {
   }
 };
 
+class TokenStream;
+class LexerThread;
+
 /**
-  *個別トークン格納クラス
+  *個別トークン参照クラス
+  * トークンの種別・位置・値だけを保持する軽量なビュー
+  * 行番号・桁位置は必要になったときにTokenStreamに問い合わせる
   */
-typedef class Token {
-public:
-
+class Token {
 private:
+  const TokenStream *Stream;
+  int Index;
   TokenType Type;
-  std::string TokenString;
-  int Number;
-  int Line;
-  int Pos;       // トークンの最後の位置
-  Token *Prev;
+  uint32_t Offset;
+  uint32_t Length;
+  int Value;
 
 public:
-  Token(){};
-  Token(TokenType type, std::string string, int line, int pos, Token *prev)
-    : Type(type), TokenString(string), Line(line), Pos(pos), Prev(prev){
-    if (type == TOK_DIGIT)
-      Number = atoi(string.c_str());
-    else
-      Number = 0x7fffffff;
-  };
+  Token(const TokenStream *stream, int index, TokenType type, uint32_t offset, uint32_t length, int value)
+    : Stream(stream), Index(index), Type(type), Offset(offset), Length(length), Value(value) {}
   ~Token(){};
 
-  const TokenType &getTokenType() const { return Type; };
-  const std::string &getTokenString() const { return TokenString; };
-  int getNumberValue() { return Number; };
-  bool setLine(int line) { Line = line; return true; }
-  const int &line() const { return Line; }
-  const int &pos() const { return Pos; }
-  const Token *prev() const { return Prev; }
-} Token;
+  TokenType getTokenType() const { return Type; }
+  llvm::StringRef getTokenString() const;
+  int getNumberValue() const { return Value; }
+  SymbolID getSymbol() const { return Value; }
+  int line() const;
+  int column() const;    // トークンの最初の位置（1始まり）
+  int pos() const { return column() + (int)Length - 1; }  // トークンの最後の位置（1始まり）
+  uint32_t offset() const { return Offset; }
+  uint32_t length() const { return Length; }
+  Token prev() const;
+  int index() const { return Index; }
+};
+
+/**
+  * バッファからトークンを1つずつ切り出すクラス
+  */
+class Lexer {
+private:
+  const char *Base;
+  const char *Cur;
+  const char *End;
+  const char *LineHead;     // 現在行の先頭
+  StringInterner *Names;               // nullptrなら識別子を登録しない（値は0）
+  std::vector<uint32_t> *LineStarts;   // nullptrなら行頭位置を記録しない
+  std::vector<Diagnostic> *Errors;     // nullptrならエラーを診断エンジンに記録する
+
+public:
+  Lexer(llvm::StringRef source, StringInterner *names, std::vector<uint32_t> *line_starts = nullptr)
+    : Base(source.begin()), Cur(source.begin()), End(source.end()), LineHead(source.begin()),
+      Names(names), LineStarts(line_starts), Errors(nullptr) {}
+  ~Lexer() {}
+
+  TokenType next(uint32_t &offset, uint32_t &length, int &value);
+  void deferErrors(std::vector<Diagnostic> *errors) { Errors = errors; }
+
+  /**
+    * offsetの位置（トークンの先頭）から切り出しを続ける（インクリメンタル解析）
+    */
+  void seek(uint32_t offset) { Cur = LineHead = Base + offset; }
+
+private:
+  void error(const Diagnostic &diag);
+  void newLine() {
+    LineHead = Cur;
+    if (LineStarts)
+      LineStarts->push_back(Cur - Base);
+  }
+};
 
 /**
   * 切り出したToken格納用クラス
+  * トークンは種別・ソース上の位置・長さ・値を別々の配列に格納する
+  * 行番号・桁位置は行頭位置の表から必要なときに計算する
+  *
+  * Lexerを持つ場合は必要になった時点でトークンを切り出し、
+  * 固定長のリングバッファに格納する（ファイル全体のトークン列は保持しない）
+  * LexerThreadを持つ場合は別スレッドで切り出されたトークンをキューから受け取る
   */
 class TokenStream {
 private:
-    std::vector<Token> Tokens;
+    static const int RINGSIZE = 16;               // リングバッファの大きさ（2の冪）
+
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;   // ソースコード
+    std::vector<uint8_t> Kinds;                   // TokenType
+    std::vector<uint32_t> Offsets;                // ソース上の開始位置
+    std::vector<uint32_t> Lengths;                // 長さ
+    std::vector<int> Values;                      // 数字: 値, 識別子: SymbolID
+    std::vector<uint32_t> LineStarts;             // 各行の先頭位置
     int CurIndex;
+    int Filled;                                   // 切り出し済みのトークン数
+    std::shared_ptr<StringInterner> Names;        // 識別子表（ASTと共有する）
+    std::unique_ptr<Lexer> OnDemand;              // オンデマンド字句解析用
+    std::unique_ptr<LexerThread> Pipeline;        // 字句解析スレッド
+
+    // 行頭位置の表を持たない場合の行番号計算用キャッシュ
+    mutable uint32_t CacheOffset;
+    mutable uint32_t CacheLineHead;
+    mutable int CacheLine;
 
 public:
-    TokenStream(): CurIndex(0) {}
+    TokenStream();
+    TokenStream(std::unique_ptr<llvm::MemoryBuffer> buffer, bool threaded = false);
+    TokenStream(std::unique_ptr<llvm::MemoryBuffer> buffer, std::shared_ptr<StringInterner> names, uint32_t start);
     ~TokenStream();
 
+    void setBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer) { Buffer = std::move(buffer); }
+    llvm::StringRef getSource() const { return Buffer->getBuffer(); }
+    std::vector<uint32_t> *getLineStarts() { return &LineStarts; }
+    void addLineStart(uint32_t offset) { LineStarts.push_back(offset); }
+    void reserve(size_t size);
+
     bool getNextToken();
-    bool pushToken(Token token) {
-      Tokens.push_back(token);
+    bool pushToken(TokenType type, uint32_t offset, uint32_t length, int value = 0) {
+      if (isStreaming()) {
+        int slot = Filled & (RINGSIZE - 1);
+        Kinds[slot] = type;
+        Offsets[slot] = offset;
+        Lengths[slot] = length;
+        Values[slot] = value;
+      } else {
+        Kinds.push_back(type);
+        Offsets.push_back(offset);
+        Lengths.push_back(length);
+        Values.push_back(value);
+      }
+      Filled++;
       return true;
     }
-    Token *getLastToken() {
-      return &Tokens.back();
+    bool pushIdentifier(uint32_t offset, llvm::StringRef name) {
+      return pushToken(TOK_IDENTIFIER, offset, name.size(), Names->intern(name));
+    }
+    Token getToken() const { return tokenAt(CurIndex); }
+    Token tokenAt(int i) const {
+      int s = slot(i);
+      return Token(this, i, (TokenType)Kinds[s], Offsets[s], Lengths[s], Values[s]);
     }
-    Token getToken();
-    TokenType getCurType() { return Tokens[CurIndex].getTokenType(); }
-    std::string getCurString() { return Tokens[CurIndex].getTokenString(); }
-    int getCurNumVal() { return Tokens[CurIndex].getNumberValue(); }
+    TokenType getCurType() const { return (TokenType)Kinds[slot(CurIndex)]; }
+    llvm::StringRef getCurString() const { int s = slot(CurIndex); return getSource().substr(Offsets[s], Lengths[s]); }
+    int getCurNumVal() const { return Values[slot(CurIndex)]; }
+    SymbolID getCurSymbol() const { return Values[slot(CurIndex)]; }
+    std::shared_ptr<StringInterner> getNames() const { return Names; }
+    llvm::StringRef getBufferName() const { return Buffer->getBufferIdentifier(); }
     bool printTokens();
     int getCurIndex() { return CurIndex; }
-    bool isSymbol(std::string str) { return getCurType() == TOK_SYMBOL && getCurString() == str; }
+    bool isType(TokenType type) const { return getCurType() == type; }
+
+    int getLine(uint32_t offset) const;
+    int getColumn(uint32_t offset) const;
+
+private:
+    bool isStreaming() const { return OnDemand || Pipeline; }
+    int slot(int i) const { return isStreaming() ? (i & (RINGSIZE - 1)) : i; }
+    bool fill();
+    void locate(uint32_t offset, int &line, uint32_t &line_head) const;
+};
+
+inline llvm::StringRef Token::getTokenString() const { return Stream->getSource().substr(Offset, Length); }
+inline int Token::line() const { return Stream->getLine(Offset); }
+inline int Token::column() const { return Stream->getColumn(Offset); }
+inline Token Token::prev() const { return Stream->tokenAt(Index > 0 ? Index - 1 : 0); }
+
+/**
+  * 字句解析時の入力の読み込み方法
+  */
+enum LexerMode {
+  LEXER_GETLINE,   // 1行ずつgetlineで読み込む
+  LEXER_BUFFER,    // ファイル全体をmmap(またはread)したバッファを走査する
+  LEXER_STREAM,    // バッファからトークンを必要になった時点で切り出す
+  LEXER_THREAD     // 別スレッドで切り出したトークンをキュー経由で受け取る
 };
 
-std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename);
+std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename, LexerMode mode = LEXER_STREAM);
+std::unique_ptr<TokenStream> LexicalAnalysis(std::unique_ptr<llvm::MemoryBuffer> buffer, LexerMode mode = LEXER_BUFFER);
 
 #endif  // #ifndef LEXER_HPP
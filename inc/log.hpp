@@ -2,105 +2,125 @@
 #define LOG_HPP
 
 #include <string>
-#include <iostream>
-#include <sstream>
+#include "diagnostics.hpp"
 #include "lexer.hpp"
 
+/**
+  * 診断出力用ヘルパ
+  * 診断はその時点の診断エンジンに記録され、flush()でまとめて出力される
+  * 診断エンジンはスレッドごとに切り替える（並列コンパイルではファイルごとに1つ）
+  */
 class Log {
 private:
-  static const int MAXERROR = 30;
-  static int error_num;
+  static thread_local Diagnostics *Engine;
+
+  static uint32_t location(const Token &token, bool prev) {
+    if (!prev)
+      return token.offset();
+    Token p = token.prev();
+    return p.offset() + p.length();   // 直前のトークンの次の位置
+  }
+
+  static void report(DiagID id, DiagLevel level, const Token &token, bool prev,
+                     DiagArg arg0 = DiagArg(), DiagArg arg1 = DiagArg()) {
+    engine().report(Diagnostic(id, level, location(token, prev), arg0, arg1));
+  }
+
+  static DiagArg text(const Token &token) {
+    return DiagArg::range(token.offset(), token.length());
+  }
 
 public:
-  static void error(const std::string &message, Token token, bool prev=false) {
-    int line, pos;
-    if (prev) {
-      line = token.prev()->line();
-      pos  = token.prev()->pos() + 1; // posは0始まりなので+1
-    } else {
-      line = token.line();
-      pos  = token.pos() - (int)token.getTokenString().size() + 1;
-    }
-    fprintf(stderr, "[% 3d:% 3d] error: %s\n", line, pos, message.c_str());
-    if (error_num++ > MAXERROR) {
-      fprintf(stderr, "too many errors\n");
-      exit(1);
-    }
+  /**
+    * このスレッドの診断エンジンを切り替える（nullptrなら既定のエンジン）
+    */
+  static void setEngine(Diagnostics *engine) { Engine = engine; }
+
+  static Diagnostics &engine() {
+    static thread_local Diagnostics Default;
+    return Engine ? *Engine : Default;
+  }
+
+  static void setSource(const TokenStream *source) { engine().setSource(source); }
+  static void releaseSource(const TokenStream *source);
+  static void setNames(std::shared_ptr<StringInterner> names) { engine().setNames(names); }
+  static void report(const Diagnostic &diag) { engine().report(diag); }
+  static void flush() { engine().flush(); }
+  static void write(llvm::StringRef text) { engine().write(text); }
+
+  static void error(const char *message, const Token &token, bool prev=false) {
+    report(DIAG_MESSAGE, DIAG_ERROR, token, prev, DiagArg::text(message));
   }
 
-  static void unexpectedError(const std::string &expected, const std::string &specified, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "expected '" << expected << "' but '" << specified << "'";
-    error(ss.str(), token, prev);
+  static void unexpectedError(const Token &token, bool prev=false) {
+    report(DIAG_UNEXPECTED, DIAG_ERROR, token, prev, text(token));
   }
 
-  static void unexpectedError(const std::string &specified, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "unexpected '" << specified << "': deleted";
-    error(ss.str(), token, prev);
+  static void undefinedFuncError(SymbolID name, int params, const Token &token, bool prev=false) {
+    report(DIAG_UNDEFINED_FUNC, DIAG_ERROR, token, prev, DiagArg::symbol(name), DiagArg::integer(params));
   }
 
-  static void undefinedFuncError(const std::string &name, int params, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "undefined func " << name << "(" << params << ")";
-    error(ss.str(), token, prev);
+  static void missingError(const char *insert, const Token &token, bool prev=false) {
+    report(DIAG_MISSING, DIAG_ERROR, token, prev, DiagArg::text(insert));
   }
 
-  static void missingError(const std::string &insert, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "missing '" << insert << "': inserted";
-    error(ss.str(), token, prev);
+  static void duplicateError(const char *type, SymbolID name, const Token &token, bool prev=false) {
+    report(DIAG_DUPLICATE, DIAG_ERROR, token, prev, DiagArg::text(type), DiagArg::symbol(name));
   }
 
-  static void duplicateError(const std::string &type, const std::string &name, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "duplicate " << type << " " << name << ": ignored";
-    error(ss.str(), token, prev);
+  static void skipError(const Token &token) {
+    report(DIAG_SKIP, DIAG_ERROR, token, false, text(token));
   }
 
-  static void skipError(const std::string &name, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "delete " << name << " and skip to a new statement";
-    error(ss.str(), token, prev);
+  static void duplicateFactorError(const Token &token) {
+    report(DIAG_DUPLICATE_FACTOR, DIAG_ERROR, token, false, text(token));
   }
 
-  static void duplicateFactorError(const std::string &name, Token token, bool prev=false) {
-    std::stringstream ss;
-    ss << "fact + id/num " << name << ": missing opcode";
-    error(ss.str(), token, prev);
+  static void undefinedError(SymbolID name) {
+    engine().report(Diagnostic(DIAG_UNDEFINED, DIAG_ERROR, Diagnostic::NOLOC, DiagArg::symbol(name)));
   }
 
-  static void error(const std::string &message, bool force_exit=false) {
-    fprintf(stderr, "%s\n", message.c_str());
-    if (error_num++ > MAXERROR) {
-      fprintf(stderr, "too many errors\n");
-      exit(1);
-    } else if (force_exit)
-      exit(1);
+  static void errorCount(int num) {
+    engine().report(Diagnostic(DIAG_ERROR_COUNT, DIAG_ERROR, Diagnostic::NOLOC, DiagArg::integer(num)));
   }
 
-  static void warn(const std::string &message, Token token) {
-    fprintf(stderr, "[% 3d:% 3d] warn: %s\n", token.line(), token.pos() - (int)token.getTokenString().size() + 1, message.c_str());
+  static void error(const char *message) {
+    engine().report(Diagnostic(DIAG_MESSAGE, DIAG_ERROR, Diagnostic::NOLOC, DiagArg::text(message)));
   }
 
-  static void addWarn(const std::string &name, Token token) {
-    std::stringstream ss;
-    ss << "add " << name << " to name table temporarily";
-    warn(ss.str(), token);
+  static void error(const std::string &message) {
+    Diagnostics &diags = engine();
+    diags.report(Diagnostic(DIAG_MESSAGE, DIAG_ERROR, Diagnostic::NOLOC, diags.copyString(message)));
   }
 
-  static void deleteWarn(const std::string &name, Token token) {
-    std::stringstream ss;
-    ss << "delete " << name << " from name table";
-    warn(ss.str(), token);
+  static void note(const std::string &message) {
+    Diagnostics &diags = engine();
+    diags.report(Diagnostic(DIAG_MESSAGE, DIAG_NOTE, Diagnostic::NOLOC, diags.copyString(message)));
   }
 
-  static void token(Token token) {
-      fprintf(stderr, "[% 3d:% 3d] TOKEN: %-10s (%s)\n", token.line(), token.pos() - (int)token.getTokenString().size() + 1, token.getTokenString().c_str(), TokenTypeStr(token.getTokenType()).c_str());
+  static void warn(const char *message, const Token &token) {
+    report(DIAG_MESSAGE, DIAG_WARN, token, false, DiagArg::text(message));
+  }
+
+  static void addWarn(SymbolID name, const Token &token) {
+    report(DIAG_ADD_TEMP, DIAG_WARN, token, false, DiagArg::symbol(name));
+  }
+
+  static void deleteWarn(SymbolID name, const Token &token) {
+    report(DIAG_DELETE_TEMP, DIAG_WARN, token, false, DiagArg::symbol(name));
+  }
+
+  static void token(const Token &token) {
+    flush();   // 字句解析エラーとの順序を保つ
+    fprintf(stderr, "[% 3d:% 3d] TOKEN: %-10s (%s)\n", token.line(), token.column(), token.getTokenString().str().c_str(), TokenTypeStr(token.getTokenType()).c_str());
   }
 
   static int getErrorNum() {
-    return error_num;
+    return engine().getErrorNum();
+  }
+
+  static bool tooMany() {
+    return engine().tooMany();
   }
 };
 
@@ -2,6 +2,7 @@
 #define PARSER_HPP
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 #include <algorithm>
 #include <cstdio>
 #include <cstdlib>
@@ -14,21 +15,112 @@
 #include "table.hpp"
 //using namespace llvm;
 
+/**
+  * 関数定義の記録（インクリメンタル解析用）
+  * 名前表に登録した関数ごとに、ブロックのソース上の範囲と解析中に記録された診断の範囲を持つ。
+  * 関数の先頭に出会った順（外側が先）に並ぶ
+  */
+struct FuncRecord {
+  uint32_t Decl;           // 関数名の宣言
+  SymbolID Name;
+  int NumParams;
+  uint32_t Node;           // FuncDeclASTの添字（ブロックの解析に失敗したら NOIDX）
+  int Parent;              // 外側の関数の記録の番号（-1ならプログラムのブロック）
+  uint32_t Prev;           // ブロックの直前のトークンの位置
+  uint32_t First;          // ブロックの最初のトークンの位置
+  uint32_t FirstEnd;       // ブロックの最初のトークンの終わり
+  uint32_t Last;           // ブロックの最後のトークンの位置
+  uint32_t End;            // ブロックの次のトークンの位置
+  TokenType EndType;       // ブロックの次のトークンの種別
+  int DiagBegin;           // ブロックの解析中に記録された診断（診断エンジンでの通し番号）
+  int DiagEnd;
+  bool Clean;              // ブロックの前後で一時的な名前表が空
+};
+
 /**
   * 構文解析・意味解析クラス
   */
 class Parser{
+  friend class IncrementalParser;
+
 private:
   static const int MINERROR = 30;
   bool Debug;
   std::unique_ptr<TokenStream> Tokens;
+  std::shared_ptr<StringInterner> Names;   // 識別子表
+  std::unique_ptr<ASTContext> Context;     // 平坦化したAST
   std::unique_ptr<ProgramAST> TheProgramAST;
 
   //意味解析用各種識別子表
   SymTable sym_table;      // 名前シンボルテーブル
 
+  /**
+    * 解析途中の複合文（begin/if/while）
+    */
+  struct StmtFrame {
+    AstID Kind;              // BeginEndID, IfThenID, WhileDoID
+    BaseExpAST Condition;    // if/while: 条件
+    size_t Begin;            // begin: StmtList での文の開始位置
+    Token Temp;              // if/while: 中の文の先頭（エラー位置）
+
+    StmtFrame(AstID kind, BaseExpAST condition, size_t begin, Token temp)
+      : Kind(kind), Condition(condition), Begin(begin), Temp(temp) {}
+  };
+
+  /**
+    * 解析途中の式が待っているもの
+    */
+  enum ExpState : uint8_t {
+    EXP_LHS,     // expression: 最初の項
+    EXP_RHS,     // expression: '+' / '-' の後の項
+    TERM_LHS,    // term: 最初の因子
+    TERM_RHS,    // term: '*' / '/' の後の因子
+    PAREN_EXP,   // '(' expression ')' の式
+    CALL_ARG,    // 関数呼び出しの引数
+  };
+
+  /**
+    * 解析途中の式
+    */
+  struct ExpFrame {
+    ExpState State;
+    OpID Op;                 // 読んだ演算子
+    OpID Prefix;             // expression: 符号
+    bool First;              // 関数呼び出し: 最初の引数
+    BaseExpAST LHS;          // ここまでに組み立てた式
+    Token Temp;              // エラー位置（関数呼び出しでは関数名）
+    SymbolID Callee;         // 関数呼び出し: 関数名
+    size_t ArgBegin;         // 関数呼び出し: ArgList での引数の開始位置
+
+    ExpFrame(ExpState state, Token temp)
+      : State(state), Op(OP_NONE), Prefix(OP_NONE), First(true), Temp(temp), Callee(0), ArgBegin(0) {}
+  };
+
+  /**
+    * 式の解析で次に行うこと
+    */
+  enum ExpStep : uint8_t {
+    START_EXP,     // expressionを読み始める
+    START_TERM,    // termを読み始める
+    START_FACTOR,  // factorを読む
+    RETURN_EXP,    // 読み終えた値を待っている状態に渡す
+  };
+
+  // 入れ子の文・式はネイティブスタックを使わずにここに積む
+  std::vector<StmtFrame> StmtStack;
+  llvm::SmallVector<BaseStmtAST, 16> StmtList;   // 解析途中のbeginの中の文
+  std::vector<ExpFrame> ExpStack;
+  llvm::SmallVector<BaseExpAST, 16> ArgList;     // 解析途中の関数呼び出しの引数
+
+  // 関数定義の記録先（nullptrなら記録しない）と、解析中の関数の記録の番号
+  std::vector<FuncRecord> *Records = nullptr;
+  int CurRecord = -1;
+  bool Unlisted = false;   // ASTにない宣言（値のない定数）を名前表に登録した
+
 public:
-  Parser(std::string filename, bool debug);
+  Parser(std::string filename, bool debug, LexerMode mode = LEXER_STREAM);
+  Parser(std::unique_ptr<llvm::MemoryBuffer> buffer, bool debug, LexerMode mode = LEXER_STREAM);
+  Parser(std::unique_ptr<TokenStream> tokens, std::unique_ptr<ASTContext> context, bool debug);
   ~Parser() {}
   bool parse();
   std::unique_ptr<ProgramAST> getAST();
@@ -38,28 +130,31 @@ private:
     各種構文解析メソッド
     */
   bool parseProgram();
-  std::unique_ptr<BlockAST> parseBlock();
-  std::unique_ptr<ConstDeclAST> parseConst();
-  std::unique_ptr<VarDeclAST> parseVar();
-  std::unique_ptr<FuncDeclAST> parseFunction();
-  std::unique_ptr<BaseStmtAST> parseStatement();
-  std::unique_ptr<BaseStmtAST> parseAssign();
-  std::unique_ptr<BaseStmtAST> parseBeginEnd();
-  std::unique_ptr<BaseStmtAST> parseIfThen();
-  std::unique_ptr<BaseStmtAST> parseWhileDo();
-  std::unique_ptr<BaseStmtAST> parseReturn();
-  std::unique_ptr<BaseStmtAST> parseWrite();
-  std::unique_ptr<BaseExpAST> parseCondition();
-  std::unique_ptr<BaseExpAST> parseExpression(std::unique_ptr<BaseExpAST> lhs);
-  std::unique_ptr<BaseExpAST> parseTerm(std::unique_ptr<BaseExpAST> lhs);
-  std::unique_ptr<BaseExpAST> parseFactor();
-  std::unique_ptr<BaseExpAST> parseCall(const std::string &name, Token token);
-  void checkGet(std::string symbol);
+  BlockAST parseBlock();
+  void parseConst(llvm::SmallVectorImpl<std::pair<uint32_t, int>> &table);
+  void parseVar(llvm::SmallVectorImpl<uint32_t> &table);
+  FuncDeclAST parseFunction();
+  int beginRecord(uint32_t decl, SymbolID name, int num);
+  void endRecord(int index);
+  BaseStmtAST parseStatement();
+  bool beginStatement(BaseStmtAST &statement);
+  bool finishStatement(BaseStmtAST &statement);
+  BaseStmtAST parseAssign();
+  void parseBeginEnd();
+  bool parseIfThen();
+  bool parseWhileDo();
+  BaseStmtAST parseReturn();
+  BaseStmtAST parseWrite();
+  BaseExpAST parseCondition();
+  BaseExpAST parseExpression();
+  ExpStep startExpression();
+  ExpStep resumeExpression(BaseExpAST &value);
+  ExpStep parseFactor(BaseExpAST &value);
+  BaseExpAST checkFactorEnd(BaseExpAST factor);
+  BaseExpAST parseCall(const ExpFrame &frame);
+  void checkGet(TokenType type);
   void check(const std::string &caller);
-  bool isKeyWord(std::string &name);
-  bool isSymbol(std::string &name);
-  bool isKeyWordType(int type);
-  bool isStmtBeginKey(const std::string &name);
+  bool isStmtBeginKey(TokenType type);
 };
 
 #endif
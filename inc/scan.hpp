@@ -0,0 +1,38 @@
+#ifndef SCAN_HPP
+#define SCAN_HPP
+
+#include <cstddef>
+
+/**
+  * 字句解析の走査カーネルの種類
+  */
+enum ScanKernel {
+  SCAN_AUTO,     // 実行時にCPUを判定して選択
+  SCAN_SCALAR,   // 1バイトずつ
+  SCAN_SSE2,     // 16バイトずつ
+  SCAN_AVX2      // 32バイトずつ
+};
+
+/**
+  * 走査カーネルを選択する
+  * @param カーネルの種類。CPUが対応していなければ次に速いものを選ぶ
+  * @return 実際に選択したカーネル
+  */
+ScanKernel setScanKernel(ScanKernel kernel);
+ScanKernel getScanKernel();
+const char *scanKernelName(ScanKernel kernel);
+
+/**
+  * 走査カーネル
+  * いずれも[p, end)を走査し、条件を満たさない最初の位置（なければend）を返す
+  */
+struct ScanFunctions {
+  const char *(*blank)(const char *p, const char *end);     // ' ', \t, \v, \f, \r を読み飛ばす
+  const char *(*alnum)(const char *p, const char *end);     // 英数字を読み飛ばす
+  const char *(*digit)(const char *p, const char *end);     // 数字を読み飛ばす
+  const char *(*comment)(const char *p, const char *end);   // '}' と '\n' 以外を読み飛ばす
+};
+
+extern ScanFunctions Scan;
+
+#endif
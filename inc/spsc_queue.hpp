@@ -0,0 +1,92 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <utility>
+
+/**
+  * 単一生産者・単一消費者のロックフリーキュー
+  * 生産者はpush()、消費者はpop()だけを呼ぶこと
+  *
+  * 書き込み位置の公開はBATCH件ごと（またはflush()時）にまとめて行い、
+  * 相手側の位置はキャッシュして読むことでコア間の通信を減らす
+  * @param T 要素型（ムーブ可能であること）
+  * @param N 要素数（2の冪）
+  */
+template <typename T, size_t N>
+class SPSCQueue {
+private:
+  static_assert((N & (N - 1)) == 0, "SPSCQueue size must be a power of two");
+  static const size_t BATCH = 64;
+  static const size_t CACHELINE = 64;
+
+  T Slots[N];
+
+  // 消費者側
+  alignas(CACHELINE) std::atomic<size_t> Head;
+  size_t TailCache;                 // 最後に読んだTail
+
+  // 生産者側
+  alignas(CACHELINE) std::atomic<size_t> Tail;
+  size_t LocalTail;                 // まだ公開していない書き込み位置
+  size_t HeadCache;                 // 最後に読んだHead
+
+  const std::atomic<bool> *Stop;    // trueになれば待機をやめる
+
+public:
+  SPSCQueue(const std::atomic<bool> *stop = nullptr)
+    : Head(0), TailCache(0), Tail(0), LocalTail(0), HeadCache(0), Stop(stop) {}
+
+  /**
+    * 要素を1つ追加する。満杯なら空くまで待つ
+    * @return 成功時：true　停止要求で中断した時：false
+    */
+  bool push(T &&item) {
+    if (LocalTail - HeadCache == N) {
+      flush();
+      if (!wait([&] { return LocalTail - (HeadCache = Head.load(std::memory_order_acquire)) < N; }))
+        return false;
+    }
+    Slots[LocalTail & (N - 1)] = std::move(item);
+    if (++LocalTail - Tail.load(std::memory_order_relaxed) >= BATCH)
+      flush();
+    return true;
+  }
+
+  /**
+    * 追加済みの要素を消費者に公開する
+    */
+  void flush() {
+    Tail.store(LocalTail, std::memory_order_release);
+  }
+
+  /**
+    * 要素を1つ取り出す。空なら生産者が公開するまで待つ
+    * @return 成功時：true　停止要求で中断した時：false
+    */
+  bool pop(T &item) {
+    size_t head = Head.load(std::memory_order_relaxed);
+    if (head == TailCache &&
+        !wait([&] { return head != (TailCache = Tail.load(std::memory_order_acquire)); }))
+      return false;
+    item = std::move(Slots[head & (N - 1)]);
+    Head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+private:
+  template <typename Cond>
+  bool wait(Cond ready) {
+    for (int spin = 0; !ready(); spin++) {
+      if (Stop && Stop->load(std::memory_order_relaxed))
+        return false;
+      if (spin >= 64)
+        std::this_thread::yield();
+    }
+    return true;
+  }
+};
+
+#endif  // #ifndef SPSC_QUEUE_HPP
@@ -2,8 +2,11 @@
 #define TABLE_HPP
 
 #include "log.hpp"
-#include <llvm/IR/Function.h>
-#include <llvm/IR/Value.h>
+#include "interner.hpp"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 
 /**
   * nameの種類
@@ -28,91 +31,80 @@ struct NameTypeStr : public std::string {
 
 class SymInfo {
 public:
-  SymInfo(int p_level, NameType p_type, std::string p_name, int p_num): level(p_level),type(p_type),name(p_name),num(p_num){}
+  SymInfo(int p_level, NameType p_type, SymbolID p_name, int p_num): level(p_level),type(p_type),name(p_name),num(p_num){}
 
 public:
   int level;
   NameType type;
-  std::string name;
+  SymbolID name;
   int num;        // Func: 引数の数
 };
 
+/**
+  * 構文解析用の名前表
+  * (名前, 種類, 引数の数) をキーにしたハッシュ表で、キーごとに宣言されたレベルと宣言の番号を積む。
+  * 関数は引数の数を問わない検索のため、引数の数 -1 のキーにも登録する。
+  * 定数・変数の参照はブロックを出るときに解決する（ブロックの定数・変数は、
+  * その前に書かれた関数の中からも見えるため）
+  */
 class SymTable {
-private:
-  std::vector<SymInfo> symbolTable;      // 名前シンボルテーブル
-  std::vector<std::string> tempNames;    // 一時的な名前テーブル
-  int cur_level = -1;
-
 public:
-  void blockIn() { cur_level++; }
-  void blockOut();
-
-  void addSymbol(std::string name, NameType type, int num = -1) {
-    symbolTable.emplace_back(cur_level, type, name, num);
-  }
+  static const uint32_t NODECL = UINT32_MAX;   // 宣言なし
 
-  bool findSymbol(const std::string &name, const NameType &type, const bool &checkLevel = true, int num = -1) const;
+private:
+  typedef std::pair<int, uint32_t> Entry;      // レベル, 宣言の番号
+
+  std::vector<SymInfo> symbolTable;      // 名前シンボルテーブル（宣言順）
+  llvm::DenseMap<uint64_t, llvm::SmallVector<Entry, 2>> symbolIndex;  // キー -> 宣言
+  std::vector<std::pair<SymbolID, uint32_t>> references;   // 未解決の参照（名前, ノード）
+  std::vector<size_t> referenceBegin;    // ブロックごとの references の開始位置
+  llvm::DenseMap<SymbolID, llvm::SmallVector<unsigned, 1>> tempNames;   // 一時的な名前テーブル（名前 -> 追加順）
+  unsigned temp_count = 0;
+  int cur_level = -1;
 
-  void addTemp(std::string name) {
-    tempNames.push_back(name);
+  // DenseMapのハッシュは下位32ビットしか効かないので、名前を下位に置く
+  static uint64_t key(SymbolID name, NameType type, int num) {
+    return ((uint64_t)(uint32_t)(num + 1) << 40) | ((uint64_t)type << 32) | name;
   }
 
-  void deleteTemp(const std::string &name);
-
-  bool findTemp(const std::string &name) const;
-
-  bool remainedTemp() const { return tempNames.size() > 0; }
-
-  void dumpSymbolTable() const;
-
-  void dumpTempNames() const;
-};
-
-class CodeInfo {
 public:
-  CodeInfo(const std::string &name, NameType type, llvm::Function *func,
-         llvm::Value *val, int level)
-      : name(name), type(type), func(func), val(val), level(level) {}
+  void blockIn() {
+    cur_level++;
+    referenceBegin.push_back(references.size());
+  }
+  void blockOut(llvm::function_ref<void(uint32_t node, uint32_t decl)> resolve);
 
-public:
-  std::string name;
-  NameType type;
-  llvm::Function *func;
-  llvm::Value *val;
-  int level;
-};
+  void addSymbol(SymbolID name, NameType type, uint32_t decl, int num = -1);
 
-class CodeTable {
-public:
-  const CodeInfo &find(const std::string &name) const;
+  bool findSymbol(SymbolID name, const NameType &type, const bool &checkLevel = true, int num = -1) const;
 
-  void appendConst(const std::string &name, llvm::Value *val) {
-    infos.emplace_back(name, CONST, nullptr, val, cur_level);
-  }
+  uint32_t findDecl(SymbolID name, NameType type, int num = -1) const;
 
-  void appendVar(const std::string &name, llvm::Value *val) {
-    infos.emplace_back(name, VAR, nullptr, val, cur_level);
+  /**
+    * 定数・変数・パラメタの参照を記録する（ブロックを出るときに解決する）
+    */
+  void addReference(SymbolID name, uint32_t node) {
+    references.emplace_back(name, node);
   }
 
-  void appendParam(const std::string &name, llvm::Value *val) {
-    infos.emplace_back(name, PARAM, nullptr, val, cur_level);
-  }
+  /**
+    * 最も外側のブロックを出ても解決できなかった参照
+    */
+  llvm::ArrayRef<std::pair<SymbolID, uint32_t>> getReferences() const { return references; }
 
-  void appendFunction(const std::string &name, llvm::Function *func) {
-    infos.emplace_back(name, FUNC, func, nullptr, cur_level);
+  void addTemp(SymbolID name) {
+    tempNames[name].push_back(temp_count++);
   }
 
-  void enterBlock() { cur_level++; }
+  void deleteTemp(SymbolID name);
 
-  void leaveBlock();
+  bool findTemp(SymbolID name) const { return tempNames.count(name) != 0; }
 
-  int getLevel() const { return cur_level; }
+  bool remainedTemp() const { return !tempNames.empty(); }
 
-  void dumpInfos() const;
+  void dumpSymbolTable(const StringInterner &names) const;
 
-private:
-  std::vector<CodeInfo> infos;
-  int cur_level = -1;
+  void dumpTempNames(const StringInterner &names) const;
 };
 
 #endif
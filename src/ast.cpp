@@ -1,48 +1,24 @@
 #include "ast.hpp"
 
 /**
-  * BlockASTメソッド
-  * @param  std::unique_ptr<ConstDeclAST>
-  * @return void
-  */
-void BlockAST::setConstant(std::unique_ptr<ConstDeclAST> constant) {
-    if (!Constant) {
-      Constant = std::move(constant);
-    } else {
-      auto dest = Constant->getNameTable();
-      auto source = constant->getNameTable();
-      dest.insert(dest.end(), source.begin(), source.end());
-      Constant->setNameTable(dest);
-    }
-}
-
-/**
-  * BlockASTメソッド
-  * @param  std::unique_ptr<VarDeclAST>
-  */
-void BlockAST::setVariable(std::unique_ptr<VarDeclAST> variable) {
-    if (!Variable) {
-      Variable = std::move(variable);
-    } else {
-      auto dest = Variable->getNameTable();
-      auto source = variable->getNameTable();
-      dest.insert(dest.end(), source.begin(), source.end());
-      Variable->setNameTable(dest);
-    }
-}
-
-/**
-  * BlockASTメソッド
-  * @param  std::unique_ptr<FuncDeclAST>ue
+  * BlockASTの内容を設定する
+  * @param 定数定義, 変数定義（なければ空の参照）, 関数定義の並び, 文
   */
-void BlockAST::addFunction(std::unique_ptr<FuncDeclAST> function) {
-    Functions.push_back(std::move(function));
+void BlockAST::build(ASTContext &context, ASTNode &node, ConstDeclAST constant, VarDeclAST variable,
+                     llvm::ArrayRef<FuncDeclAST> functions, BaseStmtAST statement) {
+  llvm::SmallVector<uint32_t, 8> items;
+  items.push_back(constant.getIndex());
+  items.push_back(variable.getIndex());
+  for (auto &func : functions)
+    items.push_back(func.getIndex());
+  node.Operand[0] = context.addList(llvm::makeArrayRef(items));
+  node.Operand[1] = statement.getIndex();
 }
 
 /**
   * BlockASTメソッド
   * @retirm true
   */
-bool BlockAST::empty() {
-  return !Constant && !Variable;
+bool BlockAST::empty() const {
+  return !getConstant() && !getVariable();
 }
@@ -0,0 +1,183 @@
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include "astcache.hpp"
+#include <cstring>
+
+const uint32_t ASTCache::VERSION;
+
+static const char MAGIC[4] = { 'P', 'L', '0', 'A' };
+
+/**
+  * ソースの内容のハッシュ値
+  */
+uint64_t ASTCache::hash(llvm::StringRef source) {
+  return llvm::xxHash64(source);
+}
+
+/**
+  * キャッシュファイルのパス（ディレクトリ/ハッシュ値.ast）
+  */
+std::string ASTCache::path(llvm::StringRef source) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.ast", (unsigned long long)hash(source));
+  llvm::SmallString<128> result(Dir);
+  llvm::sys::path::append(result, name);
+  return result.str().str();
+}
+
+template<typename T>
+static void writeArray(llvm::raw_ostream &out, llvm::ArrayRef<T> items) {
+  out.write(reinterpret_cast<const char *>(items.data()), items.size() * sizeof(T));
+}
+
+/**
+  * ASTを書き出す
+  * @param AST, 元のソース, 出力先
+  */
+void ASTCache::write(const ProgramAST &program, llvm::StringRef source, llvm::raw_ostream &out) {
+  const ASTContext &context = program.getContext();
+  const StringInterner &names = *program.getNames();
+
+  std::vector<uint32_t> offsets;
+  offsets.reserve(names.size() + 1);
+  uint32_t bytes = 0;
+  for (size_t i = 0; i < names.size(); i++) {
+    offsets.push_back(bytes);
+    bytes += names.get(i).size();
+  }
+  offsets.push_back(bytes);
+
+  // ヘッダに中身のハッシュ値を入れるので、中身を先に組み立てる
+  std::string payload;
+  {
+    llvm::raw_string_ostream body(payload);
+    writeArray(body, context.getNodes());
+    writeArray(body, context.getLists());
+    writeArray(body, context.getDecls());
+    writeArray(body, llvm::makeArrayRef(offsets));
+    for (size_t i = 0; i < names.size(); i++)
+      body << names.get(i);
+  }
+
+  ASTCacheHeader header;
+  memcpy(header.Magic, MAGIC, sizeof(MAGIC));
+  header.Version = VERSION;
+  header.SourceHash = hash(source);
+  header.SourceSize = source.size();
+  header.PayloadHash = llvm::xxHash64(payload);
+  header.NumNodes = context.getNodes().size();
+  header.NumLists = context.getLists().size();
+  header.NumDecls = context.getDecls().size();
+  header.NumNames = names.size();
+  header.NameBytes = bytes;
+  header.Root = program.getBlock().getIndex();
+
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out << payload;
+}
+
+/**
+  * 配列を1つ読み込む
+  * @return データが足りなければ false
+  */
+template<typename T>
+static bool readArray(llvm::StringRef &data, size_t num, std::vector<T> &items) {
+  size_t size = num * sizeof(T);
+  if (data.size() < size)
+    return false;
+  items.resize(num);
+  memcpy(items.data(), data.data(), size);
+  data = data.drop_front(size);
+  return true;
+}
+
+/**
+  * 書き出したASTを読み込む
+  * ヘッダが合わない（形式の版・ソースの内容が違う）か、データが壊れていれば nullptr を返す。
+  * ノードの添字などは調べないので、中身がハッシュ値と合わないファイルは使わない
+  * @param 書き出したデータ, 元のソース
+  */
+std::unique_ptr<ProgramAST> ASTCache::read(llvm::StringRef data, llvm::StringRef source) {
+  ASTCacheHeader header;
+  if (data.size() < sizeof(header))
+    return nullptr;
+  memcpy(&header, data.data(), sizeof(header));
+  data = data.drop_front(sizeof(header));
+  if (memcmp(header.Magic, MAGIC, sizeof(MAGIC)) || header.Version != VERSION ||
+      header.SourceSize != source.size() || header.SourceHash != hash(source) ||
+      header.PayloadHash != llvm::xxHash64(data))
+    return nullptr;
+
+  std::vector<ASTNode> nodes;
+  std::vector<uint32_t> lists;
+  std::vector<SymbolID> decls;
+  std::vector<uint32_t> offsets;
+  if (!readArray(data, header.NumNodes, nodes) || !readArray(data, header.NumLists, lists) ||
+      !readArray(data, header.NumDecls, decls) || !readArray(data, header.NumNames + 1, offsets) ||
+      data.size() != header.NameBytes)
+    return nullptr;
+  if (header.Root >= nodes.size() || nodes[header.Root].ID != BlockID)
+    return nullptr;
+  for (SymbolID name : decls)
+    if (name >= header.NumNames)
+      return nullptr;
+
+  // 同じ順に登録すれば識別子のIDは書き出したときと同じになる
+  auto names = std::make_shared<StringInterner>();
+  for (uint32_t i = 0; i < header.NumNames; i++) {
+    if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.NameBytes)
+      return nullptr;
+    if (names->intern(data.slice(offsets[i], offsets[i + 1])) != i)
+      return nullptr;
+  }
+
+  auto context = llvm::make_unique<ASTContext>(std::move(nodes), std::move(lists), std::move(decls));
+  BlockAST block(context.get(), header.Root);
+  return llvm::make_unique<ProgramAST>(std::move(context), block, names);
+}
+
+/**
+  * ソースに対応するASTをキャッシュから読み込む
+  * @return キャッシュになければ nullptr
+  */
+std::unique_ptr<ProgramAST> ASTCache::load(llvm::StringRef source) const {
+  auto buffer = llvm::MemoryBuffer::getFile(path(source));
+  if (!buffer)
+    return nullptr;
+  return read((*buffer)->getBuffer(), source);
+}
+
+/**
+  * ASTをキャッシュに保存する
+  * 一時ファイルに書いてから置き換えるので、同じソースを並列にコンパイルしても壊れない
+  * @return 保存できなければ false
+  */
+bool ASTCache::store(llvm::StringRef source, const ProgramAST &program) const {
+  if (llvm::sys::fs::create_directories(Dir))
+    return false;
+
+  llvm::SmallString<128> model(Dir);
+  llvm::sys::path::append(model, "tmp-%%%%%%%%.ast");
+  llvm::SmallString<128> temp;
+  int fd;
+  if (llvm::sys::fs::createUniqueFile(model, fd, temp))
+    return false;
+  {
+    llvm::raw_fd_ostream out(fd, true);
+    write(program, source, out);
+    out.close();
+    if (out.has_error()) {
+      out.clear_error();
+      llvm::sys::fs::remove(temp);
+      return false;
+    }
+  }
+  if (llvm::sys::fs::rename(temp, path(source))) {
+    llvm::sys::fs::remove(temp);
+    return false;
+  }
+  return true;
+}
@@ -1,5 +1,6 @@
 #include "llvm/IR/LegacyPassManager.h"
 #include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/CFG.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/IRPrintingPasses.h>
 #include <llvm/IR/ValueSymbolTable.h>
@@ -19,130 +20,236 @@
 
 CodeGen::~CodeGen(){}
 
-void CodeGen::generate(std::unique_ptr<ProgramAST> program) {
+/**
+  * ASTからLLVM IRを生成する
+  * 未定義の名前などのエラーは診断エンジンに記録し、生成は最後まで続ける
+  * @return エラーがなければ true
+  */
+bool CodeGen::generate(std::unique_ptr<ProgramAST> program) {
   Program = std::move(program);
+  Names = Program->getNames();
+  Slots.assign(Program->getContext().getNumDecls(), nullptr);
+  Log::setNames(Names);
+  Effects = llvm::make_unique<EffectAnalysis>(*Program);
+  Effects->analyze();
   auto *funcType = llvm::FunctionType::get(TheBuilder.getInt64Ty(), false);
   auto *mainFunc = llvm::Function::Create(
       funcType, llvm::Function::ExternalLinkage, "main", TheModule.get());
-  llvm::BasicBlock::Create(TheContext, "entrypoint", mainFunc);
-  ident_table.enterBlock();
+  mainFunc->addFnAttr(llvm::Attribute::NoUnwind);
+  mainFunc->addFnAttr(llvm::Attribute::NoRecurse);
+  sealBlock(llvm::BasicBlock::Create(TheContext, "entrypoint", mainFunc));
   block(Program->getBlock(), mainFunc);
   TheBuilder.CreateRet(TheBuilder.getInt64(1));
+  // SSAモード: 置き換えた phi はどこからも使われていないので消し、残った phi に変数の名前を付ける
+  for (auto &pair : Phis) {
+    if (Replaced.count(pair.first))
+      pair.first->eraseFromParent();
+    else
+      pair.first->setName(Names->get(Program->getContext().getDeclName(pair.second)));
+  }
+  return !Failed;
 }
 
-void CodeGen::block(std::unique_ptr<BlockAST> block_ast, llvm::Function *func) {
+void CodeGen::block(BlockAST block_ast, llvm::Function *func,
+                    llvm::ArrayRef<uint32_t> params) {
   std::vector<std::string> vars;
 
   TheBuilder.SetInsertPoint(&func->getEntryBlock());
-  constant(block_ast->getConstant());
-  variable(block_ast->getVariable());
-  auto functions = block_ast->getFunctions();
-  for(size_t i = 0; i < functions.size(); i++) {
-    function(std::move(functions[i]));
-  }
+  constant(block_ast.getConstant());
+  variable(block_ast.getVariable());
+  for (auto func_ast : block_ast.getFunctions())
+    function(func_ast);
   curFunc = func;
   TheBuilder.SetInsertPoint(&func->getEntryBlock());
   auto itr = func->arg_begin();
-  for (size_t i = 0; i < func->arg_size(); i++) {
-    auto *alloca =
-        TheBuilder.CreateAlloca(TheBuilder.getInt64Ty(), 0, itr->getName());
-    TheBuilder.CreateStore(itr, alloca);
-    ident_table.appendParam(itr->getName(), alloca);
+  for (size_t i = 0; i < params.size(); i++) {
+    if (SSA && !Effects->isShared(params[i])) {
+      Slots[params[i]] = undefined();
+      writeVariable(params[i], &func->getEntryBlock(), &*itr);
+    } else {
+      auto *alloca =
+          TheBuilder.CreateAlloca(TheBuilder.getInt64Ty(), 0, itr->getName());
+      TheBuilder.CreateStore(itr, alloca);
+      Slots[params[i]] = alloca;
+    }
     itr++;
   }
-  statement(block_ast->getStatement());
-  ident_table.leaveBlock();
+  statement(block_ast.getStatement());
 }
 
-void CodeGen::constant(std::unique_ptr<ConstDeclAST> const_ast) {
-  if (const_ast == nullptr) return;
-  for (auto pair : const_ast->getNameTable())
-    ident_table.appendConst(pair.first, TheBuilder.getInt64(pair.second));
+/**
+  * 文を生成する
+  * 入れ子の文は再帰せず StmtStack に積み、積んだ順の逆に生成する
+  */
+void CodeGen::statement(BaseStmtAST stmt_ast) {
+  size_t base = StmtStack.size();
+  StmtStack.push_back(StmtWork(stmt_ast));
+  while (StmtStack.size() > base) {
+    StmtWork work = StmtStack.back();
+    StmtStack.pop_back();
+    if (work.Stmt) {
+      visit(work.Stmt);
+    } else {
+      // if/whileの中の文を生成し終えた
+      TheBuilder.CreateBr(work.Target);
+      sealBlock(work.Target);
+      curFunc->getBasicBlockList().push_back(work.Merge);
+      TheBuilder.SetInsertPoint(work.Merge);
+    }
+  }
 }
 
-void CodeGen::variable(std::unique_ptr<VarDeclAST> var_ast) {
-  if (var_ast == nullptr) return;
-  for (auto name : var_ast->getNameTable()) {
-    auto *alloca = TheBuilder.CreateAlloca(TheBuilder.getInt64Ty(), 0, name);
-    ident_table.appendVar(name, alloca);
+/**
+  * 式を生成する
+  * 子の式を左から順に生成してから親を生成する。子は再帰せず ExpStack に積み、
+  * 生成した値は Values に積む（式の visitXXX は子の値を Values から取り出す）
+  */
+llvm::Value *CodeGen::expression(BaseExpAST exp_ast) {
+  const ASTContext *context = &Program->getContext();
+  size_t base = ExpStack.size();
+  ExpStack.push_back(exp_ast.getIndex());
+  while (ExpStack.size() > base) {
+    uint32_t work = ExpStack.back();
+    ExpStack.pop_back();
+    BaseExpAST exp(context, work & ~EXPANDED);
+    AstID id = exp.getValueID();
+    if ((work & EXPANDED) || id == VariableID || id == NumberID) {
+      Values.push_back(visit(exp));   // 子を生成し終えた式か、子のない式
+      continue;
+    }
+    // 子を左から生成するよう、右の子から積む
+    ExpStack.push_back(work | EXPANDED);
+    switch (id) {
+    case CondExpID: {
+      auto cond = exp.castAs<CondExpAST>();
+      ExpStack.push_back(cond.getRHS().getIndex());
+      if (cond.getOp() != OP_ODD)
+        ExpStack.push_back(cond.getLHS().getIndex());
+      break;
+    }
+    case BinaryExprID: {
+      auto binary = exp.castAs<BinaryExprAST>();
+      ExpStack.push_back(binary.getRHS().getIndex());
+      ExpStack.push_back(binary.getLHS().getIndex());
+      break;
+    }
+    case CallExprID: {
+      auto call = exp.castAs<CallExprAST>();
+      for (size_t i = call.getArgSize(); i > 0; i--)
+        ExpStack.push_back(call.getArgs(i - 1).getIndex());
+      break;
+    }
+    default:
+      break;
+    }
   }
+  return popValue();
+}
+
+llvm::Value *CodeGen::popValue() {
+  llvm::Value *value = Values.back();
+  Values.pop_back();
+  return value;
+}
+
+void CodeGen::constant(ConstDeclAST const_ast) {
+  if (!const_ast) return;
+  for (size_t i = 0; i < const_ast.size(); i++)
+    Slots[const_ast.getDecl(i)] = TheBuilder.getInt64(const_ast.getValue(i));
 }
 
-void CodeGen::function(std::unique_ptr<FuncDeclAST> func_ast) {
-  if (func_ast == nullptr) return;
-  auto func_name = func_ast->getName();
-  auto params = func_ast->getParameters();
+void CodeGen::variable(VarDeclAST var_ast) {
+  if (!var_ast) return;
+  auto decls = var_ast.getDecls();
+  for (size_t i = 0; i < decls.size(); i++) {
+    if (Effects->isGlobal(decls[i])) {
+      // 関数から参照される main の変数は大域変数に置く（main は再帰しないので1つで足りる）
+      Slots[decls[i]] = new llvm::GlobalVariable(
+          *TheModule, TheBuilder.getInt64Ty(), false, llvm::GlobalValue::InternalLinkage,
+          TheBuilder.getInt64(0), Names->get(var_ast.getName(i)));
+    } else if (SSA && !Effects->isShared(decls[i])) {
+      // SSAで表す変数は Slots の undef を目印にする（代入するまでの値も undef）。
+      // 内側の関数から参照される変数は alloca に置く
+      Slots[decls[i]] = undefined();
+    } else {
+      Slots[decls[i]] = TheBuilder.CreateAlloca(TheBuilder.getInt64Ty(), 0, Names->get(var_ast.getName(i)));
+    }
+  }
+}
+
+void CodeGen::function(FuncDeclAST func_ast) {
+  if (!func_ast) return;
+  auto func_name = func_ast.getName();
+  const ASTContext &context = Program->getContext();
+  auto params = func_ast.getParameters();
+  // パラメタの後ろに、外側の関数から受け取る変数のアドレスを並べる
+  auto free_vars = Effects->getFreeVars(func_ast.getDecl());
   std::vector<llvm::Type *> param_types(params.size(), TheBuilder.getInt64Ty());
+  param_types.resize(params.size() + free_vars.size(), TheBuilder.getInt64Ty()->getPointerTo());
   auto *funcType =
       llvm::FunctionType::get(TheBuilder.getInt64Ty(), param_types, false);
-  auto *func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, func_name, TheModule.get());
-  llvm::BasicBlock::Create(TheContext, "entry", func);
-  ident_table.appendFunction(func_name, func);
-  ident_table.enterBlock();
+  auto *func = createFunction(funcType, Names->get(func_name));
+  setAttributes(func, func_ast.getDecl());
+  sealBlock(llvm::BasicBlock::Create(TheContext, "entry", func));
+  Slots[func_ast.getDecl()] = func;
   auto itr = func->arg_begin();
   for (size_t i = 0; i < params.size(); i++) {
-    itr->setName(params[i]);
+    itr->setName(Names->get(context.getDeclName(params[i])));
+    itr++;
+  }
+  // 関数の中では外側の変数をアドレスの引数で読み書きする
+  std::vector<llvm::Value *> outer_slots;
+  for (uint32_t var : free_vars) {
+    itr->setName(Names->get(context.getDeclName(var)));
+    outer_slots.push_back(Slots[var]);
+    Slots[var] = &*itr;
     itr++;
   }
 
-  block(func_ast->getBlock(), func);
+  block(func_ast.getBlock(), func, params);
+  // return で終わらない関数は 0 を返す
+  if (!TheBuilder.GetInsertBlock()->getTerminator())
+    TheBuilder.CreateRet(TheBuilder.getInt64(0));
+  for (size_t i = 0; i < free_vars.size(); i++)
+    Slots[free_vars[i]] = outer_slots[i];
 }
 
-void CodeGen::statement(std::unique_ptr<BaseStmtAST> stmt_ast) {
-  if (stmt_ast == nullptr) return;
-  if (llvm::isa<NullAST>(stmt_ast))
+void CodeGen::visitAssign(AssignAST stmt_ast) {
+  llvm::Value *assignee = lookup(stmt_ast.getDecl());
+  if (!assignee)
+    return;
+  if (SSA && llvm::isa<llvm::UndefValue>(assignee)) {
+    writeVariable(stmt_ast.getDecl(), TheBuilder.GetInsertBlock(), expression(stmt_ast.getRHS()));
     return;
-  else if (llvm::isa<AssignAST>(stmt_ast)) {
-    statementAssign(llvm::cast<AssignAST>(std::move(stmt_ast)));
-  } else if (llvm::isa<BeginEndAST>(stmt_ast)) {
-    auto stmts = llvm::cast<BeginEndAST>(std::move(stmt_ast))->getStatements();
-    for (size_t i=0; i < stmts.size(); i++)
-      statement(std::move(stmts[i]));
-  } else if (llvm::isa<IfThenAST>(std::move(stmt_ast))) {
-    statementIf(llvm::cast<IfThenAST>(std::move(stmt_ast)));
-  } else if (llvm::isa<WhileDoAST>(stmt_ast)) {
-    statementWhile(llvm::cast<WhileDoAST>(std::move(stmt_ast)));
-  } else if (llvm::isa<ReturnAST>(stmt_ast)) {
-    auto exp_ast = llvm::cast<ReturnAST>(std::move(stmt_ast))->getExpression();
-    TheBuilder.CreateRet(expression(std::move(exp_ast)));
-    TheBuilder.SetInsertPoint(llvm::BasicBlock::Create(TheContext, "dummy"));
-  } else if (llvm::isa<WriteAST>(stmt_ast)) {
-    auto exp_ast = llvm::cast<WriteAST>(std::move(stmt_ast))->getExpression();
-    TheBuilder.CreateCall(writeFunc, std::vector<llvm::Value *>(1, expression(std::move(exp_ast))));
-  } else if (llvm::isa<WritelnAST>(stmt_ast)) {
-    TheBuilder.CreateCall(writelnFunc);
   }
-}
-
-void CodeGen::statementAssign(std::unique_ptr<AssignAST> stmt_ast) {
-  const auto &info = ident_table.find(stmt_ast->getName());
-  llvm::Value *assignee = nullptr;
-  if (info.type == VAR || info.type == PARAM) {
-    assignee = info.val;
-  } else {
+  if (!isMemory(assignee)) {
     Log::error("variable is expected but it is not variable");
+    Failed = true;
     return;
   }
-  TheBuilder.CreateStore(expression(stmt_ast->getRHS()), assignee);
+  TheBuilder.CreateStore(expression(stmt_ast.getRHS()), assignee);
+}
+
+void CodeGen::visitBeginEnd(BeginEndAST stmt_ast) {
+  auto statements = stmt_ast.getStatements();
+  for (size_t i = statements.size(); i > 0; i--)
+    StmtStack.push_back(StmtWork(statements[i - 1]));
 }
 
-void CodeGen::statementIf(std::unique_ptr<IfThenAST> stmt_ast) {
-  auto cond_ast = stmt_ast->getCondition();
-  auto *cond = condition(llvm::cast<CondExpAST>(std::move(cond_ast)));
+void CodeGen::visitIfThen(IfThenAST stmt_ast) {
+  auto *cond = expression(stmt_ast.getCondition());
   auto *then_block = llvm::BasicBlock::Create(TheContext, "if.then", curFunc);
   auto *merge_block = llvm::BasicBlock::Create(TheContext, "if.merge");
   TheBuilder.CreateCondBr(cond, then_block, merge_block);
+  sealBlock(then_block);
 
   TheBuilder.SetInsertPoint(then_block);
-  auto thenstmt = stmt_ast->getStatement();
-  statement(std::move(thenstmt));
-  TheBuilder.CreateBr(merge_block);
-  then_block = TheBuilder.GetInsertBlock();
-  curFunc->getBasicBlockList().push_back(merge_block);
-  TheBuilder.SetInsertPoint(merge_block);
+  // 中の文の後で merge_block に合流する
+  StmtStack.push_back(StmtWork(merge_block, merge_block));
+  StmtStack.push_back(StmtWork(stmt_ast.getStatement()));
 }
 
-void CodeGen::statementWhile(std::unique_ptr<WhileDoAST> stmt_ast) {
+void CodeGen::visitWhileDo(WhileDoAST stmt_ast) {
   auto *cond_block = llvm::BasicBlock::Create(TheContext, "while.cond", curFunc);
   auto *body_block = llvm::BasicBlock::Create(TheContext, "while.body");
   auto *merge_block = llvm::BasicBlock::Create(TheContext, "while.merge");
@@ -150,113 +257,159 @@ void CodeGen::statementWhile(std::unique_ptr<WhileDoAST> stmt_ast) {
   TheBuilder.CreateBr(cond_block);
   {
     TheBuilder.SetInsertPoint(cond_block);
-    auto cond_ast = stmt_ast->getCondition();
-    auto *cond = condition(llvm::cast<CondExpAST>(std::move(cond_ast)));
+    auto *cond = expression(stmt_ast.getCondition());
     TheBuilder.CreateCondBr(cond, body_block, merge_block);
   }
-  {
-    curFunc->getBasicBlockList().push_back(body_block);
-    TheBuilder.SetInsertPoint(body_block);
-    auto dostmt = stmt_ast->getStatement();
-    statement(std::move(dostmt));
-    TheBuilder.CreateBr(cond_block);
-  }
-  curFunc->getBasicBlockList().push_back(merge_block);
-  TheBuilder.SetInsertPoint(merge_block);
+  sealBlock(body_block);
+  sealBlock(merge_block);
+  curFunc->getBasicBlockList().push_back(body_block);
+  TheBuilder.SetInsertPoint(body_block);
+  // 中の文の後で cond_block に戻り、merge_block から続ける
+  StmtStack.push_back(StmtWork(cond_block, merge_block));
+  StmtStack.push_back(StmtWork(stmt_ast.getStatement()));
 }
 
-llvm::CmpInst::Predicate CodeGen::token_to_inst(std::string op) {
-  if (op == "=")
+void CodeGen::visitReturn(ReturnAST stmt_ast) {
+  TheBuilder.CreateRet(expression(stmt_ast.getExpression()));
+  // 後に続く文は到達しないブロックに生成する（関数の中に置かないと最適化パスが扱えない）
+  auto *dummy = llvm::BasicBlock::Create(TheContext, "dummy", curFunc);
+  sealBlock(dummy);
+  TheBuilder.SetInsertPoint(dummy);
+}
+
+void CodeGen::visitWrite(WriteAST stmt_ast) {
+  createCall(writeFunc, expression(stmt_ast.getExpression()));
+}
+
+void CodeGen::visitWriteln(WritelnAST) {
+  createCall(writelnFunc);
+}
+
+llvm::CmpInst::Predicate CodeGen::token_to_inst(OpID op) {
+  switch (op) {
+  case OP_EQ:
     return llvm::CmpInst::Predicate::ICMP_EQ;
-  else if (op == "<>")
+  case OP_NE:
     return llvm::CmpInst::Predicate::ICMP_NE;
-  else if (op == "<")
+  case OP_LT:
     return llvm::CmpInst::Predicate::ICMP_SLT;
-  else if (op == "<=")
+  case OP_LE:
     return llvm::CmpInst::Predicate::ICMP_SLE;
-  else if (op == ">")
+  case OP_GT:
     return llvm::CmpInst::Predicate::ICMP_SGT;
-  else if (op == ">=")
+  case OP_GE:
     return llvm::CmpInst::Predicate::ICMP_SGE;
-  else
+  default:
     Log::error("not support at token to inst");
+    Failed = true;
+  }
   return llvm::CmpInst::Predicate::FCMP_FALSE;
 }
 
-llvm::Value *CodeGen::condition(std::unique_ptr<CondExpAST> exp_ast) {
-  auto op = exp_ast->getOp();
-  if (op == "odd") {
-    auto *rhs = TheBuilder.CreateSRem(expression(exp_ast->getRHS()), TheBuilder.getInt64(2));
-    return TheBuilder.CreateICmpEQ(rhs, TheBuilder.getInt64(1));
+llvm::Value *CodeGen::visitCondExp(CondExpAST exp_ast) {
+  auto op = exp_ast.getOp();
+  if (op == OP_ODD) {
+    // 最下位ビットを調べる（負の奇数も奇数）
+    auto *rhs = TheBuilder.CreateAnd(popValue(), TheBuilder.getInt64(1));
+    return TheBuilder.CreateICmpNE(rhs, TheBuilder.getInt64(0));
   } else {
-    auto *lhs = expression(exp_ast->getLHS());
+    auto *rhs = popValue();
+    auto *lhs = popValue();
     llvm::CmpInst::Predicate inst = token_to_inst(op);
-    auto *rhs = expression(exp_ast->getRHS());
     return TheBuilder.CreateICmp(inst, lhs, rhs);
   }
 }
 
-llvm::Value *CodeGen::expression(std::unique_ptr<BaseExpAST> exp_ast) {
-  if (llvm::isa<BinaryExprAST>(exp_ast))
-    return binaryExp(llvm::cast<BinaryExprAST>(std::move(exp_ast)));
-  else if (llvm::isa<CallExprAST>(exp_ast))
-    return callExp(llvm::cast<CallExprAST>(std::move(exp_ast)));
-  else if (llvm::isa<VariableAST>(exp_ast))
-    return variableExp(llvm::cast<VariableAST>(std::move(exp_ast)));
-  else if (llvm::isa<NumberAST>(exp_ast))
-    return numberExp(llvm::cast<NumberAST>(std::move(exp_ast)));
-  return nullptr;
-}
-
-llvm::Value *CodeGen::binaryExp(std::unique_ptr<BinaryExprAST> exp_ast) {
-  auto op = exp_ast->getOp();
-  llvm::Value *lhs = expression(exp_ast->getLHS());
-  llvm::Value *rhs = expression(exp_ast->getRHS());
-  if (exp_ast->getPrefix() == "-")
+/**
+  * 算術式を生成する
+  * 加減乗算と符号反転は桁あふれで折り返す（ConstantFolder の畳み込みと同じ）
+  */
+llvm::Value *CodeGen::visitBinaryExpr(BinaryExprAST exp_ast) {
+  auto op = exp_ast.getOp();
+  llvm::Value *rhs = popValue();
+  llvm::Value *lhs = popValue();
+  if (exp_ast.getPrefix() == OP_SUB)
     lhs = TheBuilder.CreateNeg(lhs);
-  if (op == "+")
+  switch (op) {
+  case OP_ADD:
     lhs = TheBuilder.CreateAdd(lhs, rhs);
-  else if (op == "-")
+    break;
+  case OP_SUB:
     lhs = TheBuilder.CreateSub(lhs, rhs);
-  else if (op == "*")
+    break;
+  case OP_MUL:
     lhs = TheBuilder.CreateMul(lhs, rhs);
-  else if (op == "/")
+    break;
+  case OP_DIV:
     lhs = TheBuilder.CreateSDiv(lhs, rhs);
+    break;
+  default:
+    ;
+  }
 
   return lhs;
 }
 
-llvm::Value *CodeGen::callExp(std::unique_ptr<CallExprAST> exp_ast) {
-  auto &val = ident_table.find(exp_ast->getCallee());
-  std::vector<llvm::Value *> args;
-  for (size_t i = 0; i < exp_ast->getArgSize(); i++) {
-    args.push_back(expression(exp_ast->getArgs(i)));
-  }
-  if (args.size() != val.func->arg_size()) {
+llvm::Value *CodeGen::visitCallExpr(CallExprAST exp_ast) {
+  std::vector<llvm::Value *> args(Values.end() - exp_ast.getArgSize(), Values.end());
+  Values.resize(Values.size() - args.size());
+  auto *func = llvm::dyn_cast_or_null<llvm::Function>(lookup(exp_ast.getDecl()));
+  if (!func)
+    return undefined();
+  // 呼び出し先が参照する外側の変数のアドレスを渡す（呼び出し元の変数か、受け取ったアドレス）
+  for (uint32_t var : Effects->getFreeVars(exp_ast.getDecl()))
+    args.push_back(Slots[var]);
+  if (args.size() != func->arg_size()) {
     Log::error("argument number is wrong");
-    return nullptr;
+    Failed = true;
+    return undefined();
   }
-  return TheBuilder.CreateCall(val.func, args);
+  return createCall(func, args);
 
 }
 
-llvm::Value *CodeGen::variableExp(std::unique_ptr<VariableAST> exp_ast) {
-  auto &val = ident_table.find(exp_ast->getName());
-  switch (val.type) {
-  case CONST:
-    return val.val;
-  case VAR:
-    return TheBuilder.CreateLoad(val.val);
-  case PARAM:
-    return TheBuilder.CreateLoad(val.val);
-  default:
-    ; // for not warning
+llvm::Value *CodeGen::visitVariable(VariableAST exp_ast) {
+  llvm::Value *value = lookup(exp_ast.getDecl());
+  if (!value)
+    return undefined();
+  if (isMemory(value))                      // 変数・パラメタ
+    return TheBuilder.CreateLoad(value);
+  if (SSA && llvm::isa<llvm::UndefValue>(value))   // SSAで表す変数・パラメタ
+    return readVariable(exp_ast.getDecl(), TheBuilder.GetInsertBlock());
+  return value;                             // 定数
+}
+
+/**
+  * エラー時に式の値の代わりに使う
+  */
+llvm::Value *CodeGen::undefined() {
+  return llvm::UndefValue::get(TheBuilder.getInt64Ty());
+}
+
+llvm::Value *CodeGen::visitNumber(NumberAST exp_ast) {
+  return TheBuilder.getInt64(exp_ast.getNumberValue());
+}
+
+/**
+  * 宣言に対応する値を取り出す
+  * まだ生成していない宣言（未定義の名前を含む）ならエラーにする
+  * @return 定数、変数・パラメタの置き場所（SSAモードでは undef）、関数のいずれか
+  */
+llvm::Value *CodeGen::lookup(uint32_t decl) {
+  llvm::Value *value = Slots[decl];
+  if (!value) {
+    Log::undefinedError(Program->getContext().getDeclName(decl));
+    Failed = true;
   }
-  return nullptr;
+  return value;
 }
 
-llvm::Value *CodeGen::numberExp(std::unique_ptr<NumberAST> exp_ast) {
-  return TheBuilder.getInt64(exp_ast->getNumberValue());
+/**
+  * 変数・パラメタの置き場所（alloca、大域変数、外側の変数のアドレスの引数）か
+  */
+bool CodeGen::isMemory(llvm::Value *value) {
+  return llvm::isa<llvm::AllocaInst>(value) || llvm::isa<llvm::GlobalVariable>(value) ||
+         llvm::isa<llvm::Argument>(value);
 }
 
 void CodeGen::setLibraries() {
@@ -267,12 +420,12 @@ void CodeGen::setLibraries() {
   auto *printfFunc = llvm::Function::Create(
         printfFT, llvm::Function::ExternalLinkage, "printf", TheModule.get());
 
-  // define void write(int i)
+  // define internal fastcc void __pl0_write(int i)
   std::vector<llvm::Type *> Int32s(1, TheBuilder.getInt64Ty());
   auto *writeFT =
     llvm::FunctionType::get(TheBuilder.getVoidTy(), Int32s, false);
-  writeFunc = llvm::Function::Create(
-        writeFT, llvm::Function::ExternalLinkage, "write", TheModule.get());
+  writeFunc = createFunction(writeFT, "__pl0_write");
+  writeFunc->addFnAttr(llvm::Attribute::NoUnwind);
 
   auto Arg = writeFunc->arg_begin();
   Arg->setName("i");
@@ -292,11 +445,11 @@ void CodeGen::setLibraries() {
   TheBuilder.CreateCall(printfFunc, write_args, "call_write");
   TheBuilder.CreateRetVoid();
 
-  // define void writeln()
+  // define internal fastcc void __pl0_writeln()
   auto *writelnFT =
     llvm::FunctionType::get(TheBuilder.getVoidTy(), false);
-  writelnFunc = llvm::Function::Create(
-        writelnFT, llvm::Function::ExternalLinkage, "writeln", TheModule.get());
+  writelnFunc = createFunction(writelnFT, "__pl0_writeln");
+  writelnFunc->addFnAttr(llvm::Attribute::NoUnwind);
 
   auto *writelnBB = llvm::BasicBlock::Create(TheContext, "entry", writelnFunc);
   TheBuilder.SetInsertPoint(writelnBB);
@@ -308,3 +461,196 @@ void CodeGen::setLibraries() {
   TheBuilder.CreateCall(printfFunc, writeln_args, "call_writeln");
   TheBuilder.CreateRetVoid();
 }
+
+/**
+  * main 以外の関数（PL/0の関数と実行時の補助関数）を作る
+  * モジュールの外から呼ばれないので内部リンケージと fastcc にし、
+  * 引数の削除やインライン展開、使われない関数の削除をできるようにする。
+  * 補助関数の名前には識別子に使えない '_' を付け、PL/0の関数やlibcと衝突しないようにする
+  */
+llvm::Function *CodeGen::createFunction(llvm::FunctionType *type, const llvm::Twine &name) {
+  auto *func = llvm::Function::Create(type, llvm::Function::InternalLinkage, name, TheModule.get());
+  func->setCallingConv(llvm::CallingConv::Fast);
+  return func;
+}
+
+/**
+  * 関数を呼び出す（呼び出し規約は関数に合わせる）
+  */
+llvm::CallInst *CodeGen::createCall(llvm::Function *func, llvm::ArrayRef<llvm::Value *> args) {
+  auto *call = TheBuilder.CreateCall(func, args);
+  call->setCallingConv(func->getCallingConv());
+  return call;
+}
+
+/**
+  * 副作用の解析の結果からPL/0の関数の属性を付ける
+  * PL/0には例外がないので、どの関数も nounwind になる。
+  * willreturn は LLVM 10 からなので、名前で引けるときだけ付ける
+  */
+void CodeGen::setAttributes(llvm::Function *func, uint32_t decl) {
+  unsigned effects = Effects->getEffects(decl);
+  func->addFnAttr(llvm::Attribute::NoUnwind);
+  if (!(effects & (EffectAnalysis::EFF_WRITE | EffectAnalysis::EFF_OUTPUT)))
+    func->addFnAttr(effects & EffectAnalysis::EFF_READ ? llvm::Attribute::ReadOnly : llvm::Attribute::ReadNone);
+  if (!Effects->isRecursive(decl))
+    func->addFnAttr(llvm::Attribute::NoRecurse);
+  if (!(effects & EffectAnalysis::EFF_LOOP)) {
+    auto will_return = llvm::Attribute::getAttrKindFromName("willreturn");
+    if (will_return != llvm::Attribute::None)
+      func->addFnAttr(will_return);
+  }
+}
+
+/**
+  * SSAモード: ブロックの終わりでの変数の値を記録する
+  */
+void CodeGen::writeVariable(uint32_t decl, llvm::BasicBlock *block, llvm::Value *value) {
+  CurrentDef[std::make_pair(block, decl)] = value;
+}
+
+/**
+  * SSAモード: ブロックの終わりでの変数の値を求める
+  * 値のないブロックから先行ブロックをさかのぼる。再帰せず作業スタックでたどり、
+  * 先行ブロックが複数あれば phi を置き、まだ出そろっていなければ中身のない phi を置く
+  */
+llvm::Value *CodeGen::readVariable(uint32_t decl, llvm::BasicBlock *block) {
+  auto found = CurrentDef.find(std::make_pair(block, decl));
+  if (found != CurrentDef.end())
+    return resolvePhi(found->second);
+
+  llvm::SmallVector<llvm::BasicBlock *, 8> work(1, block);
+  llvm::SmallVector<llvm::BasicBlock *, 8> chains;   // 先行ブロックが1つのブロック
+  llvm::SmallVector<llvm::PHINode *, 8> phis;
+  while (!work.empty()) {
+    auto *bb = work.pop_back_val();
+    auto inserted = CurrentDef.insert(std::make_pair(std::make_pair(bb, decl), nullptr));
+    if (!inserted.second)
+      continue;
+    llvm::Value *&def = inserted.first->second;
+    if (!Sealed.count(bb)) {
+      auto *phi = createPhi(decl, bb);
+      IncompletePhis[bb].push_back(std::make_pair(decl, phi));
+      def = phi;
+    } else if (auto *pred = bb->getSinglePredecessor()) {
+      chains.push_back(bb);   // 後で先行ブロックの値を写す
+      work.push_back(pred);
+    } else if (llvm::pred_empty(bb)) {
+      def = undefined();      // 関数の入口か到達しないブロック
+    } else {
+      auto *phi = createPhi(decl, bb);
+      def = phi;
+      phis.push_back(phi);
+      for (auto *pred : llvm::predecessors(bb))
+        work.push_back(pred);
+    }
+  }
+
+  for (auto *bb : llvm::reverse(chains)) {
+    auto *pred = bb->getSinglePredecessor();
+    llvm::Value *value;
+    while (!(value = CurrentDef[std::make_pair(pred, decl)]))
+      pred = pred->getSinglePredecessor();
+    writeVariable(decl, bb, value);
+  }
+  // 先行ブロックの値はすべて決まっている
+  for (auto *phi : phis)
+    addPhiOperands(decl, phi);
+  removeTrivialPhis(phis);
+  return resolvePhi(CurrentDef[std::make_pair(block, decl)]);
+}
+
+/**
+  * SSAモード: ブロックの先頭に変数の phi を置く
+  */
+llvm::PHINode *CodeGen::createPhi(uint32_t decl, llvm::BasicBlock *block) {
+  llvm::PHINode *phi;
+  if (auto *first = block->getFirstNonPHI())
+    phi = llvm::PHINode::Create(TheBuilder.getInt64Ty(), 2, "", first);
+  else
+    phi = llvm::PHINode::Create(TheBuilder.getInt64Ty(), 2, "", block);
+  Phis.push_back(std::make_pair(phi, decl));
+  return phi;
+}
+
+/**
+  * SSAモード: 先行ブロックの終わりでの値を phi に加える
+  */
+void CodeGen::addPhiOperands(uint32_t decl, llvm::PHINode *phi) {
+  for (auto *pred : llvm::predecessors(phi->getParent()))
+    phi->addIncoming(readVariable(decl, pred), pred);
+}
+
+/**
+  * SSAモード: 自分以外に1つの値しか受け取らない phi をその値で置き換える
+  * 置き換えた phi を使う phi も調べ直す。置き換えた phi は CurrentDef に残るので
+  * Replaced に置き換えた値を記録し、消すのは生成の後にする
+  */
+void CodeGen::removeTrivialPhis(llvm::SmallVectorImpl<llvm::PHINode *> &phis) {
+  while (!phis.empty()) {
+    auto *phi = phis.pop_back_val();
+    if (Replaced.count(phi))
+      continue;
+    llvm::Value *same = nullptr;
+    bool trivial = true;
+    for (llvm::Value *op : phi->incoming_values()) {
+      if (op == same || op == phi)
+        continue;
+      if (same) {
+        trivial = false;
+        break;
+      }
+      same = op;
+    }
+    if (!trivial)
+      continue;
+    if (!same)
+      same = undefined();
+    for (auto *user : phi->users())
+      if (user != phi && llvm::isa<llvm::PHINode>(user))
+        phis.push_back(llvm::cast<llvm::PHINode>(user));
+    phi->replaceAllUsesWith(same);
+    phi->dropAllReferences();   // 置き換えた phi が他の値の使用者として残らないようにする
+    Replaced[phi] = same;
+  }
+}
+
+/**
+  * SSAモード: 置き換えた phi を置き換えた値にたどる
+  * たどった phi は最後の値を直接指すようにする
+  */
+llvm::Value *CodeGen::resolvePhi(llvm::Value *value) {
+  llvm::Value *result = value;
+  while (auto *phi = llvm::dyn_cast_or_null<llvm::PHINode>(result)) {
+    auto found = Replaced.find(phi);
+    if (found == Replaced.end())
+      break;
+    result = found->second;
+  }
+  while (value != result) {
+    auto &next = Replaced[llvm::cast<llvm::PHINode>(value)];
+    value = next;
+    next = result;
+  }
+  return result;
+}
+
+/**
+  * SSAモード: ブロックの先行ブロックが出そろった。中身のない phi を埋める
+  */
+void CodeGen::sealBlock(llvm::BasicBlock *block) {
+  if (!SSA)
+    return;
+  Sealed.insert(block);
+  auto found = IncompletePhis.find(block);
+  if (found == IncompletePhis.end())
+    return;
+  auto incomplete = std::move(found->second);
+  IncompletePhis.erase(found);
+  llvm::SmallVector<llvm::PHINode *, 8> phis;
+  for (auto &pair : incomplete) {
+    addPhiOperands(pair.first, pair.second);
+    phis.push_back(pair.second);
+  }
+  removeTrivialPhis(phis);
+}
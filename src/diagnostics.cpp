@@ -0,0 +1,221 @@
+#include "diagnostics.hpp"
+#include "lexer.hpp"
+#include "log.hpp"
+#include <iterator>
+
+const uint32_t Diagnostic::NOLOC;
+thread_local Diagnostics *Log::Engine = nullptr;
+
+/**
+  * TokenStreamの破棄前に呼ぶ
+  * そのTokenStreamで位置を解決する診断を出力してから登録を外す
+  */
+void Log::releaseSource(const TokenStream *source) {
+  if (engine().getSource() == source)
+    engine().setSource(nullptr);
+}
+
+/**
+  * 位置の解決に使うTokenStreamを切り替える
+  * 未出力の診断は元のTokenStreamで位置を解決するため先に出力する
+  * @param TokenStream（nullptrなら位置なし）
+  */
+void Diagnostics::setSource(const TokenStream *source) {
+  if (source == Source)
+    return;
+  flush();
+  Source = source;
+  if (Source)
+    Names = Source->getNames();
+}
+
+/**
+  * 診断を記録する
+  * エラー数が上限（既定はMAXERROR）を超えたら"too many errors"を記録し、以降の診断は捨てる
+  */
+void Diagnostics::report(const Diagnostic &diag) {
+  if (Full)
+    return;
+  Pending.push_back(diag);
+  ReportNum++;
+  if (diag.Level == DIAG_ERROR && ErrorNum++ > MaxError) {
+    Pending.emplace_back(DIAG_TOO_MANY, DIAG_ERROR, Diagnostic::NOLOC);
+    Full = true;
+  }
+}
+
+/**
+  * 文字列を診断エンジンにコピーして引数にする
+  * （ソースや識別子表にない文字列用）
+  */
+DiagArg Diagnostics::copyString(const std::string &str) {
+  DiagArg arg;
+  arg.ArgKind = DiagArg::STRING;
+  arg.Value = (int)Strings.size();
+  Strings.push_back(str);
+  return arg;
+}
+
+/**
+  * 記録した診断を出力せずに取り出す（インクリメンタル解析で診断を差し替えるため）
+  * STRING引数の本体は strings の末尾に移し、番号を付け替える
+  * @param 診断の追加先, STRING引数の本体の追加先
+  */
+void Diagnostics::take(std::vector<Diagnostic> &diags, std::vector<std::string> &strings) {
+  int base = (int)strings.size();
+  for (Diagnostic diag : Pending) {
+    for (auto &arg : diag.Args)
+      if (arg.ArgKind == DiagArg::STRING)
+        arg.Value += base;
+    diags.push_back(diag);
+  }
+  std::move(Strings.begin(), Strings.end(), std::back_inserter(strings));
+  Pending.clear();
+  Strings.clear();
+}
+
+/**
+  * 記録した診断をまとめて出力する
+  */
+void Diagnostics::flush() {
+  if (Pending.empty())
+    return;
+  std::string out;
+  out.reserve(Pending.size() * 64);
+  for (const auto &diag : Pending) {
+    if (Format == DIAG_JSON)
+      renderJSON(diag, out);
+    else
+      renderText(diag, out);
+  }
+  output(out);
+  Pending.clear();
+  Strings.clear();
+}
+
+/**
+  * 診断以外の出力（"parse ok"など）を、記録済みの診断の後に書く
+  */
+void Diagnostics::write(llvm::StringRef text) {
+  flush();
+  output(text);
+}
+
+void Diagnostics::output(llvm::StringRef text) {
+  if (Buffer) {
+    Buffer->append(text.data(), text.size());
+    return;
+  }
+  fwrite(text.data(), 1, text.size(), Out);
+  fflush(Out);
+}
+
+std::string Diagnostics::argText(const DiagArg &arg) const {
+  switch (arg.ArgKind) {
+  case DiagArg::INT:
+    return std::to_string(arg.Value);
+  case DiagArg::SYMBOL:
+    return Names ? Names->str(arg.Value) : "#" + std::to_string(arg.Value);
+  case DiagArg::RANGE:
+    return Source ? Source->getSource().substr(arg.Value, arg.Length).str() : "";
+  case DiagArg::TEXT:
+    return arg.Text;
+  case DiagArg::STRING:
+    return Strings[arg.Value];
+  default:
+    return "";
+  }
+}
+
+/**
+  * 診断のメッセージを組み立てる
+  */
+std::string Diagnostics::message(const Diagnostic &diag) const {
+  std::string arg0 = argText(diag.Args[0]);
+  std::string arg1 = argText(diag.Args[1]);
+  switch (diag.ID) {
+  case DIAG_MESSAGE:
+    return arg0;
+  case DIAG_EXPECTED:
+    return "expected '" + arg0 + "' but '" + arg1 + "'";
+  case DIAG_UNEXPECTED:
+    return "unexpected '" + arg0 + "': deleted";
+  case DIAG_UNDEFINED_FUNC:
+    return "undefined func " + arg0 + "(" + arg1 + ")";
+  case DIAG_MISSING:
+    return "missing '" + arg0 + "': inserted";
+  case DIAG_DUPLICATE:
+    return "duplicate " + arg0 + " " + arg1 + ": ignored";
+  case DIAG_SKIP:
+    return "delete " + arg0 + " and skip to a new statement";
+  case DIAG_DUPLICATE_FACTOR:
+    return "fact + id/num " + arg0 + ": missing opcode";
+  case DIAG_ADD_TEMP:
+    return "add " + arg0 + " to name table temporarily";
+  case DIAG_DELETE_TEMP:
+    return "delete " + arg0 + " from name table";
+  case DIAG_UNDEFINED:
+    return arg0 + " is undefined";
+  case DIAG_ERROR_COUNT:
+    return arg0 + (diag.Args[0].Value > 1 ? " errors" : " error");
+  case DIAG_TOO_MANY:
+    return "too many errors";
+  }
+  return "";
+}
+
+/**
+  * テキスト形式: [行:桁] error: メッセージ
+  * 位置のない診断はメッセージだけを出力する
+  */
+void Diagnostics::renderText(const Diagnostic &diag, std::string &out) const {
+  if (diag.Loc != Diagnostic::NOLOC && Source && diag.Level != DIAG_NOTE) {
+    char head[64];
+    snprintf(head, sizeof(head), "[% 3d:% 3d] %s: ", Source->getLine(diag.Loc), Source->getColumn(diag.Loc),
+             diag.Level == DIAG_ERROR ? "error" : "warn");
+    out += head;
+  }
+  out += message(diag);
+  out += '\n';
+}
+
+static void appendJSONString(std::string &out, llvm::StringRef str) {
+  out += '"';
+  for (char c : str) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\n': out += "\\n"; break;
+    case '\t': out += "\\t"; break;
+    default:
+      if ((unsigned char)c < 0x20) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+  }
+  out += '"';
+}
+
+/**
+  * JSON形式: 1行に1件
+  * {"level":"error","file":"a.p0","line":3,"column":9,"message":"..."}
+  */
+void Diagnostics::renderJSON(const Diagnostic &diag, std::string &out) const {
+  static const char *levels[] = { "error", "warn", "note" };
+  out += "{\"level\":\"";
+  out += levels[diag.Level];
+  out += '"';
+  if (diag.Loc != Diagnostic::NOLOC && Source) {
+    out += ",\"file\":";
+    appendJSONString(out, Source->getBufferName());
+    out += ",\"line\":" + std::to_string(Source->getLine(diag.Loc));
+    out += ",\"column\":" + std::to_string(Source->getColumn(diag.Loc));
+  }
+  out += ",\"message\":";
+  appendJSONString(out, message(diag));
+  out += "}\n";
+}
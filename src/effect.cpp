@@ -0,0 +1,212 @@
+#include "effect.hpp"
+#include <algorithm>
+
+const uint32_t EffectAnalysis::NOFUNC;
+
+/**
+  * プログラム全体を解析する
+  */
+void EffectAnalysis::analyze() {
+  Funcs.assign(Context.getNumDecls(), FuncInfo());
+  Owners.assign(Context.getNumDecls(), NOFUNC);
+  IsVar.assign(Context.getNumDecls(), false);
+  Shared.assign(Context.getNumDecls(), false);
+  block(Program.getBlock());
+  propagate();
+}
+
+/**
+  * ブロックをたどる。入れ子の関数は本体をたどり終えた順に Finished に並べる
+  * @param ブロック, 関数のパラメタの宣言
+  */
+void EffectAnalysis::block(BlockAST block_ast, llvm::ArrayRef<uint32_t> params) {
+  if (auto variable = block_ast.getVariable()) {
+    for (uint32_t decl : variable.getDecls()) {
+      IsVar[decl] = true;
+      Owners[decl] = Current;
+    }
+  }
+  for (uint32_t param : params) {
+    IsVar[param] = true;
+    Owners[param] = Current;
+  }
+  uint32_t outer = Current;
+  for (auto func_ast : block_ast.getFunctions()) {
+    if (!func_ast)
+      continue;
+    uint32_t decl = func_ast.getDecl();
+    FuncInfo &info = Funcs[decl];
+    info.Depth = outer == NOFUNC ? 1 : Funcs[outer].Depth + 1;
+    info.Active = true;
+    Current = decl;
+    block(func_ast.getBlock(), func_ast.getParameters());
+    Current = outer;
+
+    info.Active = false;
+    info.Recursive = info.UpLevel <= info.Depth;
+    if (info.Recursive)
+      info.Effects |= EFF_LOOP;
+    Finished.push_back(decl);
+  }
+  statement(block_ast.getStatement());
+}
+
+/**
+  * 文をたどる
+  * 入れ子の文は再帰せず StmtStack に積む（たどる順は問わない）
+  */
+void EffectAnalysis::statement(BaseStmtAST stmt_ast) {
+  size_t base = StmtStack.size();
+  StmtStack.push_back(stmt_ast);
+  while (StmtStack.size() > base) {
+    BaseStmtAST stmt = StmtStack.back();
+    StmtStack.pop_back();
+    visit(stmt);
+  }
+}
+
+void EffectAnalysis::visitAssign(AssignAST stmt_ast) {
+  use(stmt_ast.getDecl(), EFF_WRITE);
+  expression(stmt_ast.getRHS());
+}
+
+void EffectAnalysis::visitBeginEnd(BeginEndAST stmt_ast) {
+  for (auto stmt : stmt_ast.getStatements())
+    StmtStack.push_back(stmt);
+}
+
+void EffectAnalysis::visitIfThen(IfThenAST stmt_ast) {
+  expression(stmt_ast.getCondition());
+  StmtStack.push_back(stmt_ast.getStatement());
+}
+
+void EffectAnalysis::visitWhileDo(WhileDoAST stmt_ast) {
+  if (Current != NOFUNC)
+    Funcs[Current].Effects |= EFF_LOOP;
+  expression(stmt_ast.getCondition());
+  StmtStack.push_back(stmt_ast.getStatement());
+}
+
+void EffectAnalysis::visitReturn(ReturnAST stmt_ast) {
+  expression(stmt_ast.getExpression());
+}
+
+void EffectAnalysis::visitWrite(WriteAST stmt_ast) {
+  if (Current != NOFUNC)
+    Funcs[Current].Effects |= EFF_OUTPUT;
+  expression(stmt_ast.getExpression());
+}
+
+void EffectAnalysis::visitWriteln(WritelnAST) {
+  if (Current != NOFUNC)
+    Funcs[Current].Effects |= EFF_OUTPUT;
+}
+
+/**
+  * 式をたどり、変数の参照と関数の呼び出しを調べる
+  * 子の式は再帰せず ExpStack に積む
+  */
+void EffectAnalysis::expression(BaseExpAST exp_ast) {
+  size_t base = ExpStack.size();
+  ExpStack.push_back(exp_ast.getIndex());
+  while (ExpStack.size() > base) {
+    BaseExpAST exp(&Context, ExpStack.back());
+    ExpStack.pop_back();
+    switch (exp.getValueID()) {
+    case CondExpID: {
+      auto cond = exp.castAs<CondExpAST>();
+      ExpStack.push_back(cond.getRHS().getIndex());
+      if (cond.getOp() != OP_ODD)
+        ExpStack.push_back(cond.getLHS().getIndex());
+      break;
+    }
+    case BinaryExprID: {
+      auto binary = exp.castAs<BinaryExprAST>();
+      ExpStack.push_back(binary.getRHS().getIndex());
+      ExpStack.push_back(binary.getLHS().getIndex());
+      break;
+    }
+    case CallExprID: {
+      auto call_ast = exp.castAs<CallExprAST>();
+      call(call_ast.getDecl());
+      for (auto arg : call_ast.getArgs())
+        ExpStack.push_back(arg.getIndex());
+      break;
+    }
+    case VariableID:
+      use(exp.castAs<VariableAST>().getDecl(), EFF_READ);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/**
+  * 変数の読み書きを調べる（自分の変数・パラメタでなければ副作用とする）
+  */
+void EffectAnalysis::use(uint32_t decl, Effect effect) {
+  if (Current == NOFUNC || !IsVar[decl] || Owners[decl] == Current)
+    return;
+  Shared[decl] = true;
+  Funcs[Current].Effects |= effect;
+  if (Owners[decl] != NOFUNC)
+    addFreeVars(Current, decl);
+}
+
+/**
+  * 関数の呼び出しを調べる
+  * 生成中の関数はその深さを、生成し終えた関数はそれが呼びうる生成中の関数の深さを UpLevel に反映する
+  */
+void EffectAnalysis::call(uint32_t decl) {
+  if (Current == NOFUNC)
+    return;
+  FuncInfo &caller = Funcs[Current];
+  const FuncInfo &callee = Funcs[decl];
+  if (callee.Active)
+    caller.UpLevel = std::min(caller.UpLevel, callee.Depth);
+  else if (callee.Depth)
+    caller.UpLevel = std::min(caller.UpLevel, callee.UpLevel);
+  caller.Calls.push_back(decl);
+}
+
+/**
+  * 呼び出す関数の副作用と外側から受け取る変数を呼び出し元に加える
+  * 生成し終えた順にたどれば循環のない呼び出しは1回で伝わる。循環の分は変わらなくなるまで繰り返す
+  */
+void EffectAnalysis::propagate() {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (uint32_t decl : Finished) {
+      FuncInfo &info = Funcs[decl];
+      unsigned effects = info.Effects;
+      for (uint32_t callee : info.Calls) {
+        effects |= Funcs[callee].Effects;
+        if (callee != decl && addFreeVars(decl, Funcs[callee].FreeVars))
+          changed = true;
+      }
+      if (effects != info.Effects) {
+        info.Effects = effects;
+        changed = true;
+      }
+    }
+  }
+}
+
+/**
+  * 関数が外側から受け取る変数を加える（自分の変数・パラメタは除く）
+  * @return 増えたら true
+  */
+bool EffectAnalysis::addFreeVars(uint32_t decl, llvm::ArrayRef<uint32_t> vars) {
+  std::vector<uint32_t> &free_vars = Funcs[decl].FreeVars;
+  size_t size = free_vars.size();
+  for (uint32_t var : vars) {
+    if (Owners[var] == decl)
+      continue;
+    auto itr = std::lower_bound(free_vars.begin(), free_vars.end(), var);
+    if (itr == free_vars.end() || *itr != var)
+      free_vars.insert(itr, var);
+  }
+  return free_vars.size() != size;
+}
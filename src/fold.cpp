@@ -0,0 +1,264 @@
+#include "fold.hpp"
+#include <climits>
+
+/**
+  * 比較演算の結果
+  */
+static bool compare(OpID op, int64_t lhs, int64_t rhs) {
+  switch (op) {
+  case OP_EQ: return lhs == rhs;
+  case OP_NE: return lhs != rhs;
+  case OP_LT: return lhs < rhs;
+  case OP_LE: return lhs <= rhs;
+  case OP_GT: return lhs > rhs;
+  case OP_GE: return lhs >= rhs;
+  default:
+    llvm_unreachable("not a comparison");
+  }
+}
+
+/**
+  * プログラム全体を畳み込む
+  */
+void ConstantFolder::fold() {
+  Kinds.assign(Context.getNumDecls(), DECL_NONE);
+  Numbers.assign(Context.getNumDecls(), 0);
+  block(Program.getBlock());
+}
+
+/**
+  * ブロックを宣言が使えるようになる順（定数, 変数, パラメタ, 関数, 文）にたどる
+  * @param ブロック, 関数のパラメタの宣言
+  */
+void ConstantFolder::block(BlockAST block_ast, llvm::ArrayRef<uint32_t> params) {
+  if (auto constant = block_ast.getConstant()) {
+    for (size_t i = 0; i < constant.size(); i++) {
+      Kinds[constant.getDecl(i)] = DECL_CONST;
+      Numbers[constant.getDecl(i)] = constant.getValue(i);
+    }
+  }
+  if (auto variable = block_ast.getVariable())
+    for (uint32_t decl : variable.getDecls())
+      Kinds[decl] = DECL_VAR;
+  // パラメタも内側の関数からアドレスの引数で使えるので、内側の関数より先に印をつける
+  for (uint32_t param : params)
+    Kinds[param] = DECL_VAR;
+  for (auto func_ast : block_ast.getFunctions()) {
+    if (!func_ast)
+      continue;
+    Kinds[func_ast.getDecl()] = DECL_FUNC;
+    Numbers[func_ast.getDecl()] = (int)func_ast.getParameters().size();
+    block(func_ast.getBlock(), func_ast.getParameters());
+  }
+  statement(block_ast.getStatement());
+}
+
+/**
+  * 文をたどる
+  * 入れ子の文は再帰せず StmtStack に積み、積んだ順の逆にたどる
+  */
+void ConstantFolder::statement(BaseStmtAST stmt_ast) {
+  size_t base = StmtStack.size();
+  StmtStack.push_back(StmtWork(stmt_ast));
+  while (StmtStack.size() > base) {
+    StmtWork work = StmtStack.back();
+    StmtStack.pop_back();
+    if (work.Stmt) {
+      visit(work.Stmt);
+    } else if (Errors == work.Errors) {
+      // if/whileの中の文をたどり終え、消す部分にエラーがなかった
+      replace(work.Target, work.Replace);
+      NumDeleted++;
+    }
+  }
+}
+
+void ConstantFolder::visitAssign(AssignAST stmt_ast) {
+  use(stmt_ast.getDecl(), DECL_VAR);
+  expression(stmt_ast.getRHS());
+}
+
+void ConstantFolder::visitBeginEnd(BeginEndAST stmt_ast) {
+  auto statements = stmt_ast.getStatements();
+  for (size_t i = statements.size(); i > 0; i--)
+    StmtStack.push_back(StmtWork(statements[i - 1]));
+}
+
+void ConstantFolder::visitIfThen(IfThenAST stmt_ast) {
+  unsigned errors = Errors;
+  Value cond = expression(stmt_ast.getCondition());
+  // 中の文の後で、真なら中の文に、偽なら空文に置き換える
+  if (cond.Known)
+    StmtStack.push_back(StmtWork(stmt_ast.getIndex(),
+                                 cond.Num ? stmt_ast.getStatement().getIndex() : ASTContext::NOIDX, errors));
+  StmtStack.push_back(StmtWork(stmt_ast.getStatement()));
+}
+
+void ConstantFolder::visitWhileDo(WhileDoAST stmt_ast) {
+  unsigned errors = Errors;
+  Value cond = expression(stmt_ast.getCondition());
+  // 条件が偽なら一度も実行しないので、中の文の後で空文に置き換える
+  if (cond.Known && !cond.Num)
+    StmtStack.push_back(StmtWork(stmt_ast.getIndex(), ASTContext::NOIDX, errors));
+  StmtStack.push_back(StmtWork(stmt_ast.getStatement()));
+}
+
+void ConstantFolder::visitReturn(ReturnAST stmt_ast) {
+  expression(stmt_ast.getExpression());
+}
+
+void ConstantFolder::visitWrite(WriteAST stmt_ast) {
+  expression(stmt_ast.getExpression());
+}
+
+/**
+  * 式をたどって値を求め、値の決まる部分を畳み込む
+  * 子の式を先にたどる。子は再帰せず ExpStack に積み、求めた値は Values に積む
+  * @return 式の値（条件式なら真: 1, 偽: 0）
+  */
+ConstantFolder::Value ConstantFolder::expression(BaseExpAST exp_ast) {
+  size_t base = ExpStack.size();
+  ExpStack.push_back(exp_ast.getIndex());
+  while (ExpStack.size() > base) {
+    uint32_t work = ExpStack.back();
+    ExpStack.pop_back();
+    BaseExpAST exp(&Context, work & ~EXPANDED);
+    AstID id = exp.getValueID();
+    if ((work & EXPANDED) || id == VariableID || id == NumberID) {
+      Values.push_back(evaluate(exp));   // 子をたどり終えた式か、子のない式
+      continue;
+    }
+    ExpStack.push_back(work | EXPANDED);
+    switch (id) {
+    case CondExpID: {
+      auto cond = exp.castAs<CondExpAST>();
+      ExpStack.push_back(cond.getRHS().getIndex());
+      if (cond.getOp() != OP_ODD)
+        ExpStack.push_back(cond.getLHS().getIndex());
+      break;
+    }
+    case BinaryExprID: {
+      auto binary = exp.castAs<BinaryExprAST>();
+      ExpStack.push_back(binary.getRHS().getIndex());
+      ExpStack.push_back(binary.getLHS().getIndex());
+      break;
+    }
+    case CallExprID: {
+      auto call = exp.castAs<CallExprAST>();
+      for (size_t i = call.getArgSize(); i > 0; i--)
+        ExpStack.push_back(call.getArgs(i - 1).getIndex());
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  Value value = Values.back();
+  Values.pop_back();
+  return value;
+}
+
+/**
+  * 子の値が Values に積まれた式の値を求める
+  * 値は生成するコードと同じく64ビットで計算する（加減乗算は桁あふれで折り返す）。
+  * 0除算と桁あふれする除算は畳み込まず、実行時に任せる
+  */
+ConstantFolder::Value ConstantFolder::evaluate(BaseExpAST exp) {
+  Value unknown = { false, 0 };
+  switch (exp.getValueID()) {
+  case NumberID:
+    return { true, exp.castAs<NumberAST>().getNumberValue() };
+
+  case VariableID: {
+    uint32_t decl = exp.castAs<VariableAST>().getDecl();
+    if (Kinds[decl] == DECL_CONST) {
+      setNumber(exp.getIndex(), Numbers[decl]);
+      return { true, Numbers[decl] };
+    }
+    use(decl, DECL_VAR);
+    return unknown;
+  }
+
+  case CondExpID: {
+    auto cond = exp.castAs<CondExpAST>();
+    Value rhs = Values.back();
+    Values.pop_back();
+    if (cond.getOp() == OP_ODD)
+      return rhs.Known ? Value{ true, (rhs.Num & 1) != 0 } : unknown;
+    Value lhs = Values.back();
+    Values.pop_back();
+    if (!lhs.Known || !rhs.Known)
+      return unknown;
+    return { true, compare(cond.getOp(), lhs.Num, rhs.Num) };
+  }
+
+  case BinaryExprID: {
+    auto binary = exp.castAs<BinaryExprAST>();
+    Value rhs = Values.back();
+    Values.pop_back();
+    Value lhs = Values.back();
+    Values.pop_back();
+    if (!lhs.Known || !rhs.Known)
+      return unknown;
+    uint64_t l = lhs.Num, r = rhs.Num;
+    if (binary.getPrefix() == OP_SUB)
+      l = 0 - l;
+    switch (binary.getOp()) {
+    case OP_ADD: l += r; break;
+    case OP_SUB: l -= r; break;
+    case OP_MUL: l *= r; break;
+    case OP_DIV:
+      if (rhs.Num == 0 || ((int64_t)l == INT64_MIN && rhs.Num == -1))
+        return unknown;
+      l = (uint64_t)((int64_t)l / rhs.Num);
+      break;
+    default:
+      return unknown;
+    }
+    setNumber(exp.getIndex(), (int64_t)l);
+    return { true, (int64_t)l };
+  }
+
+  case CallExprID: {
+    auto call = exp.castAs<CallExprAST>();
+    Values.resize(Values.size() - call.getArgSize());
+    uint32_t decl = call.getDecl();
+    if (Kinds[decl] != DECL_FUNC || Numbers[decl] != (int)call.getArgSize())
+      Errors++;
+    return unknown;
+  }
+
+  default:
+    llvm_unreachable("unknown expression AST");
+  }
+}
+
+/**
+  * 名前の参照を調べる（コード生成がエラーにするものを数える）
+  */
+void ConstantFolder::use(uint32_t decl, DeclKind kind) {
+  if (Kinds[decl] != kind)
+    Errors++;
+}
+
+/**
+  * 文のノードを別の文のノード（NOIDXなら空文）で置き換える
+  */
+void ConstantFolder::replace(uint32_t index, uint32_t with) {
+  ASTNode node = { NullID, OP_NONE, OP_NONE, 0, { ASTContext::NOIDX, ASTContext::NOIDX } };
+  if (with != ASTContext::NOIDX)
+    node = Context.getNode(with);
+  Context.setNode(index, node);
+}
+
+/**
+  * 式のノードを NumberAST に置き換える
+  * NumberAST に入らない値（32ビットを超えるもの）は置き換えず、親の式で畳み込めれば畳み込む
+  */
+void ConstantFolder::setNumber(uint32_t index, int64_t value) {
+  if (value < INT_MIN || value > INT_MAX)
+    return;
+  ASTNode node = { NumberID, OP_NONE, OP_NONE, 0, { (uint32_t)(int)value, ASTContext::NOIDX } };
+  Context.setNode(index, node);
+  NumFolded++;
+}
@@ -0,0 +1,314 @@
+#include "llvm/ADT/SmallVector.h"
+#include "incremental.hpp"
+#include "log.hpp"
+#include "table.hpp"
+#include <algorithm>
+#include <climits>
+
+/**
+  * 解析の間だけ、このスレッドの診断を記録用の診断エンジンに切り替える
+  * 件数の上限なしで記録し、take()で取り出す。取り出さなかった診断は出力せずに捨てる
+  */
+class DiagCapture {
+private:
+  std::string Discarded;
+  Diagnostics Engine;
+  Diagnostics *Caller;
+
+public:
+  DiagCapture() : Caller(&Log::engine()) {
+    Engine.setBuffer(&Discarded);
+    Engine.setMaxError(INT_MAX);
+    Log::setEngine(&Engine);
+  }
+  ~DiagCapture() { Log::setEngine(Caller); }
+
+  int getReportNum() const { return Engine.getReportNum(); }
+  void take(std::vector<Diagnostic> &diags, std::vector<std::string> &strings) { Engine.take(diags, strings); }
+};
+
+/**
+  * 名前表に戻す宣言
+  */
+struct Declaration {
+  uint32_t Decl;
+  SymbolID Name;
+  NameType Type;
+  int Num;         // 関数: 引数の数
+};
+
+/**
+  * ブロックで宣言された名前（定数・変数・関数）を宣言の順に集める
+  * 関数は、名前表に登録されたもの（ブロックの解析に失敗したものを含む）を関数定義の記録から集める
+  * @param ブロック, 関数定義の記録, ブロックを持つ関数の記録の番号（-1ならプログラムのブロック）
+  */
+static void collectDecls(const ASTContext &context, BlockAST block, const std::vector<FuncRecord> &funcs,
+                         int owner, std::vector<Declaration> &decls) {
+  if (auto constant = block.getConstant())
+    for (size_t i = 0; i < constant.size(); i++)
+      decls.push_back({ constant.getDecl(i), constant.getName(i), CONST, -1 });
+  if (auto variable = block.getVariable())
+    for (uint32_t decl : variable.getDecls())
+      decls.push_back({ decl, context.getDeclName(decl), VAR, -1 });
+  for (auto &func : funcs)
+    if (func.Parent == owner)
+      decls.push_back({ func.Decl, func.Name, FUNC, func.NumParams });
+  std::sort(decls.begin(), decls.end(),
+            [](const Declaration &a, const Declaration &b) { return a.Decl < b.Decl; });
+}
+
+/**
+  * 宣言を名前表に戻す
+  * 重複した定数はASTにはあるが名前表には登録されていないので、構文解析と同じく読み飛ばす
+  */
+static void addDeclaration(SymTable &table, const Declaration &decl) {
+  if (decl.Type == CONST && table.findSymbol(decl.Name, CONST))
+    return;
+  table.addSymbol(decl.Name, decl.Type, decl.Decl, decl.Num);
+}
+
+/**
+  * 編集範囲より後ろを指す診断の位置をずらす
+  */
+static void moveDiagnostic(Diagnostic &diag, uint32_t edit_end, int delta) {
+  if (diag.Loc != Diagnostic::NOLOC && diag.Loc >= edit_end)
+    diag.Loc += delta;
+  for (auto &arg : diag.Args)
+    if (arg.ArgKind == DiagArg::RANGE && (uint32_t)arg.Value >= edit_end)
+      arg.Value += delta;
+}
+
+/**
+  * コンストラクタ
+  * ソース全体を解析する
+  * @param ファイル名（診断に使う）, ソース
+  */
+IncrementalParser::IncrementalParser(llvm::StringRef filename, llvm::StringRef text)
+  : FileName(filename), Text(text), Result(false), Exact(false), LiveNodes(0),
+    NumFull(0), NumIncremental(0) {
+  parseAll();
+}
+
+/**
+  * 編集を反映して解析し直す
+  * @param 置き換える範囲（位置, 長さ。ソースの中に収まること）, 置き換える文字列
+  * @return 関数のブロックだけを解析し直した: true, 全体を解析し直した: false
+  */
+bool IncrementalParser::edit(uint32_t offset, uint32_t length, llvm::StringRef text) {
+  int index = findFunction(offset, offset + length);
+  Tokens = nullptr;   // 編集前のソースを参照している
+  Text.replace(offset, length, text.data(), text.size());
+  if (index >= 0 && reparse(index, offset, length, text.size())) {
+    NumIncremental++;
+    return true;
+  }
+  parseAll();
+  return false;
+}
+
+/**
+  * ソース全体を解析し直す
+  */
+void IncrementalParser::parseAll() {
+  NumFull++;
+  Tokens = nullptr;
+  Program = nullptr;
+  Funcs.clear();
+  Diags.clear();
+  Strings.clear();
+
+  DiagCapture capture;
+  Parser parser(buffer(), false, LEXER_STREAM);
+  parser.Records = &Funcs;
+  Result = parser.parseProgram();
+  capture.take(Diags, Strings);
+  Names = parser.Names;
+  Exact = !parser.Unlisted;
+  Program = parser.getAST();
+  Tokens = std::move(parser.Tokens);
+  LiveNodes = Program ? Program->getContext().getNumNodes() : 0;
+}
+
+/**
+  * 編集範囲を含む最も内側の関数のブロックを探す
+  * 編集がブロックの最初・最後のトークンとその隣の文字にかからなければ、ブロックの前後のトークンの区切りは変わらない
+  * @param 編集範囲（編集前の位置）
+  * @return 関数定義の記録の番号（全体を解析し直すなら -1）
+  */
+int IncrementalParser::findFunction(uint32_t begin, uint32_t end) const {
+  if (!Program || !Exact)
+    return -1;
+  // 差し替えで参照されなくなったノードが増えたら、全体を解析し直して詰める
+  if (Program->getContext().getNumNodes() > LiveNodes * 2 + 4096)
+    return -1;
+
+  // 編集範囲を含む記録は外側から順に並んでいる
+  int found = -1;
+  for (size_t i = 0; i < Funcs.size(); i++) {
+    const FuncRecord &func = Funcs[i];
+    if (func.FirstEnd >= begin || end >= func.Last)
+      continue;
+    if (func.Node == ASTContext::NOIDX)
+      break;   // これより内側の関数はASTにない
+    if (func.Clean)
+      found = (int)i;
+  }
+  return found;
+}
+
+/**
+  * 関数のブロックだけを解析し直して差し替える
+  * 名前表は、外側のブロックの宣言のうちこの関数より前にあったものをASTから戻して作り、
+  * 残りはブロックを解析し終えてから戻して外側への参照を解決する。
+  * 解析し直したブロックが元と同じトークンで終わり、一時的な名前が残らなければ差し替える
+  * @param 関数定義の記録の番号, 編集範囲（編集前の位置, 長さ）, 置き換えた文字列の長さ
+  * @return 差し替えた: true, 全体を解析し直す必要がある: false
+  */
+bool IncrementalParser::reparse(int index, uint32_t offset, uint32_t length, uint32_t size) {
+  const FuncRecord record = Funcs[index];
+  int delta = (int)size - (int)length;
+
+  llvm::SmallVector<int, 8> chain;   // 外側から順に、この関数までの記録の番号
+  for (int i = index; i >= 0; i = Funcs[i].Parent)
+    chain.push_back(i);
+  std::reverse(chain.begin(), chain.end());
+
+  DiagCapture capture;
+  auto tokens = llvm::make_unique<TokenStream>(buffer(), Names, record.Prev);
+  tokens->getNextToken();   // ブロックの直前のトークンは解析済み
+  if (tokens->getToken().offset() != record.First)
+    return false;
+  int skip = capture.getReportNum();   // 直前のトークンとの間の字句解析エラーは記録済み
+
+  BlockAST root = Program->getBlock();
+  Parser parser(std::move(tokens), Program->releaseContext(), false);
+  Program = nullptr;
+  ASTContext &context = *parser.Context;
+  SymTable &table = parser.sym_table;
+  std::vector<FuncRecord> records;
+  parser.Records = &records;
+
+  // 外側のブロックごとに、関数より前の宣言を名前表に戻し、後の宣言は取っておく
+  std::vector<std::vector<Declaration>> later(chain.size());
+  for (size_t level = 0; level < chain.size(); level++) {
+    int owner = level == 0 ? -1 : chain[level - 1];
+    BlockAST block = root;
+    table.blockIn();
+    if (owner >= 0) {
+      FuncDeclAST func(&context, Funcs[owner].Node);
+      for (uint32_t param : func.getParameters())
+        table.addSymbol(context.getDeclName(param), PARAM, param);
+      block = func.getBlock();
+    }
+    std::vector<Declaration> decls;
+    collectDecls(context, block, Funcs, owner, decls);
+    for (auto &decl : decls) {
+      if (decl.Decl <= Funcs[chain[level]].Decl)
+        addDeclaration(table, decl);
+      else
+        later[level].push_back(decl);
+    }
+  }
+  table.blockIn();
+  for (uint32_t param : FuncDeclAST(&context, record.Node).getParameters())
+    table.addSymbol(context.getDeclName(param), PARAM, param);
+
+  BlockAST block = parser.parseBlock();
+  Token end = parser.Tokens->getToken();
+  if (!block || table.remainedTemp() || end.getTokenType() != record.EndType ||
+      end.offset() != record.End + delta || end.prev().offset() != record.Last + delta)
+    return false;
+
+  for (size_t level = chain.size(); level-- > 0;) {
+    for (auto &decl : later[level])
+      addDeclaration(table, decl);
+    table.blockOut([&](uint32_t node, uint32_t decl) { context.resolve(node, decl); });
+  }
+  for (auto &ref : table.getReferences())
+    context.resolve(ref.second, context.addDecl(ref.first));
+
+  // 関数定義のリストの末尾（ブロック）を新しいブロックにする
+  uint32_t list = context.getNode(record.Node).Operand[1];
+  context.setListItem(list, context.getList(list).size() - 1, block.getIndex());
+  Exact = !parser.Unlisted;
+
+  std::vector<Diagnostic> diags;
+  capture.take(diags, Strings);
+  diags.erase(diags.begin(), diags.begin() + skip);
+  for (auto &func : records) {
+    func.DiagBegin += record.DiagBegin - skip;
+    func.DiagEnd += record.DiagBegin - skip;
+  }
+  splice(index, offset + length, delta, records, diags);
+
+  Tokens = std::move(parser.Tokens);
+  Program = llvm::make_unique<ProgramAST>(std::move(parser.Context), root, Names);
+  return true;
+}
+
+/**
+  * 解析し直した関数の中の記録と診断を差し替え、それより後ろの位置と診断の番号をずらす
+  * @param 関数定義の記録の番号, 編集範囲の終わり（編集前の位置）, 位置のずれ,
+  *        ブロックの中の関数定義の記録（Parentの-1はこの関数）, ブロックの解析中の診断
+  */
+void IncrementalParser::splice(int index, uint32_t edit_end, int delta, std::vector<FuncRecord> &records,
+                               std::vector<Diagnostic> &diags) {
+  int begin = Funcs[index].DiagBegin, end = Funcs[index].DiagEnd;
+  int diff = (int)diags.size() - (end - begin);
+
+  for (auto &diag : Diags)
+    moveDiagnostic(diag, edit_end, delta);
+  Diags.erase(Diags.begin() + begin, Diags.begin() + end);
+  Diags.insert(Diags.begin() + begin, diags.begin(), diags.end());
+
+  // 中の関数の記録は Funcs[index] の直後に並んでいる
+  size_t inner = index + 1;
+  while (inner < Funcs.size() && Funcs[inner].First < Funcs[index].End)
+    inner++;
+  int moved = (int)records.size() - (int)(inner - index - 1);
+
+  for (auto &func : Funcs) {
+    for (uint32_t *pos : { &func.Prev, &func.First, &func.FirstEnd, &func.Last, &func.End })
+      if (*pos >= edit_end)
+        *pos += delta;
+  }
+  for (int i = index; i >= 0; i = Funcs[i].Parent)
+    Funcs[i].DiagEnd += diff;
+  for (size_t i = inner; i < Funcs.size(); i++) {
+    Funcs[i].DiagBegin += diff;
+    Funcs[i].DiagEnd += diff;
+    if (Funcs[i].Parent > index)
+      Funcs[i].Parent += moved;
+  }
+  for (auto &func : records)
+    func.Parent = func.Parent < 0 ? index : index + 1 + func.Parent;
+
+  Funcs.erase(Funcs.begin() + index + 1, Funcs.begin() + inner);
+  Funcs.insert(Funcs.begin() + index + 1, records.begin(), records.end());
+}
+
+/**
+  * 今のソースに対する構文解析の診断を出力する（pl0 -c と同じ内容）
+  * @param 出力先, 出力形式, nullptrでなければ出力先の代わりに書く文字列
+  * @return 構文解析に成功した（"parse ok"を出力した）
+  */
+bool IncrementalParser::report(FILE *out, DiagFormat format, std::string *buffer) const {
+  Diagnostics diags(out, format);
+  diags.setBuffer(buffer);
+  diags.setSource(Tokens.get());
+  for (Diagnostic diag : Diags) {
+    for (auto &arg : diag.Args)
+      if (arg.ArgKind == DiagArg::STRING)
+        arg = diags.copyString(Strings[arg.Value]);
+    diags.report(diag);
+  }
+  int num = diags.getErrorNum();
+  if (num >= 1)
+    diags.report(Diagnostic(DIAG_ERROR_COUNT, DIAG_ERROR, Diagnostic::NOLOC, DiagArg::integer(num)));
+  bool ok = Result && num < Parser::MINERROR;
+  if (ok)
+    diags.write("parse ok\n");
+  else
+    diags.flush();
+  return ok;
+}
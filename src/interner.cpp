@@ -0,0 +1,13 @@
+#include "interner.hpp"
+
+/**
+  * 文字列を登録してIDを返す。登録済みであれば既存のIDを返す
+  * @param 文字列
+  * @return 文字列のID
+  */
+SymbolID StringInterner::intern(llvm::StringRef str) {
+  auto result = Map.insert(std::make_pair(str, (SymbolID)Strings.size()));
+  if (result.second)
+    Strings.push_back(result.first->getKey());
+  return result.first->getValue();
+}
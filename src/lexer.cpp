@@ -1,32 +1,311 @@
 #include "lexer.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <iostream>
+#include <thread>
+#include "llvm/Support/ErrorOr.h"
 #include "log.hpp"
+#include "scan.hpp"
+#include "spsc_queue.hpp"
+
+static std::unique_ptr<TokenStream> lexByGetline(std::istream &ifs, const std::string &input_filename);
+static std::unique_ptr<TokenStream> lexBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer);
+static TokenType keywordType(const char *str, size_t len);
+static TokenType singleSymbolType(char c);
 
 /**
  * トークン切り出し関数
- * @param 字句解析対象ファイル名
+ * @param 字句解析対象ファイル名（"-"なら標準入力）
+ * @param 入力の読み込み方法
+ * @return 切り出したトークンを格納したTokenStream
+ */
+std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename, LexerMode mode) {
+  if (mode == LEXER_GETLINE) {
+    if (input_filename == "-")
+      return lexByGetline(std::cin, "<stdin>");
+    std::ifstream ifs(input_filename.c_str(), std::ios::in);
+    if (!ifs)
+      return nullptr;
+    return lexByGetline(ifs, input_filename);
+  }
+
+  // ファイルサイズが大きければmmap、小さければread()で読み込まれる
+  auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(input_filename, -1, true);
+  if (!buffer)
+    return nullptr;
+  return LexicalAnalysis(std::move(*buffer), mode);
+}
+
+/**
+ * トークン切り出し関数（バッファ版）
+ * @param 字句解析対象バッファ（TokenStreamが所有する）
+ * @param 入力の読み込み方法（LEXER_GETLINEはLEXER_BUFFERとして扱う）
+ * @return 切り出したトークンを格納したTokenStream
+ */
+std::unique_ptr<TokenStream> LexicalAnalysis(std::unique_ptr<llvm::MemoryBuffer> buffer, LexerMode mode) {
+  if (mode == LEXER_STREAM || mode == LEXER_THREAD)
+    return llvm::make_unique<TokenStream>(std::move(buffer), mode == LEXER_THREAD);
+  return lexBuffer(std::move(buffer));
+}
+
+/**
+ * バッファ全体を走査し、全トークンと行頭位置を記録する
+ * @param 字句解析対象バッファ（TokenStreamが所有する）
+ * @return 切り出したトークンを格納したTokenStream
+ */
+static std::unique_ptr<TokenStream> lexBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer) {
+  std::unique_ptr<TokenStream> Tokens = llvm::make_unique<TokenStream>();
+  Tokens->setBuffer(std::move(buffer));
+  llvm::StringRef source = Tokens->getSource();
+  Lexer lexer(source, Tokens->getNames().get(), Tokens->getLineStarts());
+
+  // 1トークンあたり数バイトとして配列を確保しておく
+  Tokens->reserve(source.size() / 4);
+
+  TokenType type;
+  do {
+    uint32_t offset, length;
+    int value;
+    type = lexer.next(offset, length, value);
+    Tokens->pushToken(type, offset, length, value);
+  } while (type != TOK_EOF);
+
+  return Tokens;
+}
+
+/**
+ * 次のトークンを1つ切り出す
+ * バッファをポインタで走査し、行番号と桁位置は逐次計算する
+ * @param (出力) トークンのソース上の開始位置
+ * @param (出力) トークンの長さ
+ * @param (出力) 数字: 値, 識別子: SymbolID
+ * @return トークン種別。バッファの終わりではTOK_EOF
+ */
+TokenType Lexer::next(uint32_t &offset, uint32_t &length, int &value) {
+  while (Cur < End) {
+    const char *start = Cur;
+    char next_char = *Cur++;
+
+    if (next_char == '\n') {
+      newLine();
+      continue;
+    } else if (isspace((unsigned char)next_char)) {
+      Cur = Scan.blank(Cur, End);
+      continue;
+    }
+
+    TokenType type;
+    value = 0;
+    //IDENTIFIER
+    if (isalpha((unsigned char)next_char)) {
+      Cur = Scan.alnum(Cur, End);
+      type = keywordType(start, Cur - start);
+      if (type == TOK_IDENTIFIER && Names)
+        value = Names->intern(llvm::StringRef(start, Cur - start));
+    //数字
+    } else if (isdigit((unsigned char)next_char)) {
+      if (next_char != '0')
+        Cur = Scan.digit(Cur, End);
+      for (const char *p = start; p < Cur; p++)
+        value = value * 10 + (*p - '0');
+      type = TOK_DIGIT;
+    // コメント { コメント }
+    } else if (next_char == '{') {
+      while ((Cur = Scan.comment(Cur, End)) < End && *Cur == '\n') {
+        Cur++;
+        newLine();
+      }
+      if (Cur < End)
+        Cur++;    // eat '}'
+      continue;
+    //それ以外(記号)
+    } else {
+      switch (next_char) {
+      case ':':
+        if (Cur < End && *Cur == '=') {
+          Cur++;
+        } else {
+          error(Diagnostic(DIAG_EXPECTED, DIAG_ERROR, Cur - Base, DiagArg::text("="),
+                           Cur < End ? DiagArg::range(Cur - Base, 1) : DiagArg::text(" ")));
+        }
+        type = TOK_ASSIGN;
+        break;
+      case '<':
+        if (Cur < End && *Cur == '>') {
+          Cur++;
+          type = TOK_NE;
+        } else if (Cur < End && *Cur == '=') {
+          Cur++;
+          type = TOK_LE;
+        } else {
+          type = TOK_LT;
+        }
+        break;
+      case '>':
+        if (Cur < End && *Cur == '=') {
+          Cur++;
+          type = TOK_GE;
+        } else {
+          type = TOK_GT;
+        }
+        break;
+      default:
+        type = singleSymbolType(next_char);
+        //解析不能字句
+        if (type == TOK_EOF) {
+          error(Diagnostic(DIAG_UNEXPECTED, DIAG_ERROR, start - Base, DiagArg::range(start - Base, 1)));
+          continue;
+        }
+      }
+    }
+
+    offset = start - Base;
+    length = Cur - start;
+    return type;
+  }
+
+  //EOF: getline版と同じく最終行の次の行とする
+  if (Cur != LineHead)
+    newLine();
+  offset = Cur - Base;
+  length = 0;
+  value = 0;
+  return TOK_EOF;
+}
+
+/**
+ * 字句解析エラーを記録する
+ * 別スレッドで字句解析している場合はエラー一覧に追加するだけにする
+ * @param 診断
+ */
+void Lexer::error(const Diagnostic &diag) {
+  if (Errors)
+    Errors->push_back(diag);
+  else
+    Log::report(diag);
+}
+
+/**
+ * 識別子がキーワードであればその種別を返す
+ * 長さと先頭文字で候補を一つに絞ってから残りを比較する
+ * @param 識別子の先頭
+ * @param 識別子の長さ
+ * @return キーワードの種別、キーワードでなければTOK_IDENTIFIER
+ */
+static TokenType keywordType(const char *str, size_t len) {
+  const char *word;
+  TokenType type;
+
+  switch (len) {
+  case 2:
+    switch (str[0]) {
+    case 'd': word = "do"; type = TOK_DO; break;
+    case 'i': word = "if"; type = TOK_IF; break;
+    default: return TOK_IDENTIFIER;
+    }
+    break;
+  case 3:
+    switch (str[0]) {
+    case 'e': word = "end"; type = TOK_END; break;
+    case 'o': word = "odd"; type = TOK_ODD; break;
+    case 'v': word = "var"; type = TOK_VAR; break;
+    default: return TOK_IDENTIFIER;
+    }
+    break;
+  case 4:
+    word = "then"; type = TOK_THEN; break;
+  case 5:
+    switch (str[0]) {
+    case 'b': word = "begin"; type = TOK_BEGIN; break;
+    case 'c': word = "const"; type = TOK_CONST; break;
+    case 'w':
+      if (str[1] == 'h') {
+        word = "while"; type = TOK_WHILE;
+      } else {
+        word = "write"; type = TOK_WRITE;
+      }
+      break;
+    default: return TOK_IDENTIFIER;
+    }
+    break;
+  case 6:
+    word = "return"; type = TOK_RETURN; break;
+  case 7:
+    word = "writeln"; type = TOK_WRITELN; break;
+  case 8:
+    word = "function"; type = TOK_FUNCTION; break;
+  default:
+    return TOK_IDENTIFIER;
+  }
+  return memcmp(str, word, len) == 0 ? type : TOK_IDENTIFIER;
+}
+
+/**
+ * 1文字の記号の種別を返す
+ * @param 文字
+ * @return 記号の種別、記号でなければTOK_EOF
+ */
+static TokenType singleSymbolType(char c) {
+  switch (c) {
+  case '+': return TOK_PLUS;
+  case '-': return TOK_MINUS;
+  case '*': return TOK_MUL;
+  case '/': return TOK_DIV;
+  case '=': return TOK_EQ;
+  case ';': return TOK_SEMICOLON;
+  case ',': return TOK_COMMA;
+  case '.': return TOK_PERIOD;
+  case '(': return TOK_LPAREN;
+  case ')': return TOK_RPAREN;
+  case '<': return TOK_LT;
+  case '>': return TOK_GT;
+  default:  return TOK_EOF;
+  }
+}
+
+/**
+ * 記号・キーワードの綴りを返す
+ * @param トークン種別
+ * @return 綴り。識別子・数字・EOFは種別名
+ */
+const char *tokenSpelling(TokenType t) {
+  static const char *spellings[] = {
+    "ident", "number",
+    "+", "-", "*", "/", "=", "<>", "<", "<=", ">", ">=", ":=",
+    ";", ",", ".", "(", ")",
+    "const", "var", "function", "begin", "end", "if", "then",
+    "while", "do", "return", "write", "writeln", "odd",
+    "eof"
+  };
+  return spellings[t];
+}
+
+/**
+ * トークン切り出し関数（getline版）
+ * 1行ずつstd::stringに読み込んで走査する
+ * @param 入力ストリーム
+ * @param 字句解析対象ファイル名（バッファ名に使う）
  * @return 切り出したトークンを格納したTokenStream
  */
-std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
+static std::unique_ptr<TokenStream> lexByGetline(std::istream &ifs, const std::string &input_filename) {
   std::unique_ptr<TokenStream> Tokens = llvm::make_unique<TokenStream>();
-  std::ifstream ifs;
   std::string cur_line;
   std::string token_str;
+  std::string source;     // 読み込んだ行を連結したもの（トークンの位置の基準）
   int line_num = 1;
   bool iscomment = false;
-  Token *prev = nullptr;
-
-  ifs.open(input_filename.c_str(), std::ios::in);
-  if (!ifs)
-    return nullptr;
 
   while (ifs && getline(ifs, cur_line)) {
     char next_char;
-    std::string line;
-    Token next_token;
+    TokenType type;
     int index = 0;
     int length = cur_line.length();
     bool last_char = false;
+    uint32_t line_offset = source.size();
+
+    source += cur_line;
+    source += '\n';
 
     while(index < length) {
       next_char = cur_line.at(index++);
@@ -34,7 +313,7 @@ std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
 
       //コメントアウト読み飛ばし { コメント }
       if (iscomment) {
-        if (index < length  && next_char == '}')
+        if (next_char == '}')
           iscomment = false;
         continue;
       }
@@ -42,7 +321,7 @@ std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
       //EOF
       if (next_char == EOF) {
         token_str = EOF;
-        next_token = Token(TOK_EOF, token_str, line_num, index, prev);
+        type = TOK_EOF;
       } else if (isspace(next_char)){
         continue;
       //IDENTIFIER
@@ -61,39 +340,12 @@ std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
           if (!last_char)
             index--;
         }
-        if (token_str == "const")
-          next_token = Token(TOK_CONST, token_str, line_num, index, prev);
-        else if (token_str == "var")
-          next_token = Token(TOK_VAR, token_str, line_num, index, prev);
-        else if (token_str == "function")
-          next_token = Token(TOK_FUNCTION, token_str, line_num, index, prev);
-        else if (token_str == "begin")
-          next_token = Token(TOK_BEGIN, token_str, line_num, index, prev);
-        else if (token_str == "end")
-          next_token = Token(TOK_END, token_str, line_num, index, prev);
-        else if (token_str == "if")
-          next_token = Token(TOK_IF, token_str, line_num, index, prev);
-        else if (token_str == "then")
-          next_token = Token(TOK_THEN, token_str, line_num, index, prev);
-        else if (token_str == "while")
-          next_token = Token(TOK_WHILE, token_str, line_num, index, prev);
-        else if (token_str == "do")
-          next_token = Token(TOK_DO, token_str, line_num, index, prev);
-        else if (token_str == "return")
-          next_token = Token(TOK_RETURN, token_str, line_num, index, prev);
-        else if (token_str == "write")
-          next_token = Token(TOK_WRITE, token_str, line_num, index, prev);
-        else if (token_str == "writeln")
-          next_token = Token(TOK_WRITELN, token_str, line_num, index, prev);
-        else if (token_str == "odd")
-          next_token = Token(TOK_ODD, token_str, line_num, index, prev);
-        else
-          next_token = Token(TOK_IDENTIFIER, token_str, line_num, index, prev);
+        type = keywordType(token_str.data(), token_str.size());
       //数字
       } else if (isdigit(next_char)) {
         if (next_char=='0') {
           token_str += next_char;
-          next_token = Token(TOK_DIGIT, token_str, line_num, index, prev);
+          type = TOK_DIGIT;
         } else {
           token_str += next_char;
           if (index < length) {
@@ -109,12 +361,10 @@ std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
             if (!last_char)
               index--;
           }
-          next_token = Token(TOK_DIGIT, token_str, line_num, index, prev);
+          type = TOK_DIGIT;
         }
       // コメント { コメント }
       } else if (next_char == '{') {
-        token_str += next_char;
-        next_char = cur_line.at(index++);
         iscomment = true;
         continue;
       //それ以外(記号)
@@ -122,84 +372,275 @@ std::unique_ptr<TokenStream> LexicalAnalysis(std::string input_filename) {
         token_str += next_char;
         next_char = cur_line.at(index++);
         if (next_char != '=')
-          Log::unexpectedError("=", {next_char}, Tokens->getToken());
+          Log::report(Diagnostic(DIAG_EXPECTED, DIAG_ERROR, line_offset + index - 1, DiagArg::text("="),
+                                 DiagArg::range(line_offset + index - 1, 1)));
         token_str += next_char;
-        next_token = Token(TOK_SYMBOL, token_str, line_num, index, prev);
+        type = TOK_ASSIGN;
       } else if (next_char == '<') {
+        type = TOK_LT;
         token_str += next_char;
         next_char = cur_line.at(index++);
-        if (next_char == '>' || next_char == '=')
+        if (next_char == '>' || next_char == '=') {
           token_str += next_char;
-        else
+          type = next_char == '>' ? TOK_NE : TOK_LE;
+        } else
           index--;
-        next_token = Token(TOK_SYMBOL, token_str, line_num, index, prev);
       } else if (next_char == '>') {
+        type = TOK_GT;
         token_str += next_char;
         next_char = cur_line.at(index++);
-        if (next_char == '=')
+        if (next_char == '=') {
           token_str += next_char;
-        else
+          type = TOK_GE;
+        } else
           index--;
-        next_token = Token(TOK_SYMBOL, token_str, line_num, index, prev);
       } else {
-        if (next_char == '*' ||
-            next_char == '+' ||
-            next_char == '-' ||
-            next_char == '/' ||
-            next_char == '=' ||
-            next_char == ';' ||
-            next_char == ',' ||
-            next_char == '.' ||
-            next_char == '(' ||
-            next_char == ')') {
+        type = singleSymbolType(next_char);
+        if (type != TOK_EOF) {
           token_str += next_char;
-          next_token = Token(TOK_SYMBOL, token_str, line_num, index, prev);
         //解析不能字句
         } else {
-          Log::unexpectedError({next_char}, Tokens->getToken());
+          Log::report(Diagnostic(DIAG_UNEXPECTED, DIAG_ERROR, line_offset + index - 1,
+                                 DiagArg::range(line_offset + index - 1, 1)));
+          continue;
         }
       }
 
       //Tokensに追加
-      Tokens->pushToken(next_token);
-      prev = Tokens->getLastToken();
+      uint32_t offset = line_offset + index - token_str.size();
+      if (type == TOK_IDENTIFIER)
+        Tokens->pushIdentifier(offset, token_str);
+      else
+        Tokens->pushToken(type, offset, token_str.size(),
+                          type == TOK_DIGIT ? atoi(token_str.c_str()) : 0);
       token_str.clear();
     }
 
     token_str.clear();
     line_num++;
     last_char = false;
+    Tokens->addLineStart(source.size());
   }
 
 
   //EOFの確認
   if (ifs.eof()) {
-    Tokens->pushToken(
-        Token(TOK_EOF, token_str, line_num, -1, prev)
-        );
+    Tokens->pushToken(TOK_EOF, source.size(), 0);
   }
 
-  //クローズ
-  ifs.close();
+  Tokens->setBuffer(llvm::MemoryBuffer::getMemBufferCopy(source, input_filename));
   return Tokens;
 }
 
 
 
+/**
+  * 字句解析スレッド
+  * 切り出したトークンをロックフリーキューに入れ、TokenStreamが取り出す
+  *
+  * 識別子表はパーサ側のスレッドだけが触るように、識別子の登録は取り出し側で行う
+  * 字句解析エラーは直後のトークンの前にキューに入れ、取り出し側で診断エンジンに記録する
+  * （逐次版と同じ順序でエラーが記録される）
+  */
+class LexerThread {
+public:
+  struct Item {
+    TokenType Type;
+    uint32_t Offset;
+    uint32_t Length;
+    int Value;
+    bool IsError;          // trueならトークンではなくエラー
+    Diagnostic Error;
+  };
+
+private:
+  static const size_t QUEUESIZE = 4096;
+
+  std::atomic<bool> Stop;
+  SPSCQueue<Item, QUEUESIZE> Queue;
+  Lexer TheLexer;
+  std::thread Worker;
+
+public:
+  LexerThread(llvm::StringRef source)
+    : Stop(false), Queue(&Stop), TheLexer(source, nullptr) {
+    Worker = std::thread([this] { run(); });
+  }
+  ~LexerThread() {
+    Stop.store(true, std::memory_order_relaxed);
+    Worker.join();
+  }
+
+  bool pop(Item &item) { return Queue.pop(item); }
+
+private:
+  void run() {
+    std::vector<Diagnostic> errors;
+    TheLexer.deferErrors(&errors);
+    TokenType type;
+    do {
+      Item item;
+      type = TheLexer.next(item.Offset, item.Length, item.Value);
+      item.Type = type;
+      item.IsError = false;
+      for (auto &err : errors) {
+        Item error_item;
+        error_item.IsError = true;
+        error_item.Error = err;
+        if (!Queue.push(std::move(error_item)))
+          return;
+      }
+      errors.clear();
+      if (!Queue.push(std::move(item)))
+        return;
+    } while (type != TOK_EOF);
+    Queue.flush();
+  }
+};
+
+/**
+  * コンストラクタ
+  * トークンはpushToken()で全て格納する
+  * 診断の位置はこのTokenStreamで解決する
+  */
+TokenStream::TokenStream()
+  : LineStarts(1, 0), CurIndex(0), Filled(0), Names(std::make_shared<StringInterner>()),
+    CacheOffset(0), CacheLineHead(0), CacheLine(1) {
+  Log::setSource(this);
+}
+
+/**
+  * コンストラクタ（オンデマンド字句解析）
+  * トークンはgetNextToken()で必要になった時点で切り出す
+  * @param 字句解析対象バッファ
+  * @param trueなら別スレッドで字句解析を先行させる
+  */
+TokenStream::TokenStream(std::unique_ptr<llvm::MemoryBuffer> buffer, bool threaded)
+  : Buffer(std::move(buffer)), Kinds(RINGSIZE), Offsets(RINGSIZE), Lengths(RINGSIZE),
+    Values(RINGSIZE), CurIndex(0), Filled(0), Names(std::make_shared<StringInterner>()),
+    CacheOffset(0), CacheLineHead(0), CacheLine(1) {
+  Log::setSource(this);
+  if (threaded)
+    Pipeline = llvm::make_unique<LexerThread>(getSource());
+  else
+    OnDemand = llvm::make_unique<Lexer>(getSource(), Names.get());
+  fill();
+}
+
+/**
+  * コンストラクタ（インクリメンタル解析）
+  * バッファの途中からオンデマンドで切り出す。識別子は既存の識別子表に登録する
+  * @param 字句解析対象バッファ, 識別子表, 切り出しを始める位置（トークンの先頭）
+  */
+TokenStream::TokenStream(std::unique_ptr<llvm::MemoryBuffer> buffer, std::shared_ptr<StringInterner> names,
+                         uint32_t start)
+  : Buffer(std::move(buffer)), Kinds(RINGSIZE), Offsets(RINGSIZE), Lengths(RINGSIZE),
+    Values(RINGSIZE), CurIndex(0), Filled(0), Names(names),
+    CacheOffset(0), CacheLineHead(0), CacheLine(1) {
+  Log::setSource(this);
+  OnDemand = llvm::make_unique<Lexer>(getSource(), Names.get());
+  OnDemand->seek(start);
+  fill();
+}
+
 /**
   * デストラクタ
+  * このTokenStreamの位置を参照する診断は先に出力する
   */
 TokenStream::~TokenStream() {
-  Tokens.clear();
+  Log::releaseSource(this);
+}
+
+/**
+  * トークン格納用の配列をあらかじめ確保する
+  * @param 予想されるトークン数
+  */
+void TokenStream::reserve(size_t size) {
+  Kinds.reserve(size);
+  Offsets.reserve(size);
+  Lengths.reserve(size);
+  Values.reserve(size);
+}
+
+/**
+  * オンデマンド字句解析で次のトークンを1つ切り出してリングバッファに格納する
+  * @return 成功時：true　EOFを過ぎていれば：false
+  */
+bool TokenStream::fill() {
+  if (Filled > 0 && Kinds[slot(Filled - 1)] == TOK_EOF)
+    return false;
+  if (Pipeline) {
+    LexerThread::Item item;
+    while (true) {
+      if (!Pipeline->pop(item))
+        return false;
+      if (!item.IsError)
+        break;
+      Log::report(item.Error);
+    }
+    if (item.Type == TOK_IDENTIFIER)
+      return pushIdentifier(item.Offset, getSource().substr(item.Offset, item.Length));
+    return pushToken(item.Type, item.Offset, item.Length, item.Value);
+  }
+  uint32_t offset, length;
+  int value;
+  TokenType type = OnDemand->next(offset, length, value);
+  return pushToken(type, offset, length, value);
 }
 
+/**
+  * offsetを含む行の行番号と行頭位置を求める
+  * 行頭位置の表がなければ、前回の問い合わせ位置からソースを走査する
+  */
+void TokenStream::locate(uint32_t offset, int &line, uint32_t &line_head) const {
+  if (!isStreaming()) {
+    auto itr = std::upper_bound(LineStarts.begin(), LineStarts.end(), offset);
+    line = (int)(itr - LineStarts.begin());
+    line_head = LineStarts[line - 1];
+    return;
+  }
+  if (offset < CacheOffset) {
+    CacheOffset = CacheLineHead = 0;
+    CacheLine = 1;
+  }
+  const char *base = getSource().begin();
+  const char *p = base + CacheOffset;
+  const char *end = base + offset;
+  while ((p = (const char *)memchr(p, '\n', end - p)) != nullptr) {
+    p++;
+    CacheLine++;
+    CacheLineHead = p - base;
+  }
+  CacheOffset = offset;
+  line = CacheLine;
+  line_head = CacheLineHead;
+  // EOFは改行で終わらないソースでも最終行の次の行とする（Lexer::next と同じ）
+  if (offset == getSource().size() && offset != line_head) {
+    line++;
+    line_head = offset;
+  }
+}
 
 /**
-  * トークン取得
-  * @return CureIndex番目のToken
+  * ソース上の位置の行番号を求める
+  * @return 行番号（1始まり）
   */
-Token TokenStream::getToken() {
-  return Tokens[CurIndex];
+int TokenStream::getLine(uint32_t offset) const {
+  int line;
+  uint32_t line_head;
+  locate(offset, line, line_head);
+  return line;
+}
+
+/**
+  * ソース上の位置の桁位置を求める
+  * @return 桁位置（1始まり）
+  */
+int TokenStream::getColumn(uint32_t offset) const {
+  int line;
+  uint32_t line_head;
+  locate(offset, line, line_head);
+  return (int)(offset - line_head) + 1;
 }
 
 /**
@@ -207,8 +648,9 @@ Token TokenStream::getToken() {
   * @return 成功時：true　失敗時：false
   */
 bool TokenStream::getNextToken(){
-  //fprintf(stderr, "eat %s\n", Tokens[CurIndex]->getTokenString().c_str());
-  int size = Tokens.size();
+  if (isStreaming() && CurIndex + 1 == Filled && !fill())
+    return false;
+  int size = Filled;
   if(--size == CurIndex){
     return false;
   } else if (CurIndex < size) {
@@ -224,8 +666,8 @@ bool TokenStream::getNextToken(){
   * 格納されたトークン一覧を表示する
   */
 bool TokenStream::printTokens() {
-  for(size_t i = 0; i < Tokens.size(); i++) {
-    Log::token(Tokens[i]);
-  }
+  do {
+    Log::token(getToken());
+  } while (getNextToken());
   return true;
 }
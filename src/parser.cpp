@@ -6,30 +6,55 @@
 
 /**
   * コンストラクタ
+  * @param ソースファイル名（"-"なら標準入力）
   */
-Parser::Parser(std::string filename, bool debug = true) {
-  Tokens = LexicalAnalysis(filename);
+Parser::Parser(std::string filename, bool debug = true, LexerMode mode) {
+  Tokens = LexicalAnalysis(filename, mode);
+  if (Tokens) {
+    Names = Tokens->getNames();
+    Context = llvm::make_unique<ASTContext>(Tokens->getSource().size());
+  }
+  Debug = debug;
+}
+
+/**
+  * コンストラクタ（メモリ上のソース）
+  * @param ソースを格納したバッファ
+  */
+Parser::Parser(std::unique_ptr<llvm::MemoryBuffer> buffer, bool debug, LexerMode mode) {
+  Tokens = LexicalAnalysis(std::move(buffer), mode);
+  if (Tokens) {
+    Names = Tokens->getNames();
+    Context = llvm::make_unique<ASTContext>(Tokens->getSource().size());
+  }
   Debug = debug;
 }
 
+/**
+  * コンストラクタ（インクリメンタル解析）
+  * 途中から切り出すTokenStreamと、ノードを追加するASTContextを受け取る
+  * @param TokenStream, ASTContext
+  */
+Parser::Parser(std::unique_ptr<TokenStream> tokens, std::unique_ptr<ASTContext> context, bool debug)
+  : Debug(debug), Tokens(std::move(tokens)), Context(std::move(context)) {
+  Names = Tokens->getNames();
+}
+
 /**
   * 構文解析実効
   * @return 解析成功：true　解析失敗：false
   */
 bool Parser::parse() {
-  std::stringstream ss;
   if (!Tokens) {
     Log::error("error at lexer: could not make Tokens");
+    Log::flush();
     return false;
   }
   bool result = parseProgram();
   int num = Log::getErrorNum();
-  if (num >= 1) {
-    ss << num << " error";
-    if (num > 1)
-      ss << "s";
-    Log::error(ss.str());
-  }
+  if (num >= 1)
+    Log::errorCount(num);
+  Log::flush();
 
   return result && (num < MINERROR);
 }
@@ -52,23 +77,26 @@ bool Parser::parseProgram() {
 
   // block
   sym_table.blockIn();
-  std::unique_ptr<BlockAST> Block = parseBlock();
-  if (!Block || Block->empty()) {
-    Log::error("error at parseBlock", false);
+  BlockAST Block = parseBlock();
+  // どこにも宣言されていない名前の参照には、名前だけの宣言を割り当てる
+  for (auto &ref : sym_table.getReferences())
+    Context->resolve(ref.second, Context->addDecl(ref.first));
+  if (!Block || Block.empty()) {
+    Log::error("error at parseBlock");
     result = false;
   } else {
-    TheProgramAST =  llvm::make_unique<ProgramAST>(std::move(Block));
+    TheProgramAST =  llvm::make_unique<ProgramAST>(std::move(Context), Block, Names);
   }
 
   // eat '.'
-  if(!Tokens->isSymbol(".")) {
+  if(!Tokens->isType(TOK_PERIOD)) {
     Log::error("program done without '.': insert", Tokens->getToken());
   }
 
   // 未定義の定数、変数、関数にアクセス
   if (sym_table.remainedTemp()) {
-    Log::error("remain undefined symbols", false);
-    sym_table.dumpTempNames();
+    Log::error("remain undefined symbols");
+    sym_table.dumpTempNames(*Names);
     result = false;
   }
 
@@ -82,41 +110,42 @@ bool Parser::parseProgram() {
   * @param TheProgramAST
   * @return true: 成功 false: 失敗
   */
-std::unique_ptr<BlockAST> Parser::parseBlock() {
-  auto Block = llvm::make_unique<BlockAST>();
+BlockAST Parser::parseBlock() {
+  // 宣言は何回に分けて書いてもよいので、まとめてからASTにする
+  llvm::SmallVector<std::pair<uint32_t, int>, 8> constants;
+  llvm::SmallVector<uint32_t, 8> variables;
+  llvm::SmallVector<FuncDeclAST, 8> functions;
+  bool has_const = false, has_var = false;
   while (true) {
-    // std::moveするとuniq_ptrはnullになってしまうので
-    // 別にフラグが必要
-    //bool c = false, v = false, f = false;
     if (Tokens->getCurType() == TOK_CONST) {
       Tokens->getNextToken(); // eat 'const'
-      auto const_decl = parseConst();
-      if (const_decl)
-        Block->setConstant(std::move(const_decl));
+      parseConst(constants);
+      has_const = true;
     } else if (Tokens->getCurType() == TOK_VAR) {
       Tokens->getNextToken(); // eat 'var'
-      auto var_decl = parseVar();
-      if (var_decl)
-        Block->setVariable(std::move(var_decl));
+      parseVar(variables);
+      has_var = true;
     } else if (Tokens->getCurType() == TOK_FUNCTION) {
       Tokens->getNextToken(); // eat 'function'
       auto func_decl = parseFunction();
       if (func_decl)
-        Block->addFunction(std::move(func_decl));
+        functions.push_back(func_decl);
     } else {
       break;
     }
   }
+  BlockAST Block;
   auto statement = parseStatement();
   if (statement) {
-    Block->setStatement(std::move(statement));
+    auto const_decl = has_const ? Context->create<ConstDeclAST>(llvm::makeArrayRef(constants)) : ConstDeclAST();
+    auto var_decl = has_var ? Context->create<VarDeclAST>(llvm::makeArrayRef(variables)) : VarDeclAST();
+    Block = Context->create<BlockAST>(const_decl, var_decl, llvm::makeArrayRef(functions), statement);
   } else {
-    Log::error("No statement", false);
-    Block = nullptr;
+    Log::error("No statement");
   }
 
-  // ブロック階層を下げる
-  sym_table.blockOut();
+  // ブロック階層を下げる（ブロック内の参照をここで宣言に結びつける）
+  sym_table.blockOut([&](uint32_t node, uint32_t decl) { Context->resolve(node, decl); });
   return Block;
 }
 
@@ -124,20 +153,21 @@ std::unique_ptr<BlockAST> Parser::parseBlock() {
 // constDecl: 'const', ident, '=', number, { ',' , ident, '=', number }, ';'
 /**
   * ConstDect用構文解析メソッド
-  * @return 成功: std::unique_ptr<ConstDeclAST>, 失敗: nullptr
+  * @param 定義した定数（宣言, 値）を追加する表
   */
-std::unique_ptr<ConstDeclAST> Parser::parseConst() {
-  std::string name;
-
-  auto ConstAST = llvm::make_unique<ConstDeclAST>();
+void Parser::parseConst(llvm::SmallVectorImpl<std::pair<uint32_t, int>> &table) {
+  SymbolID name;
+  uint32_t decl;
 
   while(true) {
     if (Tokens->getCurType() != TOK_IDENTIFIER) {
       Log::error("missing const name", Tokens->getToken());
     } else {
-      name = Tokens->getCurString();
+      name = Tokens->getCurSymbol();
+      decl = Context->addDecl(name);
       Tokens->getNextToken();   // eat ident
-      checkGet("=");
+      checkGet(TOK_EQ);
+      bool added = false;
       if (sym_table.findSymbol(name, CONST))
         Log::duplicateError("constant", name, Tokens->getToken());
       else {
@@ -145,15 +175,18 @@ std::unique_ptr<ConstDeclAST> Parser::parseConst() {
           sym_table.deleteTemp(name);
           Log::deleteWarn(name, Tokens->getToken());
         }
-        sym_table.addSymbol(name, CONST);
+        sym_table.addSymbol(name, CONST, decl);
+        added = true;
       }
-      if (Tokens->getCurType() == TOK_DIGIT)
-        ConstAST->addConstant(name, Tokens->getCurNumVal());
-      else
+      if (Tokens->getCurType() == TOK_DIGIT) {
+        table.emplace_back(decl, Tokens->getCurNumVal());
+      } else {
         Log::error("assigned not number", Tokens->getToken());
+        Unlisted = Unlisted || added;
+      }
       Tokens->getNextToken(); // eat number
     }
-    if (!Tokens->isSymbol(",")) {
+    if (!Tokens->isType(TOK_COMMA)) {
       if (Tokens->getCurType() == TOK_IDENTIFIER) {
         Log::missingError(",", Tokens->getToken());
         continue;
@@ -163,26 +196,22 @@ std::unique_ptr<ConstDeclAST> Parser::parseConst() {
     }
     Tokens->getNextToken(); // eat ','
   }
-  checkGet(";");
-
-  return ConstAST;
+  checkGet(TOK_SEMICOLON);
 }
 
 // varDecl: 'var', ident, { ',', ident }, ';'
 /**
   * VarDecl用構文解析メソッド
-  * @return 成功: std::unique_ptr<VarDeclAST>, 失敗: nullptr
+  * @param 定義した変数の宣言を追加する表
   */
-std::unique_ptr<VarDeclAST> Parser::parseVar() {
-  std::string name;
-
-  auto VarAST = llvm::make_unique<VarDeclAST>();
+void Parser::parseVar(llvm::SmallVectorImpl<uint32_t> &table) {
+  SymbolID name;
 
   while(true) {
     if (Tokens->getCurType() != TOK_IDENTIFIER) {
       Log::error("missing var name", Tokens->getToken());
     } else {
-      name = Tokens->getCurString();
+      name = Tokens->getCurSymbol();
       if (sym_table.findSymbol(name, VAR)) {
         Log::duplicateError("var", name, Tokens->getToken());
       } else {
@@ -190,12 +219,13 @@ std::unique_ptr<VarDeclAST> Parser::parseVar() {
           sym_table.deleteTemp(name);
           Log::deleteWarn(name, Tokens->getToken());
         }
-        sym_table.addSymbol(name, VAR);
-        VarAST->addVariable(name);
+        uint32_t decl = Context->addDecl(name);
+        sym_table.addSymbol(name, VAR, decl);
+        table.push_back(decl);
       }
       Tokens->getNextToken();   // eat ident
     }
-    if (!Tokens->isSymbol(",")) {
+    if (!Tokens->isType(TOK_COMMA)) {
       if (Tokens->getCurType() == TOK_IDENTIFIER) {
         Log::missingError(",", Tokens->getToken());
         continue;
@@ -205,34 +235,32 @@ std::unique_ptr<VarDeclAST> Parser::parseVar() {
     }
     Tokens->getNextToken(); // eat ','
   }
-  checkGet(";");
-
-  return VarAST;
+  checkGet(TOK_SEMICOLON);
 }
 
 // funcDecl: ''function', ident, '(', [ ident, { ',', ident } ], ')', block, ';'
 /**
   * FuncDecl用構文解析メソッド
-  * @return 成功: std::unique_ptr<FuncDeclAST>, 失敗: nullptr
+  * @return 成功: FuncDeclAST, 失敗: nullptr
   */
-std::unique_ptr<FuncDeclAST> Parser::parseFunction() {
-  std::string name, param;
-  std::vector<std::string> parameters;
+FuncDeclAST Parser::parseFunction() {
+  SymbolID name, param;
+  llvm::SmallVector<SymbolID, 8> parameters;
 
   if (Tokens->getCurType() != TOK_IDENTIFIER) {
     Log::error("missing function name", Tokens->getToken());
     return nullptr;
   }
 
-  name = Tokens->getCurString();
+  name = Tokens->getCurSymbol();
   auto temp = Tokens->getToken();
   Tokens->getNextToken(); // eat ident
-  checkGet("(");
+  checkGet(TOK_LPAREN);
   while(true){
     if (Tokens->getCurType() == TOK_IDENTIFIER) {
-      param = Tokens->getCurString();
+      param = Tokens->getCurSymbol();
       if (sym_table.findSymbol(param, PARAM)) {
-          Log::duplicateError("param", param.c_str(), Tokens->getToken());
+          Log::duplicateError("param", param, Tokens->getToken());
       } else {
           parameters.push_back(param);
       }
@@ -240,7 +268,7 @@ std::unique_ptr<FuncDeclAST> Parser::parseFunction() {
     } else {
       break; // 最初に識別子が来なければparamtersは終了
     }
-    if (!Tokens->isSymbol(",")) {
+    if (!Tokens->isType(TOK_COMMA)) {
       if (Tokens->getCurType() == TOK_IDENTIFIER) {
         Log::missingError(",", Tokens->getToken());
         continue;
@@ -250,52 +278,123 @@ std::unique_ptr<FuncDeclAST> Parser::parseFunction() {
     }
     Tokens->getNextToken(); // eat ','
   }
-  checkGet(")");
-  if (Tokens->isSymbol(";")) {
-    Log::unexpectedError(";", Tokens->getToken());
+  checkGet(TOK_RPAREN);
+  if (Tokens->isType(TOK_SEMICOLON)) {
+    Log::unexpectedError(Tokens->getToken());
     Tokens->getNextToken(); // eat ';'
   }
   // check duplication of function
   if (sym_table.findSymbol(name, FUNC, true, parameters.size())) {
-    Log::duplicateError("func", name.c_str(), temp);
+    Log::duplicateError("func", name, temp);
     return nullptr;
   }
-  sym_table.addSymbol(name, FUNC, parameters.size());
+  uint32_t decl = Context->addDecl(name);
+  sym_table.addSymbol(name, FUNC, decl, parameters.size());
   // ここからブロックレベルを上げる
   sym_table.blockIn();
-  for (auto param : parameters)
-    sym_table.addSymbol(param, PARAM);
+  llvm::SmallVector<uint32_t, 8> param_decls;
+  for (auto param : parameters) {
+    param_decls.push_back(Context->addDecl(param));
+    sym_table.addSymbol(param, PARAM, param_decls.back());
+  }
 
+  int record = -1, parent = CurRecord;
+  if (Records) {
+    record = beginRecord(decl, name, parameters.size());
+    CurRecord = record;
+  }
   auto block = parseBlock();
+  if (Records) {
+    endRecord(record);
+    CurRecord = parent;
+  }
   if (!block) {
     Log::error("error in function block");
     return nullptr;
   }
-  checkGet(";");
-  return llvm::make_unique<FuncDeclAST>(name, parameters, std::move(block));
+  checkGet(TOK_SEMICOLON);
+  auto func = Context->create<FuncDeclAST>(decl, llvm::makeArrayRef(param_decls), block);
+  if (Records)
+    (*Records)[record].Node = func.getIndex();
+  return func;
+}
+
+/**
+  * 関数のブロックを読み始める前に、関数定義の記録を追加する
+  * @param 関数名の宣言, 関数名, 引数の数
+  * @return 記録の番号
+  */
+int Parser::beginRecord(uint32_t decl, SymbolID name, int num) {
+  FuncRecord record;
+  Token first = Tokens->getToken();
+  record.Decl = decl;
+  record.Name = name;
+  record.NumParams = num;
+  record.Node = ASTContext::NOIDX;
+  record.Parent = CurRecord;
+  record.Prev = first.prev().offset();
+  record.First = first.offset();
+  record.FirstEnd = first.offset() + first.length();
+  record.DiagBegin = Log::engine().getReportNum();
+  record.Clean = !sym_table.remainedTemp();
+  Records->push_back(record);
+  return (int)Records->size() - 1;
+}
+
+/**
+  * 関数のブロックを読み終えたら、ブロックの終わりを記録する
+  */
+void Parser::endRecord(int index) {
+  FuncRecord &record = (*Records)[index];
+  Token end = Tokens->getToken();
+  record.Last = end.prev().offset();
+  record.End = end.offset();
+  record.EndType = end.getTokenType();
+  record.DiagEnd = Log::engine().getReportNum();
+  record.Clean = record.Clean && !sym_table.remainedTemp();
 }
 
 // statment
 /**
   * Statement用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * begin/if/whileの入れ子は再帰せず、StmtStackに積んで解析する
+  * @return 成功: BaseStmtAST, 失敗: nullptr
   */
-std::unique_ptr<BaseStmtAST> Parser::parseStatement() {
-  std::unique_ptr<BaseStmtAST> statement;
+BaseStmtAST Parser::parseStatement() {
+  size_t base = StmtStack.size();
+  BaseStmtAST statement;
+
+  while (true) {
+    if (!beginStatement(statement))
+      continue;   // 複合文の中の文を読む
+    // 完成した文を、それを待っている複合文に渡す
+    while (StmtStack.size() > base && finishStatement(statement))
+      ;
+    if (StmtStack.size() == base)
+      return statement;
+  }
+}
+
+/**
+  * 文を読み始める
+  * 単純な文はそのまま解析し、複合文は StmtStack に積んで中の文を待つ
+  * @param 解析した文（失敗なら nullptr）
+  * @return 文が完成した: true, 複合文の中の文を待つ: false
+  */
+bool Parser::beginStatement(BaseStmtAST &statement) {
+  statement = nullptr;
 
   switch (Tokens->getCurType()) {
     case TOK_IDENTIFIER:
       statement = parseAssign();
       break;
     case TOK_BEGIN:
-      statement = parseBeginEnd();
-      break;
+      parseBeginEnd();
+      return false;
     case TOK_IF:
-      statement = parseIfThen();
-      break;
+      return parseIfThen();
     case TOK_WHILE:
-      statement = parseWhileDo();
-      break;
+      return parseWhileDo();
     case TOK_RETURN:
       statement = parseReturn();
       break;
@@ -303,33 +402,91 @@ std::unique_ptr<BaseStmtAST> Parser::parseStatement() {
       statement = parseWrite();
       break;
     case TOK_WRITELN:
-      statement = llvm::make_unique<WritelnAST>();
+      statement = Context->create<WritelnAST>();
       Tokens->getNextToken();   // eat 'writeln'
       break;
     default:
-      if (Tokens->isSymbol(".") || Tokens->getCurType() == TOK_END) {
-        statement = llvm::make_unique<NullAST>();
-      } else if (Tokens->isSymbol(";")) {
-        statement = llvm::make_unique<NullAST>();
+      if (Tokens->isType(TOK_PERIOD) || Tokens->getCurType() == TOK_END) {
+        statement = Context->create<NullAST>();
+      } else if (Tokens->isType(TOK_SEMICOLON)) {
+        statement = Context->create<NullAST>();
         Tokens->getNextToken();
       } else {
-        Log::skipError(Tokens->getCurString().c_str(), Tokens->getToken());
+        Log::skipError(Tokens->getToken());
         Tokens->getNextToken();
       }
   }
 
-  return statement;
+  return true;
+}
+
+/**
+  * 中の文を読み終えた複合文を進める
+  * @param 中の文（失敗なら nullptr）。複合文が完成したらその文に置き換える
+  * @return 複合文が完成した（または失敗した）: true, 次の文を待つ: false
+  */
+bool Parser::finishStatement(BaseStmtAST &statement) {
+  StmtFrame frame = StmtStack.back();
+
+  switch (frame.Kind) {
+  case IfThenID:
+    StmtStack.pop_back();
+    if (!statement)
+      Log::error("Couldn't get statement of if then", frame.Temp);
+    else
+      statement = Context->create<IfThenAST>(frame.Condition, statement);
+    return true;
+  case WhileDoID:
+    StmtStack.pop_back();
+    if (!statement)
+      Log::error("Couldn't get statement of while do", frame.Temp);
+    else
+      statement = Context->create<WhileDoAST>(frame.Condition, statement);
+    return true;
+  default:
+    break;
+  }
+
+  // begin statement { ';' statement } 'end'
+  if (statement) {
+    StmtList.push_back(statement);
+    while(true) {
+      if (Tokens->isType(TOK_SEMICOLON)) {
+        Tokens->getNextToken(); // eat ';'
+        return false;
+      }
+      if (Tokens->getCurType() == TOK_END) {
+        Tokens->getNextToken(); // eat ';'
+        statement = Context->create<BeginEndAST>(llvm::makeArrayRef(StmtList).drop_front(frame.Begin));
+        break;
+      }
+      if (isStmtBeginKey(Tokens->getCurType())) {
+        Log::missingError("';'", Tokens->getToken(), true);
+        return false;
+      }
+      if (Tokens->isType(TOK_EOF)) {
+        Log::missingError("end", Tokens->getToken(), true);
+        statement = nullptr;
+        break;
+      }
+      Log::skipError(Tokens->getToken());
+      Tokens->getNextToken();
+    }
+  }
+  StmtList.resize(frame.Begin);
+  StmtStack.pop_back();
+  return true;
 }
 
 // ident ':=' expression
 /**
   * FuncDecl用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * @return 成功: BaseStmtAST, 失敗: nullptr
   */
-std::unique_ptr<BaseStmtAST> Parser::parseAssign() {
-  std::string name;
+BaseStmtAST Parser::parseAssign() {
+  SymbolID name;
 
-  name = Tokens->getCurString();
+  name = Tokens->getCurSymbol();
   if (sym_table.findSymbol(name, FUNC, false, -1)) {
     Log::error("assign lhs is not var/par", Tokens->getToken());
   } else if (!sym_table.findSymbol(name, VAR) && !sym_table.findSymbol(name, PARAM)) {
@@ -338,368 +495,389 @@ std::unique_ptr<BaseStmtAST> Parser::parseAssign() {
   }
 
   Tokens->getNextToken(); // eat ident
-  checkGet(":=");
-  auto rhs = parseExpression(nullptr);
+  checkGet(TOK_ASSIGN);
+  auto rhs = parseExpression();
   if (!rhs) {
     Log::error("Couldn't get rhs-expr of assignment", Tokens->getToken());
     return nullptr;
   }
 
-  return llvm::make_unique<AssignAST>(name, std::move(rhs));
+  auto assign = Context->create<AssignAST>(rhs);
+  sym_table.addReference(name, assign.getIndex());
+  return assign;
 }
 
 // 'begin' statement { ';' statement } 'end'
 /**
   * BeginEnd用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * 'begin' を読み、中の文を待つ（文の並びは finishStatement で読む）
   */
-std::unique_ptr<BaseStmtAST> Parser::parseBeginEnd() {
-  std::unique_ptr<BaseStmtAST> statement;
-  std::vector<std::unique_ptr<BaseStmtAST>> statements;
-
+void Parser::parseBeginEnd() {
   Tokens->getNextToken(); // eat 'begin'
-  while(true) {
-    statement = parseStatement();
-    if (!statement) {
-      return nullptr;
-    }
-    statements.push_back(std::move(statement));
-    while(true) {
-      if (Tokens->isSymbol(";")) {
-        Tokens->getNextToken(); // eat ';'
-        break;
-      }
-      if (Tokens->getCurType() == TOK_END) {
-        Tokens->getNextToken(); // eat ';'
-        return llvm::make_unique<BeginEndAST>(std::move(statements));
-      }
-      if (isStmtBeginKey(Tokens->getCurString())) {
-        Log::missingError("';'", Tokens->getToken(), true);
-        break;
-      }
-      Log::skipError(Tokens->getCurString(), Tokens->getToken());
-      Tokens->getNextToken();
-    }
-  }
+  StmtStack.push_back(StmtFrame(BeginEndID, nullptr, StmtList.size(), Tokens->getToken()));
 }
 
 // 'if' condition 'then' statement
 /**
-  * BeginEnd用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * IfThen用構文解析メソッド
+  * 条件を読み、中の文を待つ
+  * @return 失敗: true（文は nullptr）, 中の文を待つ: false
   */
-std::unique_ptr<BaseStmtAST> Parser::parseIfThen() {
+bool Parser::parseIfThen() {
   Tokens->getNextToken(); // eat 'if'
   auto temp = Tokens->getToken();
   auto condition = parseCondition();
   if (!condition) {
     Log::error("Couldn't get condition of if condition", temp);
-    return nullptr;
-  }
-  checkGet("then");
-  auto temp2 = Tokens->getToken();
-  auto statement = parseStatement();
-  if (!statement) {
-    Log::error("Couldn't get statement of if then", temp2);
-    return nullptr;
+    return true;
   }
-  return llvm::make_unique<IfThenAST>(std::move(condition), std::move(statement));
+  checkGet(TOK_THEN);
+  StmtStack.push_back(StmtFrame(IfThenID, condition, 0, Tokens->getToken()));
+  return false;
 }
 
 // 'while' condition 'do' statment
 /**
   * WhileDo用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * 条件を読み、中の文を待つ
+  * @return 失敗: true（文は nullptr）, 中の文を待つ: false
   */
-std::unique_ptr<BaseStmtAST> Parser::parseWhileDo() {
+bool Parser::parseWhileDo() {
   Tokens->getNextToken(); // eat 'while'
   auto temp = Tokens->getToken();
   auto condition = parseCondition();
   if (!condition) {
     Log::error("Couldn't get condition of while condition", temp);
-    return nullptr;
-  }
-  checkGet("do");
-  auto temp2 = Tokens->getToken();
-  auto statement = parseStatement();
-  if (!statement) {
-    Log::error("Couldn't get statement of while do", temp2);
-    return nullptr;
+    return true;
   }
-  return llvm::make_unique<WhileDoAST>(std::move(condition), std::move(statement));
+  checkGet(TOK_DO);
+  StmtStack.push_back(StmtFrame(WhileDoID, condition, 0, Tokens->getToken()));
+  return false;
 }
 
 // 'return' expression
 /**
   * Return用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * @return 成功: BaseStmtAST, 失敗: nullptr
   */
-std::unique_ptr<BaseStmtAST> Parser::parseReturn() {
+BaseStmtAST Parser::parseReturn() {
   Tokens->getNextToken(); // eat 'return'
   auto temp = Tokens->getToken();
-  auto expression = parseExpression(nullptr);
+  auto expression = parseExpression();
   if (!expression) {
     Log::error("Couldn't get expr of return", temp);
     return nullptr;
   }
-  return llvm::make_unique<ReturnAST>(std::move(expression));
+  return Context->create<ReturnAST>(expression);
 }
 
 // 'write' expression
 /**
   * Write用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseStmtAST>, 失敗: nullptr
+  * @return 成功: BaseStmtAST, 失敗: nullptr
   */
-std::unique_ptr<BaseStmtAST> Parser::parseWrite() {
+BaseStmtAST Parser::parseWrite() {
   Tokens->getNextToken(); // eat 'write'
   auto temp = Tokens->getToken();
-  auto expression = parseExpression(nullptr);
+  auto expression = parseExpression();
   if (!expression) {
     Log::error("Couldn't get expr of write", temp);
     return nullptr;
   }
-  return llvm::make_unique<WriteAST>(std::move(expression));
+  return Context->create<WriteAST>(expression);
 }
 
 // condition: 'odd' expression | expression () expression
 /**
   * Write用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseExpAST>, 失敗: nullptr
+  * @return 成功: BaseExpAST, 失敗: nullptr
   */
-std::unique_ptr<BaseExpAST> Parser::parseCondition() {
+BaseExpAST Parser::parseCondition() {
   if (Tokens->getCurType() == TOK_ODD) {
     Tokens->getNextToken(); // eat 'odd'
     auto temp = Tokens->getToken();
-    auto rhs = parseExpression(nullptr);
+    auto rhs = parseExpression();
     if (!rhs) {
       Log::error("Couldn't get odd expr of condition", temp);
       return nullptr;
     }
-    return llvm::make_unique<CondExpAST>("odd", nullptr, std::move(rhs));
+    return Context->create<CondExpAST>(OP_ODD, nullptr, rhs);
   }
 
   auto temp2 = Tokens->getToken();
-  auto lhs = parseExpression(nullptr);
+  auto lhs = parseExpression();
   if (!lhs) {
     Log::error("Couldn't get lhs expr of condition", temp2);
     return nullptr;
   }
-  std::string op = Tokens->getCurString();
-  if (!(op == "=" || op == "<>" || op == "<" ||
-        op == ">" || op == "<=" || op == ">=")) {
-    Log::unexpectedError(Tokens->getCurString().c_str(), Tokens->getToken());
+  OpID op;
+  switch (Tokens->getCurType()) {
+  case TOK_EQ: op = OP_EQ; break;
+  case TOK_NE: op = OP_NE; break;
+  case TOK_LT: op = OP_LT; break;
+  case TOK_LE: op = OP_LE; break;
+  case TOK_GT: op = OP_GT; break;
+  case TOK_GE: op = OP_GE; break;
+  default:
+    Log::unexpectedError(Tokens->getToken());
     return nullptr;
   }
   Tokens->getNextToken(); // eat Symbol
   auto temp3 = Tokens->getToken();
-  auto rhs = parseExpression(nullptr);
+  auto rhs = parseExpression();
   if (!rhs) {
     Log::error("Couldn't get lhs expr of condition", temp3);
     return nullptr;
   }
 
-  return llvm::make_unique<CondExpAST>(op, std::move(lhs), std::move(rhs));
+  return Context->create<CondExpAST>(op, lhs, rhs);
 }
 
 // expression: [ ( '+' | '-' ) ] term { ('+' | '-') term }
+// term: factor, { ('*' | '/' ), factor }
+// factor: ident | number | '(' expression ')' |
+//         ident '(' [ expression, { ',' expression } ]
 /**
   * Expression用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseExpAST>, 失敗: nullptr
+  * expression, term, factor は再帰せず、解析途中の状態を ExpStack に積んで解析する
+  * （括弧や引数の中の式は新しい状態を積む）
+  * @return 成功: BaseExpAST, 失敗: nullptr
   */
-std::unique_ptr<BaseExpAST> Parser::parseExpression(std::unique_ptr<BaseExpAST> lhs) {
-  std::string prefix = "";
-  std::string op;
-
-  if (Tokens->isSymbol("+") || Tokens->isSymbol("-")) {
-    prefix = Tokens->getCurString();
-    Tokens->getNextToken();  // eat prefix
-  }
+BaseExpAST Parser::parseExpression() {
+  size_t base = ExpStack.size();
+  BaseExpAST value;
+  ExpStep step = START_EXP;
 
-  auto temp = Tokens->getToken();
-  if (!lhs)
-    lhs = parseTerm(nullptr);
-  if (!lhs) {
-    Log::error("Couldn't get lhs expr of expression", temp);
-    return nullptr;
-  }
-
-  if (Tokens->isSymbol("+") || Tokens->isSymbol("-")) {
-    op = Tokens->getCurString();
-    Tokens->getNextToken(); // eat '+' of '-'
-    auto temp2 = Tokens->getToken();
-    auto rhs = parseTerm(nullptr);
-    if (rhs) {
-      return parseExpression(llvm::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs), prefix));
-    } else {
-      Log::error("Couldn't get rhs expr of expression", temp2);
-      return nullptr;
+  while (true) {
+    switch (step) {
+    case START_EXP:
+      step = startExpression();
+      break;
+    case START_TERM:
+      ExpStack.push_back(ExpFrame(TERM_LHS, Tokens->getToken()));
+      step = START_FACTOR;
+      break;
+    case START_FACTOR:
+      step = parseFactor(value);
+      break;
+    case RETURN_EXP:
+      if (ExpStack.size() == base)
+        return value;
+      step = resumeExpression(value);
+      break;
     }
   }
-
-  return lhs;
 }
 
-// term: factor, { ('*' | '/' ), factor }
 /**
-  * Term用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseExpAST>, 失敗: nullptr
+  * expressionを読み始める（符号を読み、最初の項を待つ）
   */
-std::unique_ptr<BaseExpAST> Parser::parseTerm(std::unique_ptr<BaseExpAST> lhs) {
-  std::string op;
+Parser::ExpStep Parser::startExpression() {
+  OpID prefix = OP_NONE;
 
-  auto temp = Tokens->getToken();
-  if (!lhs)
-    lhs = parseFactor();
-  if (!lhs) {
-    Log::error("Couldn't get lhs expr of term", temp);
-    return nullptr;
+  // 符号は式の先頭でだけ読む
+  if (Tokens->isType(TOK_PLUS) || Tokens->isType(TOK_MINUS)) {
+    prefix = Tokens->isType(TOK_PLUS) ? OP_ADD : OP_SUB;
+    Tokens->getNextToken();  // eat prefix
   }
+  ExpStack.push_back(ExpFrame(EXP_LHS, Tokens->getToken()));
+  ExpStack.back().Prefix = prefix;
+  return START_TERM;
+}
 
-  if (Tokens->isSymbol("*") || Tokens->isSymbol("/")) {
-    op = Tokens->getCurString();
-    Tokens->getNextToken(); // eat '*' or '/'
-    auto temp2 = Tokens->getToken();
-    auto rhs = parseFactor();
-    if (rhs) {
-      return parseTerm(llvm::make_unique<BinaryExprAST>(op, std::move(lhs), std::move(rhs)));
+/**
+  * 項・因子・式を読み終えた状態を進める
+  * @param 読み終えた項・因子・式（失敗なら nullptr）。状態が完了したらその結果に置き換える
+  * @return 次に行うこと
+  */
+Parser::ExpStep Parser::resumeExpression(BaseExpAST &value) {
+  ExpFrame &frame = ExpStack.back();
+
+  switch (frame.State) {
+  case EXP_LHS:
+  case EXP_RHS:
+    if (!value) {
+      Log::error(frame.State == EXP_LHS ? "Couldn't get lhs expr of expression"
+                                        : "Couldn't get rhs expr of expression", frame.Temp);
+      ExpStack.pop_back();
+      return RETURN_EXP;
+    }
+    if (frame.State == EXP_LHS) {
+      frame.LHS = value;
     } else {
-      Log::error("Couldn't get rhs expr of term", temp2);
-      return nullptr;
+      frame.LHS = Context->create<BinaryExprAST>(frame.Op, frame.LHS, value, frame.Prefix);
+      frame.Prefix = OP_NONE;   // 符号は最初の演算にだけ付ける
+    }
+    if (Tokens->isType(TOK_PLUS) || Tokens->isType(TOK_MINUS)) {
+      frame.Op = Tokens->isType(TOK_PLUS) ? OP_ADD : OP_SUB;
+      Tokens->getNextToken(); // eat '+' of '-'
+      frame.State = EXP_RHS;
+      frame.Temp = Tokens->getToken();
+      return START_TERM;
+    }
+    // 項が一つだけの '-' term は 0 - term とする
+    if (frame.Prefix == OP_SUB)
+      value = Context->create<BinaryExprAST>(OP_SUB, Context->create<NumberAST>(0), frame.LHS);
+    else
+      value = frame.LHS;
+    ExpStack.pop_back();
+    return RETURN_EXP;
+
+  case TERM_LHS:
+  case TERM_RHS:
+    if (!value) {
+      Log::error(frame.State == TERM_LHS ? "Couldn't get lhs expr of term"
+                                         : "Couldn't get rhs expr of term", frame.Temp);
+      ExpStack.pop_back();
+      return RETURN_EXP;
+    }
+    frame.LHS = frame.State == TERM_LHS ? value : Context->create<BinaryExprAST>(frame.Op, frame.LHS, value);
+    if (Tokens->isType(TOK_MUL) || Tokens->isType(TOK_DIV)) {
+      frame.Op = Tokens->isType(TOK_MUL) ? OP_MUL : OP_DIV;
+      Tokens->getNextToken(); // eat '*' or '/'
+      frame.State = TERM_RHS;
+      frame.Temp = Tokens->getToken();
+      return START_FACTOR;
+    }
+    value = frame.LHS;
+    ExpStack.pop_back();
+    return RETURN_EXP;
+
+  case PAREN_EXP:
+    if (!value) {
+      Log::error("Couldn't get expr of paren", frame.Temp);
+      ExpStack.pop_back();
+      return RETURN_EXP;
     }
+    ExpStack.pop_back();
+    checkGet(TOK_RPAREN);
+    value = checkFactorEnd(value);
+    return RETURN_EXP;
+
+  case CALL_ARG:
+    // 最初の引数がなければ引数なし。2番目以降は失敗しても並びに加える
+    if (value || !frame.First) {
+      ArgList.push_back(value);
+      if (Tokens->isType(TOK_COMMA)) {
+        Tokens->getNextToken(); // eat ','
+        frame.First = false;
+        return START_EXP;
+      }
+    }
+    value = parseCall(frame);
+    ExpStack.pop_back();
+    value = checkFactorEnd(value);
+    return RETURN_EXP;
   }
-
-  return lhs;
+  llvm_unreachable("unknown expression state");
 }
 
-// factor: ident | number | '(' expression ')' |
-//         ident '(' [ expression, { ',' expression } ]
 /**
   * Factor用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseExpAST>, 失敗: nullptr
+  * 括弧や関数呼び出しなら状態を積んで中の式を待つ
+  * @param 解析した因子（失敗なら nullptr）
+  * @return 次に行うこと
   */
-std::unique_ptr<BaseExpAST> Parser::parseFactor() {
+Parser::ExpStep Parser::parseFactor(BaseExpAST &value) {
   // identifier: 定義済み変数
-  std::unique_ptr<BaseExpAST> baseAST;
+  value = nullptr;
   if (Tokens->getCurType() == TOK_IDENTIFIER) {
-    std::string name = Tokens->getCurString();
+    SymbolID name = Tokens->getCurSymbol();
     auto temp = Tokens->getToken();
     Tokens->getNextToken(); // eat ident
     if (sym_table.findSymbol(name, FUNC, false, -1)) {
-      baseAST = parseCall(name, temp);
-    } else {
-      if (!sym_table.findSymbol(name, PARAM)
-      && !sym_table.findSymbol(name, VAR, false, -1)
-      && !sym_table.findSymbol(name, CONST, false, -1)
-      && !sym_table.findTemp(name)) {
-        sym_table.addTemp(name);
-        Log::addWarn(name, Tokens->getToken());
-      }
-      baseAST = llvm::make_unique<VariableAST>(name);
+      ExpStack.push_back(ExpFrame(CALL_ARG, temp));
+      ExpStack.back().Callee = name;
+      ExpStack.back().ArgBegin = ArgList.size();
+      Tokens->getNextToken(); // eat '('
+      return START_EXP;
+    }
+    if (!sym_table.findSymbol(name, PARAM)
+    && !sym_table.findSymbol(name, VAR, false, -1)
+    && !sym_table.findSymbol(name, CONST, false, -1)
+    && !sym_table.findTemp(name)) {
+      sym_table.addTemp(name);
+      Log::addWarn(name, Tokens->getToken());
     }
+    value = Context->create<VariableAST>();
+    sym_table.addReference(name, value.getIndex());
   } else if (Tokens->getCurType() == TOK_DIGIT) {
     int val=Tokens->getCurNumVal();
     Tokens->getNextToken(); // eat digit
-    baseAST = llvm::make_unique<NumberAST>(val);
-  } else if (Tokens->isSymbol("(")) {
+    value = Context->create<NumberAST>(val);
+  } else if (Tokens->isType(TOK_LPAREN)) {
     Tokens->getNextToken(); // eat '('
-    auto temp = Tokens->getToken();
-    auto expr = parseExpression(nullptr);
-    if (!expr) {
-      Log::error("Couldn't get expr of paren", temp);
-      return nullptr;
-    }
-    checkGet(")");
-    baseAST = std::move(expr);
-  } else {
-    baseAST = nullptr;
+    ExpStack.push_back(ExpFrame(PAREN_EXP, Tokens->getToken()));
+    return START_EXP;
   }
+  value = checkFactorEnd(value);
+  return RETURN_EXP;
+}
+
+/**
+  * 因子の直後に因子や '(' が続いていないか調べる
+  * @return 因子をそのまま返す
+  */
+BaseExpAST Parser::checkFactorEnd(BaseExpAST factor) {
   if (Tokens->getCurType() == TOK_IDENTIFIER || Tokens->getCurType() == TOK_DIGIT) {
-    Log::duplicateFactorError(Tokens->getCurString(), Tokens->getToken());
-  } if (Tokens->isSymbol("(")) {
+    Log::duplicateFactorError(Tokens->getToken());
+  } if (Tokens->isType(TOK_LPAREN)) {
     Log::error("factor + '(': missing opcode", Tokens->getToken());
   }
-  return baseAST;
+  return factor;
 }
 
 // factor: ident '(' expression ')' |
 /**
   * Factor(関数呼び出し)用構文解析メソッド
-  * @return 成功: std::unique_ptr<BaseExpAST>, 失敗: nullptr
+  * 引数を読み終えてから呼ばれる
+  * @param 関数呼び出しの状態（関数名, 関数名のトークン, ArgList での引数の開始位置）
+  * @return 成功: BaseExpAST, 失敗: nullptr
   */
-std::unique_ptr<BaseExpAST> Parser::parseCall(const std::string &callee, Token token) {
-  auto call_expr = llvm::make_unique<CallExprAST>(callee);
-  Tokens->getNextToken(); // eat '('
-  auto arg = parseExpression(nullptr);
-  if (arg) {
-    while (true) {
-      call_expr->addArg(std::move(arg));
-      if (!Tokens->isSymbol(","))
-        break;
-      Tokens->getNextToken(); // eat ','
-      arg = parseExpression(nullptr);
-    }
-  }
-  checkGet(")");
-
-  if (!sym_table.findSymbol(callee, FUNC, false, call_expr->getNumOfArgs())) {
-    Log::undefinedFuncError(callee, call_expr->getNumOfArgs(), token);
-    return nullptr;
-  }
-  return call_expr;
+BaseExpAST Parser::parseCall(const ExpFrame &frame) {
+  auto args = llvm::makeArrayRef(ArgList).drop_front(frame.ArgBegin);
+  BaseExpAST call;
+  checkGet(TOK_RPAREN);
+
+  uint32_t decl = sym_table.findDecl(frame.Callee, FUNC, args.size());
+  if (decl == SymTable::NODECL)
+    Log::undefinedFuncError(frame.Callee, args.size(), frame.Temp);
+  else
+    call = Context->create<CallExprAST>(decl, args);
+  ArgList.resize(frame.ArgBegin);
+  return call;
 }
 
-bool Parser::isKeyWord(std::string &name) {
-  std::vector<std::string> keywords = {
-    "begin", "end", "if", "then", "while", "do", "return",
-    "function", "var", "const", "odd", "write", "writeln"
-  };
-  auto result = std::find(keywords.begin(), keywords.end(), name);
-  if (result == keywords.end())
-    return false;
-  return true;
-}
-
-bool Parser::isSymbol(std::string &name) {
-  std::vector<std::string> symbols = {
-    "<", "<>", "<=", ">", ">=", "*", "/",
-    "+", "-", ";", ",", ".", "=", "(", ")", ":="
-  };
-  auto result = std::find(symbols.begin(), symbols.end(), name);
-  if (result == symbols.end())
-    return false;
-  return true;
-}
-
-bool Parser::isKeyWordType(int type) {
-  return TOK_CONST <= type && type <= TOK_ODD;
-}
-
-void Parser::checkGet(std::string symbol) {
+void Parser::checkGet(TokenType type) {
   //check("in checkGet");
-  //fprintf(stderr, "symbol: %s\n", symbol.c_str());
-  if (Tokens->getCurString() == symbol) {
+  if (Tokens->isType(type)) {
     Tokens->getNextToken();
     return;
   }
-  if ((isKeyWord(symbol) && isKeyWordType(Tokens->getCurType())) ||
-        (isSymbol(symbol) && (Tokens->getCurType() == TOK_SYMBOL))) {
-    Log::unexpectedError(Tokens->getCurString(), Tokens->getToken());
-    Log::missingError(symbol, Tokens->getToken());
+  if ((isKeyWordType(type) && isKeyWordType(Tokens->getCurType())) ||
+        (isSymbolType(type) && isSymbolType(Tokens->getCurType()))) {
+    Log::unexpectedError(Tokens->getToken());
+    Log::missingError(tokenSpelling(type), Tokens->getToken());
     Tokens->getNextToken();
   } else {
-    auto token = Tokens->getToken();
-    Log::missingError(symbol, Tokens->getToken(), true);
+    Log::missingError(tokenSpelling(type), Tokens->getToken(), true);
   }
 }
 
 void Parser::check(const std::string &caller) {
-  fprintf(stderr, "%s: name: %s, type: %s\n", caller.c_str(), Tokens->getCurString().c_str(), TokenTypeStr(Tokens->getCurType()).c_str());
+  fprintf(stderr, "%s: name: %s, type: %s\n", caller.c_str(), Tokens->getCurString().str().c_str(), TokenTypeStr(Tokens->getCurType()).c_str());
 }
 
-bool Parser::isStmtBeginKey(const std::string &name) {
-  std::vector<std::string> words = {
-    "begin", "if", "while", "return", "write", "writeln"
-  };
-  auto result = std::find(words.begin(), words.end(), name);
-  return result != words.end();
+bool Parser::isStmtBeginKey(TokenType type) {
+  switch (type) {
+  case TOK_BEGIN:
+  case TOK_IF:
+  case TOK_WHILE:
+  case TOK_RETURN:
+  case TOK_WRITE:
+  case TOK_WRITELN:
+    return true;
+  default:
+    return false;
+  }
 }
@@ -1,13 +1,19 @@
 #include "llvm/Support/CommandLine.h"
 #include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/IRPrintingPasses.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/LinkAllPasses.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/TargetRegistry.h"
@@ -17,107 +23,456 @@
 #include "llvm/Target/TargetOptions.h"
 #include "llvm/Analysis/InstructionSimplify.h"
 #include "lexer.hpp"
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <thread>
 #include "ast.hpp"
+#include "astcache.hpp"
+#include "incremental.hpp"
 #include "parser.hpp"
 #include "codegen.hpp"
+#include "fold.hpp"
 #include "log.hpp"
 
 llvm::cl::opt<bool> debug("d", llvm::cl::desc("Enable debug"));
 llvm::cl::opt<bool> output_lexer("l", llvm::cl::desc("Output token list"));
 llvm::cl::opt<bool> syntax("c", llvm::cl::desc("Syntax check only"));
 llvm::cl::opt<bool> output_llvm_as("a", llvm::cl::desc("Output llvm-as code"));
-llvm::cl::opt<std::string> InputFileName(llvm::cl::Positional, llvm::cl::desc("<input file>"), llvm::cl::Required);
+llvm::cl::opt<LexerMode> lexer_mode("lexer", llvm::cl::desc("Lexer input mode"),
+  llvm::cl::values(
+    clEnumValN(LEXER_STREAM, "stream", "Lex tokens on demand into a ring buffer (default)"),
+    clEnumValN(LEXER_THREAD, "thread", "Lex tokens on a separate thread ahead of the parser"),
+    clEnumValN(LEXER_BUFFER, "buffer", "Lex the whole file mapped into memory up front"),
+    clEnumValN(LEXER_GETLINE, "getline", "Read the file line by line")),
+  llvm::cl::init(LEXER_STREAM));
+llvm::cl::list<std::string> InputFileNames(llvm::cl::Positional, llvm::cl::desc("<input files>"), llvm::cl::OneOrMore);
+llvm::cl::opt<std::string> OutputFileName("o", llvm::cl::desc("Output filename ('-' for stdout)"), llvm::cl::value_desc("filename"));
+llvm::cl::opt<DiagFormat> diag_format("diag-format", llvm::cl::desc("Diagnostics output format"),
+  llvm::cl::values(
+    clEnumValN(DIAG_TEXT, "text", "[line:column] error: message (default)"),
+    clEnumValN(DIAG_JSON, "json", "One JSON object per line")),
+  llvm::cl::init(DIAG_TEXT));
+llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of files to compile in parallel"),
+  llvm::cl::value_desc("N"), llvm::cl::init(1));
+llvm::cl::opt<std::string> ast_cache("ast-cache", llvm::cl::desc("Cache parsed ASTs in this directory"),
+  llvm::cl::value_desc("dir"));
+/**
+ * 最適化レベル
+ */
+enum OptLevel {
+  OPT_O0,
+  OPT_O1,
+  OPT_O2,
+  OPT_O3,
+  OPT_Os,
+};
+llvm::cl::opt<OptLevel> opt_level(llvm::cl::desc("Optimization level"),
+  llvm::cl::values(
+    clEnumValN(OPT_O0, "O0", "No optimization"),
+    clEnumValN(OPT_O1, "O1", "Optimize quickly without inlining or loop transformations"),
+    clEnumValN(OPT_O2, "O2", "Default optimizations with inlining, LICM, unrolling and vectorization (default)"),
+    clEnumValN(OPT_O3, "O3", "Aggressive optimizations"),
+    clEnumValN(OPT_Os, "Os", "Optimize for size")),
+  llvm::cl::init(OPT_O2));
+llvm::cl::opt<std::string> mtriple("mtriple", llvm::cl::desc("Override target triple for module"),
+  llvm::cl::value_desc("triple"));
+llvm::cl::opt<std::string> mcpu("mcpu", llvm::cl::desc("Target a specific cpu type ('native' for the host CPU)"),
+  llvm::cl::value_desc("cpu-name"), llvm::cl::init("generic"));
+llvm::cl::list<std::string> mattrs("mattr", llvm::cl::CommaSeparated,
+  llvm::cl::desc("Target specific attributes (-mattr=+popcnt,-avx)"), llvm::cl::value_desc("a1,+a2,-a3,..."));
+llvm::cl::opt<llvm::Reloc::Model> relocation_model("relocation-model", llvm::cl::desc("Choose relocation model"),
+  llvm::cl::values(
+    clEnumValN(llvm::Reloc::Static, "static", "Non-relocatable code"),
+    clEnumValN(llvm::Reloc::PIC_, "pic", "Fully relocatable, position independent code"),
+    clEnumValN(llvm::Reloc::DynamicNoPIC, "dynamic-no-pic", "Relocatable external references, non-relocatable code")));
+llvm::cl::opt<llvm::CodeModel::Model> code_model("code-model", llvm::cl::desc("Choose code model"),
+  llvm::cl::values(
+    clEnumValN(llvm::CodeModel::Small, "small", "Small code model"),
+    clEnumValN(llvm::CodeModel::Kernel, "kernel", "Kernel code model"),
+    clEnumValN(llvm::CodeModel::Medium, "medium", "Medium code model"),
+    clEnumValN(llvm::CodeModel::Large, "large", "Large code model")));
+llvm::cl::opt<bool> no_fold("no-fold", llvm::cl::desc("Disable constant folding on the AST"));
+llvm::cl::opt<bool> ssa("ssa", llvm::cl::desc("Build SSA form directly instead of allocas for variables"));
+llvm::cl::opt<bool> incremental("incremental",
+  llvm::cl::desc("Keep the file parsed and reparse edits read from stdin (syntax check only)"));
+
+/**
+ * 1つのファイルを構文解析してASTを得る
+ * -ast-cache があれば、内容が同じソースのASTをキャッシュから読み込み、字句解析・構文解析を省く。
+ * キャッシュになければ解析し、診断が1つもなかったときだけ結果を保存する
+ * @param 入力ファイル名, 得たAST（空のプログラムなら nullptr）
+ * @return 解析成功：true　解析失敗：false
+ */
+static bool parseFile(const std::string &InputFileName, std::unique_ptr<ProgramAST> &program) {
+  std::unique_ptr<llvm::MemoryBuffer> source;
+  if (!ast_cache.empty() && InputFileName != "-") {
+    auto buffer = llvm::MemoryBuffer::getFile(InputFileName);
+    if (buffer) {
+      source = std::move(*buffer);
+      program = ASTCache(ast_cache).load(source->getBuffer());
+      if (program)
+        return true;
+    }
+  }
 
-int Log::error_num = 0;
+  int reported = Log::engine().getReportNum();
+  // キャッシュを使うときは読み込んだ内容をそのまま解析する（読み直すと保存するハッシュ値と中身がずれうる）
+  auto TheParser = source
+      ? llvm::make_unique<Parser>(llvm::MemoryBuffer::getMemBuffer(source->getMemBufferRef(), false),
+                                  debug, lexer_mode)
+      : llvm::make_unique<Parser>(InputFileName, debug, lexer_mode);
+  if (!TheParser->parse())
+    return false;
+  program = TheParser->getAST();
+  if (source && program && Log::engine().getReportNum() == reported)
+    ASTCache(ast_cache).store(source->getBuffer(), *program);
+  return true;
+}
 
 /**
- * main関数
+ * 最適化レベルに対応するバックエンドの最適化レベル
+ * CodeGenOpt::None では高速なレジスタ割り付け（RegAllocFast）が選ばれる
  */
-int main(int argc, char **argv) {
-  llvm::cl::ParseCommandLineOptions(argc, argv);
+static llvm::CodeGenOpt::Level codegenLevel() {
+  switch (opt_level) {
+  case OPT_O0: return llvm::CodeGenOpt::None;
+  case OPT_O1: return llvm::CodeGenOpt::Less;
+  case OPT_O3: return llvm::CodeGenOpt::Aggressive;
+  default:     return llvm::CodeGenOpt::Default;
+  }
+}
+
+/**
+ * ターゲットのCPU名と機能（-mcpu=native はホストのものに解決する）
+ */
+static std::string TargetCPU;
+static std::string TargetFeatures;
+
+/**
+ * -mcpu, -mattr からターゲットのCPU名と機能を決める（全ファイルで1回だけ行う）
+ */
+static void resolveTargetCPU() {
+  llvm::SubtargetFeatures features;
+  TargetCPU = mcpu;
+  if (mcpu == "native") {
+    TargetCPU = llvm::sys::getHostCPUName().str();
+    llvm::StringMap<bool> host_features;
+    if (llvm::sys::getHostCPUFeatures(host_features))
+      for (auto &feature : host_features)
+        features.AddFeature(feature.first(), feature.second);
+  }
+  for (auto &attr : mattrs)
+    features.AddFeature(attr);
+  TargetFeatures = features.getString();
+}
+
+/**
+ * TargetMachineが必要か（-a はレベルかターゲットを指定したときだけ使う）
+ */
+static bool needTargetMachine() {
+  return !output_llvm_as || opt_level.getNumOccurrences() || mtriple.getNumOccurrences() ||
+    mcpu.getNumOccurrences() || mattrs.getNumOccurrences() ||
+    relocation_model.getNumOccurrences() || code_model.getNumOccurrences();
+}
 
+/**
+ * TargetMachineを作り、モジュールのターゲットとデータレイアウトを設定する
+ * 関数にも target-cpu, target-features 属性を付け、IRの最適化もターゲットに合わせる
+ * @return 作れなければ nullptr
+ */
+static std::unique_ptr<llvm::TargetMachine> createTargetMachine(llvm::Module &module) {
+  auto triple = mtriple.empty() ? llvm::sys::getDefaultTargetTriple() : llvm::Triple::normalize(mtriple);
+  module.setTargetTriple(triple);
+
+  std::string err;
+  auto target = llvm::TargetRegistry::lookupTarget(triple, err);
+  if (!target) {
+    Log::error(err);
+    return nullptr;
+  }
+
+  llvm::TargetOptions option;
+  auto rm = llvm::Optional<llvm::Reloc::Model>();
+  if (relocation_model.getNumOccurrences())
+    rm = relocation_model;
+  auto cm = llvm::Optional<llvm::CodeModel::Model>();
+  if (code_model.getNumOccurrences())
+    cm = code_model;
+  std::unique_ptr<llvm::TargetMachine> machine(target->createTargetMachine(
+    triple, TargetCPU, TargetFeatures, option, rm, cm, codegenLevel()));
+
+  module.setDataLayout(machine->createDataLayout());
+  for (auto &func : module) {
+    if (func.isDeclaration())
+      continue;
+    func.addFnAttr("target-cpu", TargetCPU);
+    if (!TargetFeatures.empty())
+      func.addFnAttr("target-features", TargetFeatures);
+  }
+  return machine;
+}
+
+/**
+ * 最適化レベルに応じたPassBuilderの既定のパイプラインでモジュールを最適化する
+ * -O0 では何もしない。-O2 以上と -Os ではループ展開とベクトル化も行う
+ */
+static void optimizeModule(llvm::Module &module, llvm::TargetMachine *machine) {
+  llvm::PassBuilder::OptimizationLevel level;
+  switch (opt_level) {
+  case OPT_O0: return;
+  case OPT_O1: level = llvm::PassBuilder::O1; break;
+  case OPT_O2: level = llvm::PassBuilder::O2; break;
+  case OPT_O3: level = llvm::PassBuilder::O3; break;
+  case OPT_Os: level = llvm::PassBuilder::Os; break;
+  }
+
+  llvm::PipelineTuningOptions tuning;
+  tuning.LoopUnrolling = opt_level >= OPT_O2;
+  tuning.LoopVectorization = opt_level >= OPT_O2;
+  tuning.SLPVectorization = opt_level >= OPT_O2;
+  llvm::PassBuilder builder(machine, tuning);
+
+  llvm::LoopAnalysisManager LAM;
+  llvm::FunctionAnalysisManager FAM;
+  llvm::CGSCCAnalysisManager CGAM;
+  llvm::ModuleAnalysisManager MAM;
+  builder.registerModuleAnalyses(MAM);
+  builder.registerCGSCCAnalyses(CGAM);
+  builder.registerFunctionAnalyses(FAM);
+  builder.registerLoopAnalyses(LAM);
+  builder.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  llvm::ModulePassManager MPM = builder.buildPerModuleDefaultPipeline(level);
+  MPM.run(module, MAM);
+}
+
+/**
+ * 1つのファイルをコンパイルする
+ * 診断はこのスレッドの診断エンジンに記録する
+ * @param 入力ファイル名（"-"なら標準入力）, 複数ファイルのコンパイル中か
+ * @return 終了コード
+ */
+static int compile(const std::string &InputFileName, bool multi) {
   if (output_lexer) {
-    auto Tokens = LexicalAnalysis(InputFileName);
+    auto Tokens = LexicalAnalysis(InputFileName, lexer_mode);
     if (Tokens)
       Tokens->printTokens();
-    exit(1);
+    return 1;
   }
 
-  auto TheParser = llvm::make_unique<Parser>(InputFileName, debug);
-  if (!TheParser->parse()) {
-    exit(1);
+  std::unique_ptr<ProgramAST> TheProgramAST;
+  if (!parseFile(InputFileName, TheProgramAST)) {
+    return 1;
   } else {
-    fprintf(stderr, "parse ok\n");
+    Log::write("parse ok\n");
   }
 
   if (syntax) {
-    exit(0);
+    return 0;
   }
 
-  //get AST
-  auto TheProgramAST = TheParser->getAST();
   if (!TheProgramAST) {
-    fprintf(stderr,"Program is empty");
-    exit(0);
+    Log::write("Program is empty");
+    return 0;
   }
 
-  auto TheCodegen = llvm::make_unique<CodeGen>(InputFileName);
+  if (!no_fold)
+    ConstantFolder(*TheProgramAST).fold();
 
-  TheCodegen->generate(std::move(TheProgramAST));
-
-  if (output_llvm_as) {
-    auto module = TheCodegen->getModule();
-    module->dump();
-    exit(0);
+  // 標準入力からの場合は出力先も標準出力とする
+  // 複数ファイルのときは -a の出力も入力ファイル名から決める
+  std::string output_filename = OutputFileName;
+  if (output_filename.empty()) {
+    std::string stem = InputFileName.substr(0, InputFileName.find_last_of("."));
+    if (InputFileName == "-")
+      output_filename = "-";
+    else if (!output_llvm_as)
+      output_filename = stem + ".o";
+    else if (multi)
+      output_filename = stem + ".ll";
   }
 
-  llvm::InitializeAllTargetInfos();
-  llvm::InitializeAllTargets();
-  llvm::InitializeAllTargetMCs();
-  llvm::InitializeAllAsmParsers();
-  llvm::InitializeAllAsmPrinters();
-
-  auto TheModule = TheCodegen->getModule();
+  auto TheCodegen = llvm::make_unique<CodeGen>(InputFileName == "-" ? "<stdin>" : InputFileName, ssa);
 
-  auto triple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(triple);
+  if (!TheCodegen->generate(std::move(TheProgramAST)))
+    return 1;
 
-  std::string err;
-  auto target = llvm::TargetRegistry::lookupTarget(triple, err);
-  if (!target)
-    Log::error(err.c_str(), true);
+  // 不正なIRを最適化・出力すると止まらないことや落ちることがあるので、その前に検査する
+  auto TheModule = TheCodegen->getModule();
+  std::string broken;
+  llvm::raw_string_ostream broken_os(broken);
+  if (llvm::verifyModule(*TheModule, &broken_os)) {
+    // 検査の結果は命令ごとに出て長くなるので、始めの数行だけ出す
+    llvm::SmallVector<llvm::StringRef, 8> lines;
+    llvm::StringRef(broken_os.str()).rtrim().split(lines, '\n', 6);
+    if (lines.size() > 6)
+      lines.back() = "...";
+    Log::error("internal error: generated invalid IR\n" + llvm::join(lines, "\n"));
+    return 1;
+  }
 
-  auto cpu = "generic";
-  auto features = "";
-  llvm::TargetOptions option;
-  auto rm = llvm::Optional<llvm::Reloc::Model>();
-  auto machine = target->createTargetMachine(
-    triple, cpu, features, option, rm);
+  // -a はターゲットを指定したときだけターゲットを設定し、レベルを指定したときだけ最適化したIRを出力する
+  std::unique_ptr<llvm::TargetMachine> machine;
+  if (needTargetMachine()) {
+    machine = createTargetMachine(*TheModule);
+    if (!machine)
+      return 1;
+    if (!output_llvm_as || opt_level.getNumOccurrences())
+      optimizeModule(*TheModule, machine.get());
+  }
 
-  TheModule->setDataLayout(machine->createDataLayout());
+  if (output_llvm_as) {
+    if (output_filename.empty()) {
+      TheModule->dump();
+      return 0;
+    }
+    std::error_code err_code;
+    llvm::raw_fd_ostream dest(output_filename, err_code, llvm::sys::fs::F_None);
+    if (err_code) {
+      Log::error("Could not open output file: " + err_code.message());
+      return 1;
+    }
+    TheModule->print(dest, nullptr);
+    return 0;
+  }
 
-  int ext = InputFileName.find_last_of(".");
-  auto prog_name = (InputFileName.substr(0, ext) + ".o").c_str();
   std::error_code err_code;
-  llvm::raw_fd_ostream dest(prog_name, err_code, llvm::sys::fs::F_None);
+  llvm::raw_fd_ostream dest(output_filename, err_code, llvm::sys::fs::F_None);
   if (err_code) {
-    Log::error(("Could not open output file: " + err_code.message()).c_str(), true);
+    Log::error("Could not open output file: " + err_code.message());
+    return 1;
   }
 
   auto ThePM = llvm::legacy::PassManager();
-  ThePM.add(llvm::createPromoteMemoryToRegisterPass());
-  ThePM.add(llvm::createInstructionCombiningPass());
-  ThePM.add(llvm::createReassociatePass());
-  ThePM.add(llvm::createGVNPass());
-  ThePM.add(llvm::createUnifyFunctionExitNodesPass());
-  ThePM.add(llvm::createCFGSimplificationPass());
-
   auto file_type = llvm::TargetMachine::CGFT_ObjectFile;
-  if (machine->addPassesToEmitFile(ThePM, dest, nullptr, file_type))
-    Log::error("TheTargetMachine can't emit a file of this type", true);
+  if (machine->addPassesToEmitFile(ThePM, dest, nullptr, file_type)) {
+    Log::error("TheTargetMachine can't emit a file of this type");
+    return 1;
+  }
   ThePM.run(*TheModule);
   dest.flush();
 
   return 0;
 }
+
+/**
+ * 複数のファイルを jobs 個のスレッドでコンパイルする
+ * ファイルごとに診断エンジン（とLLVMContext）を分け、診断は入力の順にまとめて出力する
+ * @return 終了コード（最も大きいもの）
+ */
+static int compileAll(unsigned jobs) {
+  size_t num = InputFileNames.size();
+  std::vector<std::string> logs(num);
+  std::vector<int> results(num, 0);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next++) < num) {
+      Diagnostics diags(stderr, diag_format);
+      diags.setBuffer(&logs[i]);
+      Log::setEngine(&diags);
+      results[i] = compile(InputFileNames[i], true);
+      diags.flush();
+      Log::setEngine(nullptr);
+    }
+  };
+
+  jobs = (unsigned)std::min<size_t>(std::max(jobs, 1u), num);
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < jobs; i++)
+    workers.emplace_back(worker);
+  worker();   // メインスレッドも1つのワーカになる
+  for (auto &thread : workers)
+    thread.join();
+
+  int result = 0;
+  for (size_t i = 0; i < num; i++) {
+    fwrite(logs[i].data(), 1, logs[i].size(), stderr);
+    result = std::max(result, results[i]);
+  }
+  return result;
+}
+
+/**
+ * インクリメンタル構文解析のセッション
+ * ファイルを解析して診断を標準出力に書き、標準入力から編集を読むたびに解析し直して診断を書く。
+ * 編集は「位置 長さ 文字列の長さ\n」の後に置き換える文字列を続けたもの。
+ * 診断（pl0 -c と同じ内容）の後には空行を書く
+ * @param 入力ファイル名
+ * @return 終了コード
+ */
+static int runIncremental(const std::string &InputFileName) {
+  auto buffer = llvm::MemoryBuffer::getFile(InputFileName);
+  if (!buffer) {
+    Log::error("Could not open input file: " + buffer.getError().message());
+    return 1;
+  }
+  IncrementalParser session(InputFileName, (*buffer)->getBuffer());
+  session.report(stdout, diag_format);
+  fputs("\n", stdout);
+  fflush(stdout);
+
+  unsigned long offset, length, size;
+  while (scanf("%lu %lu %lu", &offset, &length, &size) == 3 && getchar() == '\n') {
+    std::string text(size, '\0');
+    if (fread(&text[0], 1, size, stdin) != size || offset + length > session.getText().size()) {
+      Log::error("Invalid edit");
+      return 1;
+    }
+    session.edit(offset, length, text);
+    session.report(stdout, diag_format);
+    fputs("\n", stdout);
+    fflush(stdout);
+  }
+  if (!feof(stdin)) {
+    Log::error("Invalid edit");
+    return 1;
+  }
+  if (debug)
+    fprintf(stderr, "reparsed %u function(s), %u whole file(s)\n", session.getNumIncremental(),
+            session.getNumFull());
+  return 0;
+}
+
+/**
+ * main関数
+ */
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+  // 記録した診断はexit時に既定の診断エンジンの破棄とともに出力される
+  Log::engine().setFormat(diag_format);
+
+  if (InputFileNames.size() > 1 && !OutputFileName.empty()) {
+    Log::error("-o cannot be used with multiple input files");
+    return 1;
+  }
+
+  if (incremental) {
+    if (InputFileNames.size() > 1 || InputFileNames[0] == "-") {
+      Log::error("-incremental needs one input file");
+      return 1;
+    }
+    return runIncremental(InputFileNames[0]);
+  }
+
+  // ターゲットの初期化は全ファイルで1回だけ行う
+  if (!output_lexer && !syntax && needTargetMachine()) {
+    llvm::InitializeAllTargetInfos();
+    llvm::InitializeAllTargets();
+    llvm::InitializeAllTargetMCs();
+    llvm::InitializeAllAsmParsers();
+    llvm::InitializeAllAsmPrinters();
+    resolveTargetCPU();
+  }
+
+  // トークン列の表示は直接標準エラーに書くので、1ファイルずつ順に行う
+  if (InputFileNames.size() == 1 || output_lexer) {
+    int result = 0;
+    for (auto &file : InputFileNames)
+      result = std::max(result, compile(file, InputFileNames.size() > 1));
+    return result;
+  }
+  return compileAll(Jobs);
+}
@@ -0,0 +1,194 @@
+#include "scan.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/************************************************
+スカラー版
+************************************************/
+static inline bool isBlank(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static inline bool isAlnum(unsigned char c) {
+  return (unsigned char)((c | 0x20) - 'a') < 26 || (unsigned char)(c - '0') < 10;
+}
+
+static inline bool isDigit(unsigned char c) {
+  return (unsigned char)(c - '0') < 10;
+}
+
+static inline bool isCommentBody(unsigned char c) {
+  return c != '}' && c != '\n';
+}
+
+static const char *blankScalar(const char *p, const char *end) {
+  while (p < end && isBlank(*p)) p++;
+  return p;
+}
+
+static const char *alnumScalar(const char *p, const char *end) {
+  while (p < end && isAlnum(*p)) p++;
+  return p;
+}
+
+static const char *digitScalar(const char *p, const char *end) {
+  while (p < end && isDigit(*p)) p++;
+  return p;
+}
+
+static const char *commentScalar(const char *p, const char *end) {
+  while (p < end && isCommentBody(*p)) p++;
+  return p;
+}
+
+#ifdef SCAN_X86
+/************************************************
+SSE2版
+各バイトを分類して条件を満たさないバイトのマスクを作り、
+最初に立っているビットの位置まで進める
+************************************************/
+// lo <= x <= hi （ASCII範囲のみ。0x80以上は符号付き比較で範囲外になる）
+static inline __m128i inRange128(__m128i x, char lo, char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(x, _mm_set1_epi8(hi + 1)));
+}
+
+static inline __m128i blank128(__m128i x) {
+  __m128i ctrl = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('\n')), inRange128(x, '\t', '\r'));
+  return _mm_or_si128(ctrl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+}
+
+static inline __m128i alnum128(__m128i x) {
+  __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+  return _mm_or_si128(inRange128(lower, 'a', 'z'), inRange128(x, '0', '9'));
+}
+
+static inline __m128i digit128(__m128i x) {
+  return inRange128(x, '0', '9');
+}
+
+static inline __m128i comment128(__m128i x) {
+  __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('}')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\n')));
+  return _mm_xor_si128(stop, _mm_set1_epi8(-1));
+}
+
+#define DEFINE_SSE2_SCAN(name, classify, scalar)                         \
+  static const char *name##SSE2(const char *p, const char *end) {      \
+    while (end - p >= 16) {                                              \
+      __m128i x = _mm_loadu_si128((const __m128i *)p);                   \
+      unsigned mask = ~_mm_movemask_epi8(classify(x)) & 0xffff;          \
+      if (mask)                                                          \
+        return p + __builtin_ctz(mask);                                  \
+      p += 16;                                                           \
+    }                                                                    \
+    return scalar(p, end);                                               \
+  }
+
+DEFINE_SSE2_SCAN(blank, blank128, blankScalar)
+DEFINE_SSE2_SCAN(alnum, alnum128, alnumScalar)
+DEFINE_SSE2_SCAN(digit, digit128, digitScalar)
+DEFINE_SSE2_SCAN(comment, comment128, commentScalar)
+
+/************************************************
+AVX2版
+************************************************/
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i inRange256(__m256i x, char lo, char hi) {
+  return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(lo - 1)),
+                          _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), x));
+}
+
+AVX2 static inline __m256i blank256(__m256i x) {
+  __m256i ctrl = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')), inRange256(x, '\t', '\r'));
+  return _mm256_or_si256(ctrl, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')));
+}
+
+AVX2 static inline __m256i alnum256(__m256i x) {
+  __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+  return _mm256_or_si256(inRange256(lower, 'a', 'z'), inRange256(x, '0', '9'));
+}
+
+AVX2 static inline __m256i digit256(__m256i x) {
+  return inRange256(x, '0', '9');
+}
+
+AVX2 static inline __m256i comment256(__m256i x) {
+  __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('}')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\n')));
+  return _mm256_xor_si256(stop, _mm256_set1_epi8(-1));
+}
+
+// トークンの多くは16バイト未満なので、最初の16バイトはSSE2で判定する
+#define DEFINE_AVX2_SCAN(name, classify, classify128)                    \
+  AVX2 static const char *name##AVX2(const char *p, const char *end) { \
+    if (end - p >= 16) {                                                 \
+      __m128i x = _mm_loadu_si128((const __m128i *)p);                   \
+      unsigned mask = ~_mm_movemask_epi8(classify128(x)) & 0xffff;       \
+      if (mask)                                                          \
+        return p + __builtin_ctz(mask);                                  \
+      p += 16;                                                           \
+    }                                                                    \
+    while (end - p >= 32) {                                              \
+      __m256i x = _mm256_loadu_si256((const __m256i *)p);                \
+      unsigned mask = ~(unsigned)_mm256_movemask_epi8(classify(x));      \
+      if (mask)                                                          \
+        return p + __builtin_ctz(mask);                                  \
+      p += 32;                                                           \
+    }                                                                    \
+    return name##SSE2(p, end);                                           \
+  }
+
+DEFINE_AVX2_SCAN(blank, blank256, blank128)
+DEFINE_AVX2_SCAN(alnum, alnum256, alnum128)
+DEFINE_AVX2_SCAN(digit, digit256, digit128)
+DEFINE_AVX2_SCAN(comment, comment256, comment128)
+#endif
+
+/************************************************
+カーネルの選択
+************************************************/
+static const ScanFunctions ScalarFunctions = { blankScalar, alnumScalar, digitScalar, commentScalar };
+#ifdef SCAN_X86
+static const ScanFunctions SSE2Functions = { blankSSE2, alnumSSE2, digitSSE2, commentSSE2 };
+static const ScanFunctions AVX2Functions = { blankAVX2, alnumAVX2, digitAVX2, commentAVX2 };
+#endif
+
+static ScanKernel CurKernel = SCAN_SCALAR;
+ScanFunctions Scan = ScalarFunctions;
+
+// 起動時に最速のカーネルを選択する
+static ScanKernel InitKernel = setScanKernel(SCAN_AUTO);
+
+ScanKernel setScanKernel(ScanKernel kernel) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  bool has_avx2 = __builtin_cpu_supports("avx2");
+  if ((kernel == SCAN_AUTO || kernel == SCAN_AVX2) && has_avx2) {
+    Scan = AVX2Functions;
+    return CurKernel = SCAN_AVX2;
+  }
+  if (kernel != SCAN_SCALAR) {
+    Scan = SSE2Functions;
+    return CurKernel = SCAN_SSE2;
+  }
+#endif
+  Scan = ScalarFunctions;
+  return CurKernel = SCAN_SCALAR;
+}
+
+ScanKernel getScanKernel() {
+  return CurKernel;
+}
+
+const char *scanKernelName(ScanKernel kernel) {
+  switch (kernel) {
+  case SCAN_AUTO:   return "auto";
+  case SCAN_SCALAR: return "scalar";
+  case SCAN_SSE2:   return "sse2";
+  case SCAN_AVX2:   return "avx2";
+  }
+  return "unknown";
+}
@@ -1,66 +1,100 @@
 #include "log.hpp"
 #include "table.hpp"
+#include <algorithm>
+
+void SymTable::addSymbol(SymbolID name, NameType type, uint32_t decl, int num) {
+  symbolTable.emplace_back(cur_level, type, name, num);
+  symbolIndex[key(name, type, num)].emplace_back(cur_level, decl);
+  if (num != -1)
+    symbolIndex[key(name, type, -1)].emplace_back(cur_level, decl);
+}
+
+/**
+  * ブロックを出る
+  * ブロック内の未解決の参照のうち、このブロックで宣言された名前を resolve に渡し、
+  * 残りは外側のブロックに持ち越す。その後、今のレベルで宣言された名前を取り除く
+  * （どちらもそのブロックの参照・宣言の数だけかかる）
+  * @param 参照のノードと宣言の番号を受け取る関数
+  */
+void SymTable::blockOut(llvm::function_ref<void(uint32_t node, uint32_t decl)> resolve) {
+  size_t remain = referenceBegin.back();
+  referenceBegin.pop_back();
+  for (size_t i = remain; i < references.size(); i++) {
+    uint32_t decl = NODECL;
+    // 同じ名前ならパラメタ、変数、定数の順に優先する
+    for (NameType type : { PARAM, VAR, CONST }) {
+      auto it = symbolIndex.find(key(references[i].first, type, -1));
+      if (it != symbolIndex.end() && it->second.back().first == cur_level) {
+        decl = it->second.back().second;
+        break;
+      }
+    }
+    if (decl == NODECL)
+      references[remain++] = references[i];
+    else
+      resolve(references[i].second, decl);
+  }
+  references.resize(remain);
 
-void SymTable::blockOut() {
   while (!symbolTable.empty() && symbolTable.back().level == cur_level) {
+    const SymInfo &e = symbolTable.back();
+    for (int num : { e.num, -1 }) {
+      auto it = symbolIndex.find(key(e.name, e.type, num));
+      it->second.pop_back();
+      if (it->second.empty())
+        symbolIndex.erase(it);
+      if (e.num == -1)
+        break;
+    }
     symbolTable.pop_back();
   }
   cur_level--;
 }
 
-bool SymTable::findSymbol(const std::string &name, const NameType &type, const bool &checkLevel, int num) const {
-  auto result = std::find_if(symbolTable.crbegin(), symbolTable.crend(),
-  [&](const SymInfo &e) {
-    auto cond = e.name == name && e.type == type;
-    if (num != -1) cond = cond && e.num == num;
-    if (checkLevel) cond = cond && e.level == cur_level;
-    return cond;
-  });
-  return result == symbolTable.crend() ? false : true;
+/**
+  * 名前を探す
+  * @param 名前, 種類, 今のレベルに限るか, 引数の数（-1なら問わない）
+  */
+bool SymTable::findSymbol(SymbolID name, const NameType &type, const bool &checkLevel, int num) const {
+  auto it = symbolIndex.find(key(name, type, num));
+  if (it == symbolIndex.end())
+    return false;
+  // レベルは昇順に積まれているので、今のレベルの宣言があれば末尾にある
+  return !checkLevel || it->second.back().first == cur_level;
 }
 
-void SymTable::deleteTemp(const std::string &name) {
-  auto it = std::find(tempNames.begin(), tempNames.end(), name);
-  if (it != tempNames.end())
-    tempNames.erase(it);
+/**
+  * 見えている宣言のうち最も内側のものを探す
+  * @param 名前, 種類, 引数の数（-1なら問わない）
+  * @return 宣言の番号（なければ NODECL）
+  */
+uint32_t SymTable::findDecl(SymbolID name, NameType type, int num) const {
+  auto it = symbolIndex.find(key(name, type, num));
+  return it == symbolIndex.end() ? NODECL : it->second.back().second;
 }
 
-bool SymTable::findTemp(const std::string &name) const{
-  auto it = std::find(tempNames.cbegin(), tempNames.cend(), name);
-  return it == tempNames.cend() ? false : true;
+void SymTable::deleteTemp(SymbolID name) {
+  auto it = tempNames.find(name);
+  if (it == tempNames.end())
+    return;
+  it->second.erase(it->second.begin());   // 最初に追加したものから消す
+  if (it->second.empty())
+    tempNames.erase(it);
 }
 
-void SymTable::dumpSymbolTable() const {
+void SymTable::dumpSymbolTable(const StringInterner &names) const {
   for (const SymInfo &e : symbolTable)
-    fprintf(stderr, "[%d] %-10s %s\n", e.level, e.name.c_str(), NameTypeStr(e.type).c_str());
-}
-
-void SymTable::dumpTempNames() const {
-  fprintf(stderr, "remain symbols:");
-  for (const std::string &name : tempNames)
-    fprintf(stderr, " %s", name.c_str());
-  fprintf(stderr, "\n");
-}
-
-const CodeInfo &CodeTable::find(const std::string &name) const {
-  auto itr =
-      std::find_if(infos.rbegin(), infos.rend(),
-                   [&](const CodeInfo &info) { return info.name == name; });
-  if (itr == infos.rend()) {
-    Log::error((name +" is undefined").c_str(), true);
-  }
-
-  return *itr;
-}
-
-void CodeTable::leaveBlock() {
-  while (!infos.empty() && infos.back().level == cur_level) {
-    infos.pop_back();
-  }
-  cur_level--;
+    fprintf(stderr, "[%d] %-10s %s\n", e.level, names.str(e.name).c_str(), NameTypeStr(e.type).c_str());
 }
 
-void CodeTable::dumpInfos() const {
-  for (const CodeInfo &info : infos)
-    fprintf(stderr, "[%d] %-10s %s\n", info.level, info.name.c_str(), NameTypeStr(info.type).c_str());
+void SymTable::dumpTempNames(const StringInterner &names) const {
+  std::vector<std::pair<unsigned, SymbolID>> temps;   // 追加順に並べる
+  for (auto &e : tempNames)
+    for (unsigned order : e.second)
+      temps.emplace_back(order, e.first);
+  std::sort(temps.begin(), temps.end());
+  std::string message = "remain symbols:";
+  for (auto &e : temps)
+    message += " " + names.str(e.second);
+  Log::note(message);
 }